@@ -2,298 +2,1155 @@
 // Author: Jeremy Campbell
 // This program will compress a file using 
 // the Huffman compression algorithm.
+#include "../../libhuffpuff/huffpuff.h"
+#include "../../libhuffpuff/stats.h"
+
 #include <iostream>
 #include <fstream>
 #include <algorithm>
-#include <ctime>
+#include <chrono>
 #include <iomanip>
-#include <stack>
 #include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <filesystem>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+
+// Regular input files are memory mapped where mmap is available
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#define HUFF_MMAP
+#define HUFF_PARTIAL_READS
+#endif
+
+// Standard input and output carry binary data
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 using namespace std;
+using namespace huffpuff;
 
-const short MAX_FILE_NAME = 80;
-const short MAX_HUFFMAN_TABLE = 513;
-const int END_OF_FILE = 256;
-const int MIN_HEAP_SIZE = 1;
-const int ROOT = 0;
-const int INVALID = -1;
-const int BYTE_SIZE = 8;
-const char* LEFT_HUFF_VALUE = "0";
-const char* RIGHT_HUFF_VALUE = "1";
 const string HUFF_EXT = "huf";
+const string STANDARD_STREAM = "-";
+
+// The input file is read through fixed size chunks, so memory use does
+// not grow with the size of the file.
+const int INPUT_CHUNK_SIZE = 1 << 20;
 
-struct HuffmanNode {
-	int glyph;
-	int frequency = 0;
-	int leftChildIndex = INVALID;
-	int rightChildIndex = INVALID;
-	string bitstring = "";
+// Each block is held in memory whole while it is coded, and -t and -j
+// start a thread for every one they are given
+const unsigned int MAX_BLOCK_SIZE = 1u << 30;
+const unsigned int MAX_THREADS = 1024;
+
+// The input file is memory mapped when it can be, so both passes read 
+// straight from the page cache. Pipes, devices, empty files and systems
+// without mmap read it through fin into buffer instead. Standard input is 
+// read into buffer whole and then treated like a mapped file.
+struct InputFile {
+	const unsigned char* mappedData = nullptr;
+	size_t mappedSize = 0;
+	size_t position = 0;
+	bool isMapped = false;
+	ifstream fin;
+	vector<unsigned char> buffer;
 };
 
-struct MinHuffmanNode {
-	int glyph;
-	int leftChildIndex = INVALID;
-	int rightChildIndex = INVALID;
+// Everything one thread needs to compress a file. It is kept from one file
+// to the next so a batch of files does not allocate its buffers each time.
+struct HuffWorkspace {
+	InputFile input;
+	BitWriter writer;
+	HuffEncoder encoder;
+	HuffStats stats;
 };
 
-// This function will sort the list in acending order with an exception: 
-// All nodes with a frequency of zero appear at the end of the list.  
-bool sortHuffmanTable(const HuffmanNode& node1, const HuffmanNode& node2) {
-	if (node1.frequency == 0)
-		return false;
-	if (node2.frequency == 0)
+// One file of a batch. STANDARD_STREAM stands for standard input or output.
+struct HuffJob {
+	string inFileName;
+	string outFileName;
+};
+
+struct HuffOptions {
+	bool writeCanonical = false;
+	unsigned int blockSize = 0;
+	unsigned int numThreads = thread::hardware_concurrency();
+	bool shareTree = false;
+	bool interleave = false;
+	bool writeStream = false;
+	bool adaptive = false;
+	bool contextModel = false;
+	bool runLengths = false;
+	int matchLevel = 0;
+	unsigned int windowSize = 0;
+	bool burrowsWheeler = false;
+	int maxCodeLength = MAX_CODE_LENGTH;
+	unsigned int numJobs = 1;
+	string outPath = "";
+	int statsFormat = STATS_OFF;
+};
+
+
+// Creates the name of the compressed file from the name of the input file
+string makeOutFileName(const string& inFileName) {
+	string outFileName = "";
+	size_t dotPos = inFileName.find_last_of(".");
+
+	if (dotPos == string::npos) {
+		// The inFileName does not contain a "."
+		outFileName = inFileName + "." + HUFF_EXT;
+	}
+	else {
+		// Replace all the characters after the "." with DMP_EXT
+		// This effectively creates a new string from the inFileName that 
+		// has the same "base" name but a dump file extension.
+		outFileName = inFileName.substr(0, dotPos + 1) + HUFF_EXT;
+	}
+
+	return outFileName;
+}
+
+bool openInputFile(const string& fileName, InputFile& input) {
+	if (fileName == STANDARD_STREAM) {
+		size_t size = 0;
+		do {
+			input.buffer.resize(size + INPUT_CHUNK_SIZE);
+			cin.read((char*)input.buffer.data() + size, INPUT_CHUNK_SIZE);
+			size += (size_t)cin.gcount();
+		} while (cin);
+		input.buffer.resize(size);
+		input.mappedData = input.buffer.data();
+		input.mappedSize = size;
+		return !cin.bad();
+	}
+
+#ifdef HUFF_MMAP
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if (fd >= 0) {
+		struct stat info;
+		if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+			void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data != MAP_FAILED) {
+				madvise(data, info.st_size, MADV_SEQUENTIAL);
+				input.mappedData = (const unsigned char*)data;
+				input.mappedSize = info.st_size;
+				input.isMapped = true;
+			}
+		}
+		close(fd);
+	}
+	if (input.mappedData)
 		return true;
+#endif
+	input.fin.open(fileName, ios::binary | ios::in);
+	return input.fin.is_open();
+}
 
-	return node1.frequency < node2.frequency;
+// Hands out the next chunk of at most maxSize bytes of the input file.
+// Returns false at the end of the file.
+bool readChunk(InputFile& input, size_t maxSize, const unsigned char*& data, size_t& size) {
+	if (input.mappedData) {
+		size = min(maxSize, input.mappedSize - input.position);
+		data = input.mappedData + input.position;
+		input.position += size;
+		return size > 0;
+	}
+
+	input.buffer.resize(maxSize);
+	input.fin.read((char*)input.buffer.data(), maxSize);
+	size = (size_t)input.fin.gcount();
+	data = input.buffer.data();
+	return size > 0;
 }
 
-int main() {
-	clock_t start, end;
-	char filename[MAX_FILE_NAME] = "test.txt";
-	cout << "File to compress: ";
-	cin >> filename;
+void rewindInputFile(InputFile& input) {
+	input.position = 0;
+	if (!input.mappedData) {
+		input.fin.clear();
+		input.fin.seekg(0, ios::beg);
+	}
+}
 
-	// START the clock
-	start = clock();
+// Closes the input file, leaving its buffer for the next file
+void closeInputFile(InputFile& input) {
+#ifdef HUFF_MMAP
+	if (input.isMapped)
+		munmap((void*)input.mappedData, input.mappedSize);
+#endif
+	input.mappedData = nullptr;
+	input.mappedSize = 0;
+	input.position = 0;
+	input.isMapped = false;
+	if (input.fin.is_open())
+		input.fin.close();
+	input.fin.clear();
+}
 
-#pragma region inputFileProcessing
-	// Assuming the file exists
-	ifstream fin(filename, ios::binary | ios::in | ios::ate);
+// Writes the stored format header and then the input file as it is, for
+// a file that coding would not make smaller
+void storeFile(InputFile& input, const string& storedName, unsigned long long fileSize, ostream& fout,
+		HuffStats& stats) {
+	startPhase(stats);
+	fout.write((char*)& CANONICAL_MAGIC, sizeof(unsigned int));
+	fout.write((char*)& STORED_FORMAT_VERSION, sizeof(unsigned char));
+	unsigned int fileNameSize = storedName.size();
+	fout.write((char*)& fileNameSize, sizeof(unsigned int));
+	fout.write((char*) storedName.c_str(), fileNameSize);
+	fout.write((char*)& fileSize, sizeof(unsigned long long));
+	endPhase(stats, "writeHeader");
 
-	// Assuming that the file is smaller than RAM
-	long long finSize = fin.tellg();
-	unsigned char* contents = new unsigned char[finSize];
-	fin.seekg(0, ios::beg);
-	fin.read((char*)contents, finSize);
+	startPhase(stats);
+	rewindInputFile(input);
+	const unsigned char* contents;
+	size_t chunkSize;
+	while (readChunk(input, INPUT_CHUNK_SIZE, contents, chunkSize))
+		fout.write((const char*)contents, chunkSize);
+	endPhase(stats, "store");
+}
 
-	fin.close();
+// Compresses inFileName into a single huffman coded stream in either the
+// original or the canonical format, or stores it as it is when that would
+// take no more room. storedName is the name written into the header.
+// Returns false if the file cannot be read or written.
+bool compressFile(const string& inFileName, const string& storedName, ostream& fout,
+		const HuffOptions& options, HuffWorkspace& workspace) {
+#pragma region inputFileProcessing
+	HuffStats& stats = workspace.stats;
+	startPhase(stats);
+	InputFile& input = workspace.input;
+	if (!openInputFile(inFileName, input)) {
+		closeInputFile(input);
+		return false;
+	}
 
-	// Find frequencies of all of the glyphs in the file
+	// Find frequencies of all of the glyphs in the file, reading it a chunk
+	// at a time. The file is read again when it is encoded.
 	HuffmanNode huffmanTable[MAX_HUFFMAN_TABLE];
 	MinHuffmanNode minHuffmanTable[MAX_HUFFMAN_TABLE];
+	const unsigned char* contents;
+	size_t chunkSize;
+	long long frequencies[NUM_SYMBOLS] = {};
+	long long finSize = 0;
+
+	while (readChunk(input, INPUT_CHUNK_SIZE, contents, chunkSize)) {
+		countGlyphs(contents, chunkSize, frequencies);
+		finSize += chunkSize;
+	}
 
-	for (int i = 0; i < finSize; i++) {
-		int index = (int)contents[i];
-		huffmanTable[index].frequency++;
-		huffmanTable[index].glyph = index;
+	for (int glyph = 0; glyph < NUM_BYTE_VALUES; glyph++) {
+		if (frequencies[glyph] > 0) {
+			huffmanTable[glyph].frequency = frequencies[glyph];
+		}
 	}
 
+	stats.bytesIn = finSize;
+	endPhase(stats, "countGlyphs");
 
 #pragma endregion inputFileProcessing
 
 #pragma region huffmanAlgorithm
+	startPhase(stats);
 	// Add EOF byte
-	huffmanTable[END_OF_FILE].frequency++;
-	huffmanTable[END_OF_FILE].glyph = END_OF_FILE;
+	frequencies[END_OF_FILE]++;
+	huffmanTable[END_OF_FILE].frequency = frequencies[END_OF_FILE];
 
-	sort(huffmanTable, huffmanTable + MAX_HUFFMAN_TABLE, sortHuffmanTable);
+	int nextFreeSlot = buildHuffmanTree(huffmanTable, minHuffmanTable);
+	endPhase(stats, "buildTree");
 
-	int numGlyphs = 0;
-	for (int i = 0; i < MAX_HUFFMAN_TABLE; i++) {
-		if (huffmanTable[i].frequency == 0) {
-			numGlyphs = i;
-			break;
+#pragma endregion huffmanAlgorithm
+
+#pragma region buildCodes
+	startPhase(stats);
+	HuffmanCode codes[NUM_SYMBOLS];
+	int codeLengths[NUM_SYMBOLS];
+	fill(codeLengths, codeLengths + NUM_SYMBOLS, NO_CODE);
+	
+	long long numBitsWhenCompressed = buildCodes(huffmanTable, nextFreeSlot, codes, codeLengths);
+
+	// Limited code lengths are always given canonical codes, and in the 
+	// original format the tree of those codes is written instead
+	bool limitCodes = *max_element(codeLengths, codeLengths + NUM_SYMBOLS) > options.maxCodeLength;
+	if (limitCodes)
+		numBitsWhenCompressed = limitCodeLengths(frequencies, codeLengths, options.maxCodeLength);
+
+	if (options.writeCanonical || limitCodes)
+		buildCanonicalCodes(codeLengths, codes);
+
+	if (limitCodes && !options.writeCanonical) {
+		tableNode canonicalTable[MAX_HUFFMAN_TABLE];
+		nextFreeSlot = buildTableFromCodeLengths(codeLengths, canonicalTable);
+		for (int i = 0; i < nextFreeSlot; i++) {
+			minHuffmanTable[i].glyph = canonicalTable[i].glyph;
+			minHuffmanTable[i].leftChildIndex = canonicalTable[i].leftChild;
+			minHuffmanTable[i].rightChildIndex = canonicalTable[i].rightChild;
 		}
 	}
 
-	// Huffman Algorithm
-	int endOfHeap = numGlyphs - 1;
-	int nextFreeSlot = numGlyphs;
-	int marked;
-	int currentElementIndex;
-	int leftChildIndex;
-	int rightChildIndex;
-	int currentFrequency;
-	bool didReheap;
-	for (int i = 0; i < numGlyphs - 1; i++) {
-		// Mark whichever of the root's children have the lowest frequency
-		marked = (endOfHeap <= MIN_HEAP_SIZE || huffmanTable[1].frequency <= huffmanTable[2].frequency) ? 1 : 2;
-		huffmanTable[nextFreeSlot] = huffmanTable[marked];
-
-		// Move last node in tree heap to marked slot
-		huffmanTable[marked] = huffmanTable[endOfHeap];
-		if (marked < endOfHeap) {
-
-			currentElementIndex = marked;
-			currentFrequency = huffmanTable[marked].frequency;
-			didReheap = false;
-
-			while (!didReheap) {
-				leftChildIndex = (2 * currentElementIndex) + 1;
-				rightChildIndex = (2 * currentElementIndex) + 2;
-
-				if (rightChildIndex < endOfHeap && 
-						huffmanTable[rightChildIndex].frequency < huffmanTable[leftChildIndex].frequency && 
-						currentFrequency > huffmanTable[rightChildIndex].frequency) {
-					swap(huffmanTable[rightChildIndex], huffmanTable[currentElementIndex]);
-					currentElementIndex = rightChildIndex;
-				}
-				else if (leftChildIndex < endOfHeap && currentFrequency > huffmanTable[leftChildIndex].frequency) {
-					swap(huffmanTable[leftChildIndex], huffmanTable[currentElementIndex]);
-					currentElementIndex = leftChildIndex;
-				}
-				else {
-					didReheap = true;
-				}
+	// Tiny files and ones that are compressed already come out larger
+	// once the tree is added, so they are stored instead
+	unsigned long long headerSize = sizeof(unsigned int) + storedName.size();
+	unsigned long long codedSize = headerSize + (numBitsWhenCompressed + BYTE_SIZE - 1) / BYTE_SIZE;
+	if (options.writeCanonical)
+		codedSize += sizeof(CANONICAL_MAGIC) + sizeof(CANONICAL_FORMAT_VERSION) + packedCodeLengthsSize(codeLengths);
+	else
+		codedSize += sizeof(int) + sizeof(MinHuffmanNode) * nextFreeSlot;
+	unsigned long long storedSize = sizeof(CANONICAL_MAGIC) + sizeof(STORED_FORMAT_VERSION) + headerSize +
+		sizeof(unsigned long long) + finSize;
+	bool storeContents = storedSize <= codedSize;
+
+	if (!storeContents)
+		countCodeLengths(stats, frequencies, codeLengths);
+	endPhase(stats, "buildCodes");
+
+#pragma endregion buildCodes
+
+	if (storeContents) {
+		storeFile(input, storedName, finSize, fout, stats);
+		closeInputFile(input);
+		fout.flush();
+		return fout.good();
+	}
+
+#pragma region outputFileProcessing
+	startPhase(stats);
+	if (options.writeCanonical) {
+		fout.write((char*)& CANONICAL_MAGIC, sizeof(unsigned int));
+		fout.write((char*)& CANONICAL_FORMAT_VERSION, sizeof(unsigned char));
+	}
+
+	// Output name of file
+	unsigned int fileNameSize = storedName.size();
+	fout.write((char*)& fileNameSize, sizeof(unsigned int));
+	fout.write((char*) storedName.c_str(), fileNameSize);
+
+	// Output huffman tree, or only its code lengths in the canonical format
+	if (options.writeCanonical) {
+		vector<unsigned char> packedCodeLengths = packCodeLengths(codeLengths);
+		fout.write((char*)packedCodeLengths.data(), packedCodeLengths.size());
+	}
+	else {
+		fout.write((char*)& nextFreeSlot, sizeof(int));
+		fout.write((char*) minHuffmanTable, sizeof(MinHuffmanNode) * nextFreeSlot);
+	}
+	endPhase(stats, "writeHeader");
+
+	// Output compressed data, reading the input file a second time
+	startPhase(stats);
+	rewindInputFile(input);
+	BitWriter& writer = workspace.writer;
+	writer.fout = &fout;
+
+	while (readChunk(input, INPUT_CHUNK_SIZE, contents, chunkSize)) {
+		for (size_t i = 0; i < chunkSize; i++)
+			writeCode(writer, codes[contents[i]]);
+	}
+
+	writeCode(writer, codes[END_OF_FILE]);
+	flushBits(writer);
+
+	closeInputFile(input);
+	fout.flush();
+	endPhase(stats, "encode");
+	return fout.good();
+
+#pragma endregion outputFileProcessing
+}
+
+// The bits of the codes built for frequencies plus those of their stored
+// code lengths
+long long treeCost(const long long frequencies[], int codeLengths[], int maxCodeLength) {
+	long long numBits = buildCodeLengths(frequencies, codeLengths, maxCodeLength);
+	return numBits + BYTE_SIZE * (long long)packedCodeLengthsSize(codeLengths);
+}
+
+// Splits the blocks into runs that are all coded with one tree, built from
+// the glyphs of the whole run and stored by its first block. A block joins
+// the run before it as long as the run's tree then costs no more than the
+// run and the block coded with trees of their own, so runs break where the
+// glyphs of the file shift. Leaves the code lengths of each run in its first
+// block and how far back its first block is in every other block.
+void chooseBlockTrees(const vector<vector<long long>>& blockFrequencies, int maxCodeLength,
+		vector<vector<int>>& blockCodeLengths, vector<unsigned int>& treeDistances) {
+	vector<long long> runFrequencies(NUM_SYMBOLS), mergedFrequencies(NUM_SYMBOLS);
+	vector<int> mergedCodeLengths(NUM_SYMBOLS);
+	long long runCost = 0;
+	size_t runStart = 0;
+
+	for (size_t block = 0; block < blockFrequencies.size(); block++) {
+		const vector<long long>& frequencies = blockFrequencies[block];
+		blockCodeLengths[block].resize(NUM_SYMBOLS);
+		long long ownCost = treeCost(frequencies.data(), blockCodeLengths[block].data(), maxCodeLength);
+
+		if (block > 0) {
+			for (int glyph = 0; glyph < NUM_SYMBOLS; glyph++)
+				mergedFrequencies[glyph] = runFrequencies[glyph] + frequencies[glyph];
+			long long mergedCost = treeCost(mergedFrequencies.data(), mergedCodeLengths.data(), maxCodeLength);
+			if (mergedCost <= runCost + ownCost) {
+				runFrequencies.swap(mergedFrequencies);
+				blockCodeLengths[runStart].swap(mergedCodeLengths);
+				vector<int>().swap(blockCodeLengths[block]);
+				treeDistances[block] = (unsigned int)(block - runStart);
+				runCost = mergedCost;
+				continue;
 			}
 		}
 
-		// Move root node to endOfHeap
-		huffmanTable[endOfHeap] = huffmanTable[0];
-
-		// Possibly speed this up with a reference to the root
-		huffmanTable[0].glyph = -1;
-		huffmanTable[0].frequency = huffmanTable[endOfHeap].frequency + huffmanTable[nextFreeSlot].frequency;
-
-		currentElementIndex = 0;
-		currentFrequency = huffmanTable[0].frequency;
-		didReheap = false;
-
-		if (marked < endOfHeap) {
-			while (!didReheap) {
-				leftChildIndex = (2 * currentElementIndex) + 1;
-				rightChildIndex = (2 * currentElementIndex) + 2;
-
-				if (rightChildIndex < endOfHeap &&
-					huffmanTable[rightChildIndex].frequency < huffmanTable[leftChildIndex].frequency &&
-					currentFrequency > huffmanTable[rightChildIndex].frequency) {
-					swap(huffmanTable[rightChildIndex], huffmanTable[currentElementIndex]);
-					currentElementIndex = rightChildIndex;
-				}
-				else if (leftChildIndex < endOfHeap && currentFrequency > huffmanTable[leftChildIndex].frequency) {
-					swap(huffmanTable[leftChildIndex], huffmanTable[currentElementIndex]);
-					currentElementIndex = leftChildIndex;
-				}
-				else {
-					didReheap = true;
-				}
+		runStart = block;
+		runFrequencies = frequencies;
+		runCost = ownCost;
+	}
+}
+
+// Compresses inFileName as a series of independently coded blocks. The 
+// first pass counts the glyphs of every block, which gives the exact size
+// of each compressed block, so the block index is written up front. The 
+// blocks are then encoded by a pool of worker threads and written in order.
+// Blocks that coding would not make smaller are stored as they are.
+bool compressBlocks(const string& inFileName, const string& storedName, ostream& fout,
+		const HuffOptions& options, HuffWorkspace& workspace) {
+	HuffStats& stats = workspace.stats;
+	startPhase(stats);
+	InputFile& input = workspace.input;
+	if (!openInputFile(inFileName, input)) {
+		closeInputFile(input);
+		return false;
+	}
+
+	// Count the glyphs of every block and of the whole file. Interleaved
+	// blocks also count each segment, which gives the size of its stream.
+	// Context modelled and run length blocks get their whole model built
+	// instead.
+	vector<BlockIndexEntry> blockIndex;
+	vector<vector<long long>> blockFrequencies;
+	vector<vector<long long>> segmentFrequencies;
+	vector<ContextModel> contextModels;
+	vector<RunLengthModel> runLengthModels;
+	long long fileFrequencies[NUM_SYMBOLS] = {};
+	const unsigned char* contents;
+	size_t chunkSize;
+	unsigned char flags = (options.shareTree ? SHARED_TREE : REUSED_TREES) | (options.interleave ? INTERLEAVED_STREAMS : 0);
+	if (options.contextModel)
+		flags = CONTEXT_MODEL;
+	else if (options.runLengths)
+		flags = RUN_LENGTHS;
+	else if (options.matchLevel > 0)
+		flags = MATCHES;
+	else if (options.burrowsWheeler)
+		flags = BURROWS_WHEELER;
+	bool sizeAfterEncoding = options.matchLevel > 0 || options.burrowsWheeler;
+	int numStreams = options.interleave ? NUM_STREAMS : 1;
+
+	while (readChunk(input, options.blockSize, contents, chunkSize)) {
+		BlockIndexEntry indexEntry;
+		indexEntry.originalSize = (unsigned int)chunkSize;
+		blockIndex.push_back(indexEntry);
+		stats.bytesIn += chunkSize;
+		if (options.contextModel) {
+			contextModels.emplace_back();
+			buildContextModel(contents, chunkSize, min(options.maxCodeLength, MAX_SYMBOL_CODE_LENGTH), contextModels.back());
+			continue;
+		}
+		if (options.runLengths) {
+			runLengthModels.emplace_back();
+			buildRunLengthModel(contents, chunkSize, min(options.maxCodeLength, MAX_SYMBOL_CODE_LENGTH), runLengthModels.back());
+			continue;
+		}
+		// Finding the matches or sorting the block is most of the work, so
+		// it is left to the workers and the sizes of match and transform
+		// blocks are only known once they are encoded
+		if (sizeAfterEncoding)
+			continue;
+
+		vector<long long> frequencies(NUM_SYMBOLS, 0);
+		if (options.interleave) {
+			segmentFrequencies.emplace_back(NUM_STREAMS * NUM_SYMBOLS);
+			countSegmentGlyphs(contents, indexEntry.originalSize, segmentFrequencies.back().data());
+			for (int stream = 0; stream < NUM_STREAMS; stream++) {
+				for (int glyph = 0; glyph < NUM_BYTE_VALUES; glyph++)
+					frequencies[glyph] += segmentFrequencies.back()[stream * NUM_SYMBOLS + glyph];
 			}
 		}
+		else
+			countGlyphs(contents, indexEntry.originalSize, frequencies.data());
+		for (int glyph = 0; glyph < NUM_BYTE_VALUES; glyph++)
+			fileFrequencies[glyph] += frequencies[glyph];
+		// Every block, or every stream of it, ends with its own EOF
+		frequencies[END_OF_FILE] = numStreams;
+		blockFrequencies.push_back(frequencies);
+	}
+	endPhase(stats, "countGlyphs");
+
+	size_t blockCount = blockIndex.size();
+	fileFrequencies[END_OF_FILE] = max(blockCount, (size_t)1) * numStreams;
 
-		// Possibly speed this up with a reference to the root
-		huffmanTable[currentElementIndex].leftChildIndex = endOfHeap;
-		huffmanTable[currentElementIndex].rightChildIndex = nextFreeSlot;
-		
-		nextFreeSlot++;
-		endOfHeap--;
+	// Build the trees of runs of blocks, or one tree for the whole file,
+	// and work out where each block will land in the output file
+	startPhase(stats);
+	int fileCodeLengths[NUM_SYMBOLS];
+	vector<vector<int>> blockCodeLengths(options.shareTree ? 0 : blockFrequencies.size());
+	vector<unsigned int> treeDistances(blockCount, 0);
+	if (options.shareTree)
+		buildCodeLengths(fileFrequencies, fileCodeLengths, options.maxCodeLength);
+	else
+		chooseBlockTrees(blockFrequencies, options.maxCodeLength, blockCodeLengths, treeDistances);
+
+	// The blocks that later blocks take their code lengths from
+	vector<bool> treeSources(blockCount, false);
+	for (size_t block = 0; block < blockCount; block++) {
+		if (treeDistances[block] > 0)
+			treeSources[block - treeDistances[block]] = true;
 	}
 
-	// Copy data into minHuffmanTable
-	for (int i = 0; i < nextFreeSlot; i++) {
-		minHuffmanTable[i].glyph = huffmanTable[i].glyph;
-		minHuffmanTable[i].leftChildIndex = huffmanTable[i].leftChildIndex;
-		minHuffmanTable[i].rightChildIndex = huffmanTable[i].rightChildIndex;
+	unsigned long long offset = 0;
+	for (size_t block = 0; block < blockCount; block++) {
+		BlockIndexEntry& indexEntry = blockIndex[block];
+		indexEntry.offset = offset;
+		if (sizeAfterEncoding)
+			continue;
+
+		const int* codeLengths = fileCodeLengths;
+		if (options.contextModel)
+			indexEntry.compressedSize = (unsigned int)contextModels[block].encodedSize;
+		else if (options.runLengths)
+			indexEntry.compressedSize = (unsigned int)runLengthModels[block].encodedSize;
+		else {
+			const long long* frequencies = options.interleave ? segmentFrequencies[block].data() : blockFrequencies[block].data();
+			if (!options.shareTree)
+				codeLengths = blockCodeLengths[block - treeDistances[block]].data();
+			indexEntry.compressedSize = (unsigned int)encodedBlockSize(frequencies, codeLengths, flags, treeDistances[block]);
+		}
+
+		// A block that coding would not make smaller is stored as it is,
+		// unless later blocks need the code lengths it stores. Those are
+		// padded by a byte if they would pass for a stored block.
+		bool stored = indexEntry.compressedSize >= indexEntry.originalSize && !treeSources[block];
+		if (stored) {
+			indexEntry.compressedSize = indexEntry.originalSize;
+			flags |= STORED_BLOCKS;
+		}
+		else if (indexEntry.compressedSize == indexEntry.originalSize)
+			indexEntry.compressedSize++;
+		offset += indexEntry.compressedSize;
+
+		if (options.contextModel) {
+			ContextModel& model = contextModels[block];
+			for (int cluster = 0; cluster < model.numClusters && !stored; cluster++)
+				countCodeLengths(stats, &model.frequencies[cluster * NUM_SYMBOLS], &model.codeLengths[cluster * NUM_SYMBOLS]);
+			vector<long long>().swap(model.frequencies);
+			if (stored)
+				vector<int>().swap(model.codeLengths);
+		}
+		else if (options.runLengths) {
+			if (!stored)
+				countCodeLengths(stats, runLengthModels[block].frequencies, runLengthModels[block].codeLengths);
+		}
+		else {
+			if (!stored)
+				countCodeLengths(stats, blockFrequencies[block].data(), codeLengths);
+			vector<long long>().swap(blockFrequencies[block]);
+			if (options.interleave)
+				vector<long long>().swap(segmentFrequencies[block]);
+		}
 	}
 
-#pragma endregion huffmanAlgorithm
+	// Match and transform blocks are only stored once they turn out no
+	// smaller encoded, after the flags are written
+	if (sizeAfterEncoding)
+		flags |= STORED_BLOCKS;
+	endPhase(stats, "buildCodes");
 
-#pragma region buildBitstrings
-	string bitstrings[MAX_HUFFMAN_TABLE / 2 + 1];
-	
-	// Post-order traversal
-	stack<HuffmanNode> nodeStack;
-	HuffmanNode current = huffmanTable[ROOT];
-	long long numBitsWhenCompressed = 0;
-	
-	nodeStack.push(current);
+	// Output the header and the block index
+	startPhase(stats);
+	fout.write((char*)& CANONICAL_MAGIC, sizeof(unsigned int));
+	fout.write((char*)& BLOCK_FORMAT_VERSION, sizeof(unsigned char));
 
-	while (!nodeStack.empty()) {
-		current = nodeStack.top();
-		nodeStack.pop();
+	unsigned int fileNameSize = storedName.size();
+	fout.write((char*)& fileNameSize, sizeof(unsigned int));
+	fout.write((char*) storedName.c_str(), fileNameSize);
 
-		// Found a leaf
-		if (current.glyph != INVALID) {
-			bitstrings[current.glyph] = current.bitstring;
-			numBitsWhenCompressed += current.bitstring.size() * current.frequency;
-			continue;
+	unsigned int numBlocks = blockCount;
+	fout.write((char*)& numBlocks, sizeof(unsigned int));
+	fout.write((char*)& flags, sizeof(unsigned char));
+	if (options.shareTree) {
+		vector<unsigned char> packedCodeLengths = packCodeLengths(fileCodeLengths);
+		fout.write((char*)packedCodeLengths.data(), packedCodeLengths.size());
+	}
+
+	// The index of match and transform blocks is filled in as they are
+	// written and then written again over the first one. Output that cannot
+	// seek back, such as a pipe, keeps the blocks in memory until the index
+	// has gone first.
+	streampos indexPosition = fout.tellp();
+	bool holdBlocks = sizeAfterEncoding && indexPosition == streampos(-1);
+	vector<char> heldBlocks;
+	if (!holdBlocks)
+		fout.write((char*)blockIndex.data(), sizeof(BlockIndexEntry) * blockCount);
+	endPhase(stats, "writeHeader");
+
+	// Encode the blocks on the worker threads. Workers stay at most a few 
+	// blocks ahead of the writer so memory use does not grow with the file.
+	startPhase(stats);
+	vector<vector<char>> encodedBlocks(blockCount);
+	vector<bool> blockReady(blockCount, false);
+	size_t nextBlock = 0;
+	size_t blocksWritten = 0;
+	unsigned int numThreads = max(1u, min(options.numThreads, numBlocks));
+	size_t maxBlocksAhead = 2 * numThreads;
+	mutex blockMutex;
+	condition_variable blockChanged;
+
+	auto encodeBlocks = [&]() {
+		// Without a memory mapped file every worker reads its own blocks
+		ifstream blockIn;
+		vector<unsigned char> blockContents;
+		MatchModel matchModel;
+		TransformModel transformModel;
+		if (!input.mappedData)
+			blockIn.open(inFileName, ios::binary | ios::in);
+
+		while (true) {
+			unique_lock<mutex> lock(blockMutex);
+			blockChanged.wait(lock, [&] { return nextBlock == blockCount || nextBlock < blocksWritten + maxBlocksAhead; });
+			if (nextBlock == blockCount)
+				return;
+			size_t block = nextBlock++;
+			lock.unlock();
+
+			const unsigned char* blockData;
+			size_t blockStart = block * (size_t)options.blockSize;
+			if (input.mappedData)
+				blockData = input.mappedData + blockStart;
+			else {
+				blockContents.resize(blockIndex[block].originalSize);
+				blockIn.seekg(blockStart, ios::beg);
+				blockIn.read((char*)blockContents.data(), blockContents.size());
+				blockData = blockContents.data();
+			}
+
+			vector<char> encodedBlock;
+			if (!sizeAfterEncoding && isStoredBlock(blockIndex[block].compressedSize, blockIndex[block].originalSize, flags))
+				encodedBlock.assign(blockData, blockData + blockIndex[block].originalSize);
+			else if (options.contextModel) {
+				encodedBlock.resize(blockIndex[block].compressedSize);
+				encodeContextBlock(blockData, blockIndex[block].originalSize, contextModels[block], encodedBlock.data());
+				vector<int>().swap(contextModels[block].codeLengths);
+			}
+			else if (options.runLengths) {
+				encodedBlock.resize(blockIndex[block].compressedSize);
+				encodeRunLengthBlock(blockData, blockIndex[block].originalSize, runLengthModels[block], encodedBlock.data());
+			}
+			else if (options.matchLevel > 0) {
+				buildMatchModel(blockData, blockIndex[block].originalSize, options.matchLevel, options.windowSize,
+					min(options.maxCodeLength, MAX_SYMBOL_CODE_LENGTH), matchModel);
+				encodedBlock.resize(matchModel.encodedSize);
+				encodeMatchBlock(blockData, matchModel, encodedBlock.data());
+			}
+			else if (options.burrowsWheeler) {
+				buildTransformModel(blockData, blockIndex[block].originalSize, min(options.maxCodeLength, MAX_SYMBOL_CODE_LENGTH),
+					transformModel);
+				encodedBlock.resize(transformModel.encodedSize);
+				encodeTransformBlock(transformModel, encodedBlock.data());
+			}
+			else {
+				const int* codeLengths = fileCodeLengths;
+				if (!options.shareTree)
+					codeLengths = blockCodeLengths[block - treeDistances[block]].data();
+				encodedBlock = encodeBlock(blockData, blockIndex[block], codeLengths, flags, treeDistances[block]);
+			}
+			if (sizeAfterEncoding && encodedBlock.size() >= blockIndex[block].originalSize)
+				encodedBlock.assign(blockData, blockData + blockIndex[block].originalSize);
+
+			lock.lock();
+			encodedBlocks[block].swap(encodedBlock);
+			blockReady[block] = true;
+			blockChanged.notify_all();
 		}
-		
-		if (current.leftChildIndex != INVALID) {
-			huffmanTable[current.leftChildIndex].bitstring = current.bitstring + LEFT_HUFF_VALUE;
-			nodeStack.push(huffmanTable[current.leftChildIndex]);
+	};
+
+	vector<thread> workers;
+	for (unsigned int i = 0; i < numThreads; i++)
+		workers.emplace_back(encodeBlocks);
+
+	for (size_t block = 0; block < blockCount; block++) {
+		vector<char> encodedBlock;
+		unique_lock<mutex> lock(blockMutex);
+		blockChanged.wait(lock, [&] { return blockReady[block]; });
+		encodedBlock.swap(encodedBlocks[block]);
+		lock.unlock();
+
+		if (sizeAfterEncoding) {
+			if (block > 0)
+				blockIndex[block].offset = blockIndex[block - 1].offset + blockIndex[block - 1].compressedSize;
+			blockIndex[block].compressedSize = (unsigned int)encodedBlock.size();
 		}
+		if (holdBlocks)
+			heldBlocks.insert(heldBlocks.end(), encodedBlock.begin(), encodedBlock.end());
+		else
+			fout.write(encodedBlock.data(), encodedBlock.size());
+
+		lock.lock();
+		blocksWritten++;
+		blockChanged.notify_all();
+	}
 
-		if (current.rightChildIndex != INVALID) {
-			huffmanTable[current.rightChildIndex].bitstring = current.bitstring + RIGHT_HUFF_VALUE;
-			nodeStack.push(huffmanTable[current.rightChildIndex]);
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+
+	if (holdBlocks) {
+		fout.write((char*)blockIndex.data(), sizeof(BlockIndexEntry) * blockCount);
+		fout.write(heldBlocks.data(), heldBlocks.size());
+	}
+	else if (sizeAfterEncoding) {
+		streampos endPosition = fout.tellp();
+		fout.seekp(indexPosition);
+		fout.write((char*)blockIndex.data(), sizeof(BlockIndexEntry) * blockCount);
+		fout.seekp(endPosition);
+	}
+
+	closeInputFile(input);
+	fout.flush();
+	endWorkerPhase(stats, "encodeBlocks");
+	return fout.good();
+}
+
+// Reads up to size bytes of standard input. Where it can, it returns
+// whatever has arrived instead of waiting for all size bytes, so a slow 
+// pipe is compressed as it comes. Returns 0 at the end of the input or on 
+// an error, which sets failed.
+size_t readStandardInput(unsigned char* buffer, size_t size, bool& failed) {
+#ifdef HUFF_PARTIAL_READS
+	while (true) {
+		ssize_t count = read(STDIN_FILENO, buffer, size);
+		if (count >= 0)
+			return (size_t)count;
+		if (errno != EINTR) {
+			failed = true;
+			return 0;
 		}
 	}
+#else
+	cin.read((char*)buffer, size);
+	failed = cin.bad();
+	return (size_t)cin.gcount();
+#endif
+}
 
-	long long numBytesWhenCompressed = ceil((double)numBitsWhenCompressed / (double)BYTE_SIZE);
-#pragma endregion buildBitstrings
+// Compresses inFileName in a single pass into the stream format, or the
+// adaptive format with -a, using the library's streaming encoder. Standard
+// input is read a chunk at a time instead of all at once, so any amount of
+// it can be piped through, and what has been compressed of it is written
+// out after every chunk.
+bool compressStream(const string& inFileName, const string& storedName, ostream& fout,
+		const HuffOptions& options, HuffWorkspace& workspace) {
+	HuffStats& stats = workspace.stats;
+	startPhase(stats);
+	InputFile& input = workspace.input;
+	bool fromStandardInput = inFileName == STANDARD_STREAM;
+	if (!fromStandardInput && !openInputFile(inFileName, input)) {
+		closeInputFile(input);
+		return false;
+	}
 
-#pragma region outputFileProcessing
-	// Create outFileName
-	string inFileName = filename;
-	string outFileName = "";
-	size_t dotPos = inFileName.find_last_of(".");
+	HuffEncoder& encoder = workspace.encoder;
+	if (options.adaptive)
+		initAdaptiveEncoder(encoder, storedName, options.blockSize > 0 ? options.blockSize : DEFAULT_REBUILD_INTERVAL,
+			options.maxCodeLength);
+	else
+		initEncoder(encoder, storedName, options.blockSize > 0 ? options.blockSize : DEFAULT_STREAM_BLOCK_SIZE,
+			options.maxCodeLength);
+	if (workspace.writer.outBuffer.empty())
+		workspace.writer.outBuffer.resize(OUTPUT_BUFFER_SIZE);
+	unsigned char* outBuffer = (unsigned char*)workspace.writer.outBuffer.data();
+	size_t outBufferSize = workspace.writer.outBuffer.size();
+	const unsigned char* contents;
+	size_t chunkSize;
+	HuffStatus status;
+	bool readFailed = false;
 
-	if (dotPos == string::npos) {
-		// The inFileName does not contain a "."
-		outFileName = inFileName + "." + HUFF_EXT;
+	while (true) {
+		if (fromStandardInput) {
+			input.buffer.resize(INPUT_CHUNK_SIZE);
+			chunkSize = readStandardInput(input.buffer.data(), INPUT_CHUNK_SIZE, readFailed);
+			contents = input.buffer.data();
+			if (chunkSize == 0)
+				break;
+		}
+		else if (!readChunk(input, INPUT_CHUNK_SIZE, contents, chunkSize))
+			break;
+		stats.bytesIn += chunkSize;
+
+		do {
+			unsigned char* out = outBuffer;
+			size_t outSize = outBufferSize;
+			status = feedEncoder(encoder, contents, chunkSize, out, outSize);
+			fout.write((char*)outBuffer, out - outBuffer);
+		} while (status == HUFF_OUTPUT_FULL);
+
+		if (fromStandardInput)
+			fout.flush();
 	}
-	else {
-		// Replace all the characters after the "." with DMP_EXT
-		// This effectively creates a new string from the inFileName that 
-		// has the same "base" name but a dump file extension.
-		outFileName = inFileName.substr(0, dotPos + 1) + HUFF_EXT;
+
+	do {
+		unsigned char* out = outBuffer;
+		size_t outSize = outBufferSize;
+		status = finishEncoder(encoder, out, outSize);
+		fout.write((char*)outBuffer, out - outBuffer);
+	} while (status == HUFF_OUTPUT_FULL);
+
+	closeInputFile(input);
+	fout.flush();
+	endPhase(stats, "encodeStream");
+	return fout.good() && !readFailed;
+}
+
+// Reads the number given to option, which has to be written in decimal
+// digits and be from minValue to maxValue. Says what is wrong if it is not.
+bool readNumber(const string& option, const char* text, unsigned long minValue, unsigned long maxValue,
+		unsigned long& value) {
+	char* end = nullptr;
+	value = isdigit((unsigned char)text[0]) ? strtoul(text, &end, 10) : 0;
+	if (!end || *end != '\0' || value < minValue || value > maxValue) {
+		cerr << option << " needs a number from " << minValue << " to " << maxValue << endl;
+		return false;
 	}
+	return true;
+}
 
-	string outContents(numBytesWhenCompressed, '\0');
-	char currentOutByte = '\0';
-	short bitCount = 0;
-	long long currentOutByteIndex = 0;
+// Reads the command line:
+//   -c        write the canonical format when the file is coded as one stream
+//   -b <KB>   split the file into independently coded blocks of this size,
+//             with runs of similar blocks sharing a tree
+//   -t <n>    number of threads used to encode blocks
+//   -g        share one tree between all of the blocks
+//   -i        code each block as interleaved streams that decode in parallel
+//   -s        write the stream format in a single pass, in blocks of -b KB
+//   -a        code adaptively in a single pass, rebuilding the codes at least every -b KB
+//   -x        code each byte with a code picked by the byte before it, in blocks of -b KB
+//   -r        code runs of the same byte as a run length, in blocks of -b KB
+//   -z <1-9>  code matches with earlier bytes LZ77 style, trying harder at higher levels
+//   -w <KB>   how far back -z looks for matches, a power of two no larger than -b
+//   -m        code the Burrows-Wheeler transform of each block move to front, in blocks of -b KB
+//   -l <bits> longest code allowed, from 9 to 64 bits
+//   -j <n>    number of files compressed at the same time
+//   -o <path> output file, or directory when there are several inputs
+//   --stats[=text|json] print the time spent in each phase and the codes of each file
+// Everything else is a file or directory to compress, or - for standard input.
+bool parseOptions(int argc, char* argv[], HuffOptions& options, vector<string>& inFileNames) {
+	unsigned long value;
+	bool threadsGiven = false;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "-c")
+			options.writeCanonical = true;
+		else if (arg == "-g")
+			options.shareTree = true;
+		else if (arg == "-i")
+			options.interleave = true;
+		else if (arg == "-s")
+			options.writeStream = true;
+		else if (arg == "-a")
+			options.adaptive = true;
+		else if (arg == "-x")
+			options.contextModel = true;
+		else if (arg == "-r")
+			options.runLengths = true;
+		else if (arg == "-z" && i + 1 < argc) {
+			if (!readNumber(arg, argv[++i], MIN_MATCH_LEVEL, MAX_MATCH_LEVEL, value))
+				return false;
+			options.matchLevel = (int)value;
+		}
+		else if (arg == "-m")
+			options.burrowsWheeler = true;
+		else if (arg == "-w" && i + 1 < argc) {
+			if (!readNumber(arg, argv[++i], MIN_WINDOW_SIZE / KILOBYTE, MAX_WINDOW_SIZE / KILOBYTE, value))
+				return false;
+			options.windowSize = (unsigned int)value * KILOBYTE;
+		}
+		else if (arg == "-b" && i + 1 < argc) {
+			if (!readNumber(arg, argv[++i], 1, MAX_BLOCK_SIZE / KILOBYTE, value))
+				return false;
+			options.blockSize = (unsigned int)value * KILOBYTE;
+		}
+		else if (arg == "-l" && i + 1 < argc) {
+			if (!readNumber(arg, argv[++i], MIN_CODE_LENGTH_LIMIT, MAX_CODE_LENGTH, value))
+				return false;
+			options.maxCodeLength = (int)value;
+		}
+		else if (arg == "-t" && i + 1 < argc) {
+			if (!readNumber(arg, argv[++i], 1, MAX_THREADS, value))
+				return false;
+			options.numThreads = (unsigned int)value;
+			threadsGiven = true;
+		}
+		else if (arg == "-j" && i + 1 < argc) {
+			if (!readNumber(arg, argv[++i], 1, MAX_THREADS, value))
+				return false;
+			options.numJobs = (unsigned int)value;
+		}
+		else if (arg == "-o" && i + 1 < argc)
+			options.outPath = argv[++i];
+		else if (arg == "--stats" || arg == "--stats=text")
+			options.statsFormat = STATS_TEXT;
+		else if (arg == "--stats=json")
+			options.statsFormat = STATS_JSON;
+		else if (arg.size() > 1 && arg[0] == '-') {
+			cerr << "Unknown option " << arg << endl;
+			return false;
+		}
+		else
+			inFileNames.push_back(arg);
+	}
 
-	for (int i = 0; i <= finSize; i++) {
-		const string& currentBitString = (i != finSize) ? bitstrings[contents[i]] : bitstrings[END_OF_FILE];
+	// Options that would be ignored in the chosen format are refused
+	// rather than quietly doing nothing.
+	if (options.writeCanonical && (options.blockSize > 0 || options.writeStream || options.adaptive ||
+			options.contextModel || options.runLengths || options.matchLevel > 0 || options.burrowsWheeler)) {
+		cerr << "-c cannot be used with -b, -s, -a, -x, -r, -z or -m" << endl;
+		return false;
+	}
 
-		for (int j = 0; j < currentBitString.size(); j++) {
-			// Filled a byte
-			if (bitCount == BYTE_SIZE) {
-				outContents[currentOutByteIndex] = currentOutByte;
-				bitCount = 0;
-				currentOutByte = '\0';
-				currentOutByteIndex++;
-			}
+	if (options.shareTree && (options.blockSize == 0 || options.writeStream)) {
+		cerr << "-g needs a block size (-b) and cannot be used with -s" << endl;
+		return false;
+	}
 
-			// This code is modified from code that Dr. Ragsdale gave to the class
-			// is the bit "on"?
-			if (currentBitString[j] == '1')
-			{
-				// turn the bit on using the OR bitwise operator
-				currentOutByte = currentOutByte | (unsigned char)pow(2.0, bitCount);
+	if (options.interleave && (options.blockSize == 0 || options.writeStream)) {
+		cerr << "-i needs a block size (-b) and cannot be used with -s" << endl;
+		return false;
+	}
+
+	if (options.adaptive && (options.writeStream || options.shareTree || options.interleave ||
+			options.blockSize > MAX_REBUILD_INTERVAL)) {
+		cerr << "-a cannot be used with -s, -g or -i, and rebuilds its codes at least every "
+			<< MAX_REBUILD_INTERVAL / KILOBYTE << " KB" << endl;
+		return false;
+	}
+
+	if (options.contextModel && (options.writeStream || options.adaptive || options.shareTree || options.interleave)) {
+		cerr << "-x cannot be used with -s, -a, -g or -i" << endl;
+		return false;
+	}
+	if (options.contextModel && options.blockSize == 0)
+		options.blockSize = DEFAULT_STREAM_BLOCK_SIZE;
+
+	if (options.runLengths && (options.writeStream || options.adaptive || options.shareTree || options.interleave ||
+			options.contextModel)) {
+		cerr << "-r cannot be used with -s, -a, -g, -i or -x" << endl;
+		return false;
+	}
+	if (options.runLengths && options.blockSize == 0)
+		options.blockSize = DEFAULT_STREAM_BLOCK_SIZE;
+
+	if (options.matchLevel > 0 && (options.writeStream || options.adaptive || options.shareTree || options.interleave ||
+			options.contextModel || options.runLengths)) {
+		cerr << "-z cannot be used with -s, -a, -g, -i, -x or -r" << endl;
+		return false;
+	}
+	if (options.windowSize > 0 && options.matchLevel == 0) {
+		cerr << "-w only applies to -z" << endl;
+		return false;
+	}
+	if (options.windowSize & (options.windowSize - 1)) {
+		cerr << "-w needs a power of two from " << MIN_WINDOW_SIZE / KILOBYTE << " to " << MAX_WINDOW_SIZE / KILOBYTE << " KB" << endl;
+		return false;
+	}
+	// Matches never reach back past the start of their block, so a window
+	// given with -w has to fit in one. Without -b the blocks grow to fit it,
+	// and without -w the window is the default one cut down to the block.
+	if (options.matchLevel > 0 && options.blockSize == 0)
+		options.blockSize = max(DEFAULT_STREAM_BLOCK_SIZE, options.windowSize);
+	if (options.matchLevel > 0 && options.windowSize > options.blockSize) {
+		cerr << "-w cannot be larger than the block size (-b)" << endl;
+		return false;
+	}
+	if (options.windowSize == 0)
+		options.windowSize = DEFAULT_WINDOW_SIZE;
+
+	if (options.burrowsWheeler && (options.writeStream || options.adaptive || options.shareTree || options.interleave ||
+			options.contextModel || options.runLengths || options.matchLevel > 0 ||
+			options.blockSize > MAX_TRANSFORM_BLOCK_SIZE)) {
+		cerr << "-m cannot be used with -s, -a, -g, -i, -x, -r or -z, and takes blocks of at most "
+			<< MAX_TRANSFORM_BLOCK_SIZE / KILOBYTE << " KB" << endl;
+		return false;
+	}
+	if (options.burrowsWheeler && options.blockSize == 0)
+		options.blockSize = DEFAULT_STREAM_BLOCK_SIZE;
+
+	// Only the block formats are encoded by several threads
+	if (threadsGiven && (options.blockSize == 0 || options.writeStream || options.adaptive)) {
+		cerr << "-t needs a block format (-b, -x, -r, -z or -m) and cannot be used with -s or -a" << endl;
+		return false;
+	}
+
+	return true;
+}
+
+// Expands the inputs into one job per file. Directories contribute the 
+// files directly inside them, leaving out ones that are already compressed.
+// Outputs go next to their inputs unless -o names a file or directory.
+bool listJobs(const vector<string>& inFileNames, const HuffOptions& options, vector<HuffJob>& jobs) {
+	vector<string> files;
+	for (size_t i = 0; i < inFileNames.size(); i++) {
+		error_code error;
+		if (inFileNames[i] != STANDARD_STREAM && filesystem::is_directory(inFileNames[i], error)) {
+			vector<string> directoryFiles;
+			for (const filesystem::directory_entry& entry : filesystem::directory_iterator(inFileNames[i], error)) {
+				if (entry.is_regular_file(error) && entry.path().extension() != "." + HUFF_EXT)
+					directoryFiles.push_back(entry.path().string());
 			}
-			bitCount++;
+			sort(directoryFiles.begin(), directoryFiles.end());
+			files.insert(files.end(), directoryFiles.begin(), directoryFiles.end());
 		}
+		else
+			files.push_back(inFileNames[i]);
 	}
 
-	// Move last byte into outContents 
-	outContents[currentOutByteIndex] = currentOutByte;
+	error_code error;
+	bool outToDirectory = !options.outPath.empty() && options.outPath != STANDARD_STREAM 
+		&& (files.size() > 1 || filesystem::is_directory(options.outPath, error));
 
-	ofstream fout(outFileName, ios::binary);
+	int numToStandardOutput = 0;
+	for (size_t i = 0; i < files.size(); i++) {
+		HuffJob job;
+		job.inFileName = files[i];
+		if (outToDirectory) {
+			string baseName = files[i] == STANDARD_STREAM ? "stdin" : filesystem::path(files[i]).filename().string();
+			job.outFileName = (filesystem::path(options.outPath) / makeOutFileName(baseName)).string();
+		}
+		else if (!options.outPath.empty())
+			job.outFileName = options.outPath;
+		else if (files[i] == STANDARD_STREAM)
+			job.outFileName = STANDARD_STREAM;
+		else
+			job.outFileName = makeOutFileName(files[i]);
 
-	// Output name of file
-	unsigned int fileNameSize = inFileName.size();
-	fout.write((char*)& fileNameSize, sizeof(unsigned int));
-	fout.write((char*) inFileName.c_str(), fileNameSize);
+		if (job.outFileName == STANDARD_STREAM)
+			numToStandardOutput++;
+		jobs.push_back(job);
+	}
 
-	// Output huffman tree
-	fout.write((char*)& nextFreeSlot, sizeof(int));
-	fout.write((char*) minHuffmanTable, sizeof(MinHuffmanNode) * nextFreeSlot);
+	if (numToStandardOutput > 1 || (numToStandardOutput == 1 && files.size() > 1)) {
+		cerr << "Only one file can be written to standard output" << endl;
+		return false;
+	}
 
-	// Output compressed data
-	fout.write((char*)outContents.c_str(), numBytesWhenCompressed);
+	return true;
+}
 
-	fout.close();
+// Compresses one file of the batch into its output file. Input read from 
+// standard input is stored without a name.
+bool compressJob(const HuffJob& job, const HuffOptions& options, HuffWorkspace& workspace) {
+	string storedName = job.inFileName == STANDARD_STREAM ? "" : job.inFileName;
+	ofstream outFile;
+	if (job.outFileName != STANDARD_STREAM) {
+		outFile.open(job.outFileName, ios::binary);
+		if (!outFile.is_open()) {
+			cerr << "Could not create " << job.outFileName << endl;
+			return false;
+		}
+	}
+	ostream& fout = job.outFileName == STANDARD_STREAM ? cout : outFile;
 
-#pragma endregion outputFileProcessing
-	// De-allocate dynamic memory
-	delete[] contents;
+	workspace.stats = HuffStats();
+	workspace.stats.format = options.statsFormat;
+	workspace.stats.fileName = job.inFileName;
+
+	bool compressed;
+	if (options.writeStream || options.adaptive)
+		compressed = compressStream(job.inFileName, storedName, fout, options, workspace);
+	else if (options.blockSize > 0)
+		compressed = compressBlocks(job.inFileName, storedName, fout, options, workspace);
+	else
+		compressed = compressFile(job.inFileName, storedName, fout, options, workspace);
+
+	if (!compressed)
+		cerr << "Could not compress " << job.inFileName << endl;
+
+	// Standard output cannot tell how much was written to it
+	streampos outSize = fout.tellp();
+	if (outSize > 0)
+		workspace.stats.bytesOut = outSize;
+	return compressed;
+}
+
+int main(int argc, char* argv[]) {
+	chrono::steady_clock::time_point start, end;
+	HuffOptions options;
+	vector<string> inFileNames;
+	if (!parseOptions(argc, argv, options, inFileNames)) {
+		cerr << "Usage: huff [-c] [-b KB] [-t threads] [-g] [-i] [-s] [-a] [-x] [-r] [-z level] [-w KB] [-m] [-l bits] [-j jobs] [-o path] [--stats[=text|json]] [file | directory | -]..." << endl;
+		return 1;
+	}
+
+#ifdef _WIN32
+	_setmode(_fileno(stdin), _O_BINARY);
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+	// Without any files on the command line ask for one
+	if (inFileNames.empty()) {
+		string filename = "test.txt";
+		cout << "File to compress: ";
+		cin >> filename;
+		inFileNames.push_back(filename);
+	}
+
+	vector<HuffJob> jobs;
+	if (!listJobs(inFileNames, options, jobs))
+		return 1;
+
+	// Messages go to standard error when the compressed data goes to standard output
+	bool toStandardOutput = false;
+	for (size_t i = 0; i < jobs.size(); i++)
+		toStandardOutput = toStandardOutput || jobs[i].outFileName == STANDARD_STREAM;
+	ostream& status = toStandardOutput ? cerr : cout;
+
+	// START the clock
+	start = chrono::steady_clock::now();
+
+	// Each thread takes the next file of the batch and keeps its workspace
+	atomic<size_t> nextJob(0);
+	atomic<int> numFailed(0);
+	vector<HuffStats> jobStats(options.statsFormat != STATS_OFF ? jobs.size() : 0);
+	auto compressJobs = [&]() {
+		HuffWorkspace workspace;
+		for (size_t job = nextJob++; job < jobs.size(); job = nextJob++) {
+			if (!compressJob(jobs[job], options, workspace))
+				numFailed++;
+			if (options.statsFormat != STATS_OFF)
+				jobStats[job] = workspace.stats;
+		}
+	};
+
+	unsigned int numJobThreads = (unsigned int)min((size_t)options.numJobs, jobs.size());
+	vector<thread> jobThreads;
+	for (unsigned int i = 1; i < numJobThreads; i++)
+		jobThreads.emplace_back(compressJobs);
+	compressJobs();
+	for (size_t i = 0; i < jobThreads.size(); i++)
+		jobThreads[i].join();
 
 	// END the clock
-	end = clock();
+	end = chrono::steady_clock::now();
 
-	cout << setprecision(5) << fixed;
-	cout << "Time to compress: " << (double(end - start) / CLOCKS_PER_SEC) << endl;
-}
\ No newline at end of file
+	// JSON stats are a document of their own, so nothing else goes with them
+	if (options.statsFormat != STATS_JSON) {
+		status << setprecision(5) << fixed;
+		status << "Time to compress: " << chrono::duration<double>(end - start).count() << endl;
+	}
+	if (options.statsFormat != STATS_OFF)
+		writeStats(status, jobStats, "huff");
+
+	return numFailed > 0 ? 1 : 0;
+}
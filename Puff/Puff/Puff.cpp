@@ -1,171 +1,710 @@
 // Puff file for Jeremy Campbell and Jon Thompson
 
+#include "../../libhuffpuff/huffpuff.h"
+#include "../../libhuffpuff/stats.h"
+
 #include <string>
 #include <iostream>
 #include <fstream>
-#include <bitset>
 #include <vector>
-#include <ctime>
+#include <chrono>
 #include <iomanip>
+#include <cstdint>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <filesystem>
+#include <cstdlib>
+#include <cctype>
+
+// .huf files that are regular files are memory mapped where mmap is available
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#define PUFF_MMAP
+#define PUFF_PARTIAL_READS
+#endif
+
+// standard input and output carry binary data
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 using std::string;
 using std::cout;
 using std::cin;
+using std::cerr;
 using std::ifstream;
 using std::ofstream;
 using std::ios;
 using std::endl;
-using std::streampos;
-using std::bitset;
 using std::vector;
+using namespace huffpuff;
 
+const int INPUT_BUFFER_SIZE = 1 << 20;
+const string STANDARD_STREAM = "-";
+const string HUFF_EXT = ".huf";
+const unsigned int MAX_THREADS = 1024;
 
 /*
-	each node in the reconstructed huffman table will consist
-	of a glyph, left child indicator and right child indicator.
-	glyph frequency is not included, as it does not matter
-	in the case of decompression.
+	a read only view of a whole .huf file when it could be memory mapped
 */
-struct tableNode
+struct mappedFile
 {
-	int glyph, leftChild, rightChild;
+	const unsigned char* data = nullptr;
+	size_t size = 0;
+	bool isMapped = false;
 };
 
 /*
-	the decompressed file will consist of the following data
-	in order: the length in bytes of the file name, the actual
-	file name with the original file extension, the number of 
-	entries in the huffman table (max. of 513), and the original
-	file data before it was compressed.
+	command line settings.  numThreads is the number of threads used to
+	decode the blocks of one file and numJobs the number of files that
+	are decompressed at the same time.
 */
-struct decompressedFile
+struct puffOptions
 {
-	int fileNameLength = 0;
-	char* fileName;
-	int entriesInTable = 0;
-	tableNode huffTable[513];
-	unsigned char* fileOutput;
+	unsigned int numThreads = std::thread::hardware_concurrency();
+	unsigned int numJobs = 1;
+	string outPath = "";
+	int statsFormat = STATS_OFF;
 };
 
-void main()
+/*
+	one .huf file of a batch and where its output goes.  with an empty
+	outPath the output file name is the one stored in the .huf file.
+*/
+struct puffJob
 {
-	string fileName;
-
-	// query user for .huf file to be decompressed
-	cout << "File to decompress: ";
-	cin >> fileName;
+	string hufFileName;
+	string outPath;
+	bool outIsDirectory = false;
+};
 
-	// start timer
-	clock_t start, end;
-	start = clock();
+/*
+	the buffers one thread decompresses with.  they are kept from one
+	file to the next so a batch of files does not allocate them again.
+*/
+struct puffWorkspace
+{
+	vector<unsigned char> inputBuffer;
+	vector<unsigned char> outputBuffer;
+	HuffDecoder decoder;
+	HuffStats stats;
+};
 
-	// open .huf file for reading
-	ifstream fin(fileName, ios::in | ios::binary);	
+/*
+	map the whole of a regular file into memory, with a hint that it
+	will be read from front to back.  returns false for pipes and other
+	files that cannot be mapped, which are read through streams instead.
+*/
+bool mapFile(const string& fileName, mappedFile& file)
+{
+#ifdef PUFF_MMAP
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
 
-	if (fin.is_open())
+	struct stat info;
+	if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
 	{
-		// create decompressedFile object
-		decompressedFile outFile;
+		void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED)
+		{
+			madvise(data, info.st_size, MADV_SEQUENTIAL);
+			file.data = (const unsigned char*)data;
+			file.size = info.st_size;
+			file.isMapped = true;
+		}
+	}
+	close(fd);
+#endif
+	return file.data != nullptr;
+}
 
-		// the .huf file will have a consistent order of the first line :
-		// <length of name> -<file name(with original extension)> -<size of huffman table>
+void unmapFile(mappedFile& file)
+{
+#ifdef PUFF_MMAP
+	if (file.isMapped)
+		munmap((void*)file.data, file.size);
+#endif
+	file.data = nullptr;
+	file.size = 0;
+	file.isMapped = false;
+}
 
-		// populate the file name length of the decompressed file object
-		fin.read((char*)&outFile.fileNameLength, sizeof(outFile.fileNameLength));
+/*
+	decode every block of a block format file.  the blocks are shared
+	out between a pool of threads.  every thread opens the output file
+	for itself, decodes a whole block into memory and writes it straight
+	to where it belongs in the output file, so blocks can finish in any
+	order.  blocks are decoded in place when the .huf file is memory
+	mapped, otherwise every thread also reads them through its own stream.
+	with reused trees every thread keeps the decode tables of the last
+	code lengths it read, which the blocks after it mostly share.
+	writeFailed tells a block that could not be written to the output
+	file apart from a block that could not be decoded.
+*/
+bool decodeBlocks(const HuffHeader& header, const mappedFile& hufFile, const string& hufFileName,
+	const string& outFileName, unsigned int numThreads, bool& writeFailed)
+{
+	const vector<BlockIndexEntry>& blockIndex = header.blockIndex;
+	unsigned int numBlocks = blockIndex.size();
 
-		// populate the file name (with original file extension) of the decompressed file object
-		outFile.fileName = new char[outFile.fileNameLength + 1];
-		fin.read(outFile.fileName, outFile.fileNameLength);
-		//  place a null terminator at the end of the filename, otherwise
-		// the filename will have junk at the end
-		outFile.fileName[outFile.fileNameLength] = '\0';
+	// the code lengths shared by every block, if there are any
+	tableNode sharedHuffTable[MAX_HUFFMAN_TABLE];
+	vector<decodeTable> sharedDecodeTables;
+	if (header.flags & SHARED_TREE)
+	{
+		if (buildTableFromCodeLengths(header.codeLengths, sharedHuffTable) == 0)
+			return false;
+		buildDecodeTables(sharedHuffTable, sharedDecodeTables);
+	}
 
-		// populate the number of entries in the huffman table of the decompressed file object
-		fin.read((char*)&outFile.entriesInTable, sizeof outFile.entriesInTable);
+	// where each block starts in the output file
+	vector<unsigned long long> outputOffsets(numBlocks, 0);
+	for (unsigned int block = 1; block < numBlocks; block++)
+		outputOffsets[block] = outputOffsets[block - 1] + blockIndex[block - 1].originalSize;
 
-		// create output file with the given original file name
-		ofstream fout(outFile.fileName, ios::out | ios::binary);
+	std::atomic<unsigned int> nextBlock(0);
+	std::atomic<bool> blocksValid(true);
+	std::atomic<bool> blocksWritten(true);
 
-		// loop through the huffman table in the .huf file and populate the huffman table
-		// in the decompressed file, starting at the 0th node up to the number represented
-		// by the total entries.  it will read one table entry at a time by using the sizeof function.
-		for (int currentNode = 0; currentNode < outFile.entriesInTable; currentNode++)
+	auto decodeNextBlocks = [&]()
+	{
+		ifstream blockIn;
+		if (!hufFile.data)
+			blockIn.open(hufFileName, ios::in | ios::binary);
+		std::fstream blockOut(outFileName, ios::in | ios::out | ios::binary);
+		if (!blockOut)
 		{
-			tableNode currentTableNode;
-			fin.read((char*)&currentTableNode, sizeof(currentTableNode));
-			outFile.huffTable[currentNode].glyph = currentTableNode.glyph;
-			outFile.huffTable[currentNode].leftChild = currentTableNode.leftChild;
-			outFile.huffTable[currentNode].rightChild = currentTableNode.rightChild;
+			blocksWritten = false;
+			blocksValid = false;
+			return;
 		}
+		vector<unsigned char> blockBuffer;
+		vector<unsigned char> treeBuffer;
+		vector<decodeTable> blockDecodeTables;
+		size_t tablesBlock = numBlocks;
+		vector<unsigned char> decodedData;
 
-		bool endOfFile = false;		
-		unsigned char currentByte;
-		
-		// create a vector to hold the encoded data (remainder of
-		// .huf file) and populate the vector with the data
-		vector<unsigned char> encodedData;
-		int currentVectorPosition = 0;
-		
-		// get first byte of the original file data
-		fin.read((char*)&currentByte, sizeof currentByte);
-		// read in one byte at a time until the end of file and
-		// add each byte to the end of the encodedData vector
-		while (!fin.eof())
+		// the first size bytes of a block, or null if they cannot be read
+		auto readBlock = [&](unsigned int block, size_t size, vector<unsigned char>& buffer) -> const unsigned char*
 		{
-			encodedData.push_back(currentByte);
-			fin.read((char*)&currentByte, sizeof currentByte);
-		}
+			unsigned long long blockStart = header.size + blockIndex[block].offset;
+			if (hufFile.data)
+				return blockStart + size <= hufFile.size ? hufFile.data + blockStart : nullptr;
+
+			buffer.resize(size);
+			blockIn.seekg(blockStart, ios::beg);
+			blockIn.read((char*)buffer.data(), size);
+			return (size_t)blockIn.gcount() == size ? buffer.data() : nullptr;
+		};
 
-		// loop through the encodedData vector that was created in the 
-		// previous step and use right to left decoding to get the original
-		// file data
-		currentVectorPosition = 0;
-		int huffTablePosition = 0;
-		unsigned char currentVectorValue;
-		do
+		// write size bytes of a block to where it belongs in the output file
+		auto writeBlock = [&](unsigned int block, const unsigned char* data, size_t size) -> bool
 		{
-			// loop through one byte at a time
-			for (int bitPos = 0; bitPos < 8 && !endOfFile; bitPos++)
+			blockOut.seekp(outputOffsets[block], ios::beg);
+			blockOut.write((const char*)data, size);
+			if (blockOut)
+				return true;
+			blocksWritten = false;
+			blocksValid = false;
+			return false;
+		};
+
+		for (unsigned int block = nextBlock++; block < numBlocks && blocksValid; block = nextBlock++)
+		{
+			// get the whole block into memory
+			size_t blockSize = blockIndex[block].compressedSize;
+			const unsigned char* blockData = readBlock(block, blockSize, blockBuffer);
+			if (!blockData)
+			{
+				blocksValid = false;
+				break;
+			}
+
+			/* a stored block goes straight from the .huf file to the output */
+			if (isStoredBlock(blockIndex[block].compressedSize, blockIndex[block].originalSize, header.flags))
+			{
+				if (!writeBlock(block, blockData, blockSize))
+					break;
+				continue;
+			}
+
+			const vector<decodeTable>* sharedTables = (header.flags & SHARED_TREE) ? &sharedDecodeTables : nullptr;
+			if (header.flags & REUSED_TREES)
 			{
-				currentVectorValue = encodedData[currentVectorPosition];
-				// check to see if current position is the end of file
-				if (outFile.huffTable[huffTablePosition].glyph == 256)
-					endOfFile = true;
-					
-				// check to see if current position is a glyph
-				else if (outFile.huffTable[huffTablePosition].glyph != 256 &&
-					outFile.huffTable[huffTablePosition].glyph != -1)
+				size_t treeBlock;
+				if (!findTreeBlock(blockData, blockSize, block, treeBlock))
 				{
-					fout.write((char*)&outFile.huffTable[huffTablePosition].glyph, sizeof
-					currentByte);
-					// start back at the root of the huff table
-					huffTablePosition = 0;
-					bitPos--;
-					// if this is the last bit, go on to the next byte
-					if (bitPos == 7)
-						currentVectorPosition++;
+					blocksValid = false;
+					break;
 				}
-				// if the current position is not a glyph or end of file,
-				// it must be a merge node
-				else
+
+				// only the start of another block is needed for its code lengths
+				if (treeBlock != block && treeBlock != tablesBlock)
 				{
-					// if the bit we're looking at is 1, move to right child in huffman table
-					if (currentVectorValue & (unsigned char)pow(2.0, bitPos))
-						huffTablePosition = outFile.huffTable[huffTablePosition].rightChild;
-					// if the bit is 0, move to the left child in huffman table
-					else
-						huffTablePosition = outFile.huffTable[huffTablePosition].leftChild;
-					if (bitPos == 7)
-						currentVectorPosition++;
+					size_t treeSize = std::min((size_t)blockIndex[treeBlock].compressedSize,
+						(size_t)(MAX_TREE_DISTANCE_SIZE + CODE_LENGTHS_PREFIX_SIZE + NUM_SYMBOLS));
+					const unsigned char* treeData = readBlock((unsigned int)treeBlock, treeSize, treeBuffer);
+					int codeLengths[NUM_SYMBOLS];
+					tableNode huffTable[MAX_HUFFMAN_TABLE];
+					if (!treeData || !readBlockCodeLengths(treeData, treeSize, header.flags, codeLengths) ||
+						buildTableFromCodeLengths(codeLengths, huffTable) == 0)
+					{
+						blocksValid = false;
+						break;
+					}
+					buildDecodeTables(huffTable, blockDecodeTables);
 				}
+
+				// a block with its own code lengths builds its tables as it is decoded
+				if (treeBlock != block)
+					sharedTables = &blockDecodeTables;
+				tablesBlock = treeBlock;
+			}
+
+			// leave room for the extra glyphs a table entry may copy
+			decodedData.resize(blockIndex[block].originalSize + MAX_SYMBOLS_PER_ENTRY);
+			if (!decodeBlock(blockData, blockIndex[block], header.flags, sharedTables, blockDecodeTables, decodedData.data()))
+			{
+				blocksValid = false;
+				break;
 			}
-		} while (!endOfFile);		
-			   
-		fout.close();
-		fin.close();
-		delete outFile.fileName;
-	}
-	end = clock();
-	cout << std::setprecision(4) << std::fixed;
-	cout << "Time to decompress: " << (double(end - start) / CLOCKS_PER_SEC) << endl;
-}
\ No newline at end of file
+
+			if (!writeBlock(block, decodedData.data(), blockIndex[block].originalSize))
+				break;
+		}
+
+		/* a full disk may only show once the last writes are flushed */
+		blockOut.flush();
+		if (!blockOut)
+		{
+			blocksWritten = false;
+			blocksValid = false;
+		}
+	};
+
+	numThreads = std::max(1u, std::min(numThreads, numBlocks));
+	vector<std::thread> workers;
+	for (unsigned int i = 0; i < numThreads; i++)
+		workers.emplace_back(decodeNextBlocks);
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+
+	writeFailed = !blocksWritten;
+	return blocksValid;
+}
+
+/*
+	the name to give the output of hufFileName when the .huf file does
+	not store one: the .huf file name without its extension.
+*/
+string defaultOutFileName(const string& hufFileName)
+{
+	if (hufFileName == STANDARD_STREAM)
+		return "stdin";
+	string fileName = std::filesystem::path(hufFileName).filename().string();
+	if (fileName.size() > HUFF_EXT.size() && fileName.compare(fileName.size() - HUFF_EXT.size(), HUFF_EXT.size(), HUFF_EXT) == 0)
+		return fileName.substr(0, fileName.size() - HUFF_EXT.size());
+	return fileName + ".out";
+}
+
+/*
+	read up to size bytes of standard input.  where it can, this returns
+	whatever has arrived instead of waiting for all size bytes, so a
+	stream coming down a slow pipe is decoded as it comes.  returns 0 at
+	the end of the input or on an error.
+*/
+size_t readStandardInput(unsigned char* buffer, size_t size)
+{
+#ifdef PUFF_PARTIAL_READS
+	while (true)
+	{
+		ssize_t count = read(STDIN_FILENO, buffer, size);
+		if (count >= 0)
+			return (size_t)count;
+		if (errno != EINTR)
+			return 0;
+	}
+#else
+	cin.read((char*)buffer, size);
+	return (size_t)cin.gcount();
+#endif
+}
+
+/*
+	decode a .huf file with the library's streaming decoder.  the file
+	comes straight from memory when hufFile holds all of it, otherwise
+	it is read through fin a buffer at a time.  decoded glyphs are
+	collected in a buffer that is written out whenever it fills up, so
+	memory use stays the same no matter how large the file is.  returns
+	false, after saying why, if the file cannot be decoded.
+*/
+bool decodeHufFile(std::istream* fin, const mappedFile& hufFile, const puffJob& job,
+	const puffOptions& options, puffWorkspace& workspace)
+{
+	HuffDecoder& decoder = workspace.decoder;
+	initDecoder(decoder);
+	HuffStats& stats = workspace.stats;
+	startPhase(stats);
+
+	const unsigned char* in = hufFile.data;
+	size_t inSize = hufFile.size;
+	stats.bytesIn = inSize;
+	if (fin)
+		workspace.inputBuffer.resize(INPUT_BUFFER_SIZE);
+	bool fromStandardInput = fin == &cin;
+	bool inputEnded = false;
+	auto readInput = [&]()
+	{
+		in = workspace.inputBuffer.data();
+		if (fromStandardInput)
+		{
+			inSize = readStandardInput(workspace.inputBuffer.data(), workspace.inputBuffer.size());
+			inputEnded = inSize == 0;
+		}
+		else
+		{
+			fin->read((char*)workspace.inputBuffer.data(), workspace.inputBuffer.size());
+			inSize = (size_t)fin->gcount();
+		}
+		stats.bytesIn += inSize;
+	};
+	auto inputLeft = [&]() { return fin && *fin && !inputEnded; };
+
+	// read the header first, without any room for output
+	HuffStatus status = HUFF_NEED_INPUT;
+	unsigned char* out = nullptr;
+	size_t outSize = 0;
+	while (!decoder.headerRead && status != HUFF_INVALID_DATA)
+	{
+		if (inSize == 0 && inputLeft())
+			readInput();
+		if (inSize == 0 && !inputLeft())
+			break;
+		status = feedDecoder(decoder, in, inSize, out, outSize);
+	}
+	endPhase(stats, "readHeader");
+	if (!decoder.headerRead)
+	{
+		cerr << job.hufFileName << " is not a .huf file" << endl;
+		return false;
+	}
+
+	// work out where the output goes
+	const string& storedName = decoder.header.storedName;
+	string outFileName;
+	if (job.outIsDirectory)
+	{
+		string baseName = storedName.empty() ? defaultOutFileName(job.hufFileName) :
+			std::filesystem::path(storedName).filename().string();
+		outFileName = (std::filesystem::path(job.outPath) / baseName).string();
+	}
+	else if (!job.outPath.empty())
+		outFileName = job.outPath;
+	else if (job.hufFileName == STANDARD_STREAM)
+		outFileName = STANDARD_STREAM;
+	else if (!storedName.empty())
+		outFileName = storedName;
+	else
+		outFileName = defaultOutFileName(job.hufFileName);
+
+	// create output file with the given original file name
+	ofstream outFileStream;
+	if (outFileName != STANDARD_STREAM)
+	{
+		outFileStream.open(outFileName, ios::out | ios::binary);
+		if (!outFileStream.is_open())
+		{
+			cerr << "Could not create " << outFileName << endl;
+			return false;
+		}
+	}
+	std::ostream& fout = outFileName == STANDARD_STREAM ? cout : outFileStream;
+
+	// the blocks of a block format file can be decoded side by side as
+	// long as they can be read in any order and written anywhere
+	bool canSeek = hufFile.data || job.hufFileName != STANDARD_STREAM;
+	if (decoder.header.formatVersion == BLOCK_FORMAT_VERSION && outFileName != STANDARD_STREAM && canSeek)
+	{
+		// the blocks are written into the (now empty) output file by
+		// the decoding threads
+		outFileStream.close();
+		startPhase(stats);
+		bool writeFailed = false;
+		if (!decodeBlocks(decoder.header, hufFile, job.hufFileName, outFileName, options.numThreads, writeFailed))
+		{
+			if (writeFailed)
+				cerr << "Could not write " << outFileName << endl;
+			else
+				cerr << "Invalid block in " << job.hufFileName << endl;
+			return false;
+		}
+		endWorkerPhase(stats, "decodeBlocks");
+		for (size_t block = 0; block < decoder.header.blockIndex.size(); block++)
+			stats.bytesOut += decoder.header.blockIndex[block].originalSize;
+		return true;
+	}
+
+	vector<unsigned char>& outputBuffer = workspace.outputBuffer;
+	outputBuffer.resize(OUTPUT_BUFFER_SIZE);
+	do
+	{
+		startPhase(stats);
+		if (inSize == 0 && inputLeft())
+			readInput();
+
+		out = outputBuffer.data();
+		outSize = outputBuffer.size();
+		if (inSize == 0 && !inputLeft())
+			status = finishDecoder(decoder, out, outSize);
+		else
+			status = feedDecoder(decoder, in, inSize, out, outSize);
+		endPhase(stats, "decode");
+
+		startPhase(stats);
+		fout.write((const char*)outputBuffer.data(), out - outputBuffer.data());
+		if (fromStandardInput)
+			fout.flush();
+		stats.bytesOut += out - outputBuffer.data();
+		endPhase(stats, "write");
+	} while (status == HUFF_NEED_INPUT || status == HUFF_OUTPUT_FULL);
+
+	if (status == HUFF_INVALID_DATA)
+	{
+		cerr << "Invalid encoded data in " << job.hufFileName << endl;
+		return false;
+	}
+	if (status == HUFF_TRUNCATED)
+	{
+		cerr << "Unexpected end of encoded data in " << job.hufFileName << endl;
+		return false;
+	}
+
+	fout.flush();
+	return fout.good();
+}
+
+/*
+	decompress one .huf file, or standard input when the file name is
+	"-".  standard input is decoded as it arrives, so it never has to
+	fit in memory.
+*/
+bool decompressFile(const puffJob& job, const puffOptions& options, puffWorkspace& workspace)
+{
+	workspace.stats = HuffStats();
+	workspace.stats.format = options.statsFormat;
+	workspace.stats.fileName = job.hufFileName;
+
+	if (job.hufFileName == STANDARD_STREAM)
+		return decodeHufFile(&cin, mappedFile(), job, options, workspace);
+
+	// open .huf file for reading
+	ifstream fin(job.hufFileName, ios::in | ios::binary);
+	if (!fin.is_open())
+	{
+		cerr << "Could not open " << job.hufFileName << endl;
+		return false;
+	}
+
+	mappedFile hufFile;
+	bool decoded;
+	if (mapFile(job.hufFileName, hufFile))
+		decoded = decodeHufFile(nullptr, hufFile, job, options, workspace);
+	else
+		decoded = decodeHufFile(&fin, hufFile, job, options, workspace);
+	unmapFile(hufFile);
+
+	return decoded;
+}
+
+/*
+	read the number given to option.  the whole of text has to be digits
+	and the number has to be from minValue to maxValue.
+*/
+bool readNumber(const string& option, const char* text, unsigned long minValue, unsigned long maxValue,
+	unsigned long& value)
+{
+	char* end = nullptr;
+	value = isdigit((unsigned char)text[0]) ? strtoul(text, &end, 10) : 0;
+	if (!end || *end != '\0' || value < minValue || value > maxValue)
+	{
+		cerr << option << " needs a number from " << minValue << " to " << maxValue << endl;
+		return false;
+	}
+	return true;
+}
+
+/*
+	read the command line:
+		-o <path>	output file, or directory when there are several inputs
+		-t <n>		number of threads used to decode the blocks of a file
+		-j <n>		number of files decompressed at the same time
+		--stats[=text|json]	print the time spent reading the header,
+					decoding and writing each file
+	everything else is a .huf file, a directory of them, or - for
+	standard input.
+*/
+bool parseOptions(int argc, char* argv[], puffOptions& options, vector<string>& hufFileNames)
+{
+	unsigned long value;
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		if (arg == "-o" && i + 1 < argc)
+			options.outPath = argv[++i];
+		else if (arg == "-t" && i + 1 < argc)
+		{
+			if (!readNumber(arg, argv[++i], 1, MAX_THREADS, value))
+				return false;
+			options.numThreads = (unsigned int)value;
+		}
+		else if (arg == "-j" && i + 1 < argc)
+		{
+			if (!readNumber(arg, argv[++i], 1, MAX_THREADS, value))
+				return false;
+			options.numJobs = (unsigned int)value;
+		}
+		else if (arg == "--stats" || arg == "--stats=text")
+			options.statsFormat = STATS_TEXT;
+		else if (arg == "--stats=json")
+			options.statsFormat = STATS_JSON;
+		else if (arg.size() > 1 && arg[0] == '-')
+		{
+			cerr << "Unknown option " << arg << endl;
+			return false;
+		}
+		else
+			hufFileNames.push_back(arg);
+	}
+	return true;
+}
+
+/*
+	expand the inputs into one job per .huf file.  directories add the
+	.huf files directly inside them.  with several inputs, or when -o
+	names an existing directory, the outputs go into that directory.
+*/
+bool listJobs(const vector<string>& hufFileNames, const puffOptions& options, vector<puffJob>& jobs)
+{
+	vector<string> files;
+	for (size_t i = 0; i < hufFileNames.size(); i++)
+	{
+		std::error_code error;
+		if (hufFileNames[i] != STANDARD_STREAM && std::filesystem::is_directory(hufFileNames[i], error))
+		{
+			vector<string> directoryFiles;
+			for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(hufFileNames[i], error))
+			{
+				if (entry.is_regular_file(error) && entry.path().extension() == HUFF_EXT)
+					directoryFiles.push_back(entry.path().string());
+			}
+			std::sort(directoryFiles.begin(), directoryFiles.end());
+			files.insert(files.end(), directoryFiles.begin(), directoryFiles.end());
+		}
+		else
+			files.push_back(hufFileNames[i]);
+	}
+
+	std::error_code error;
+	bool outIsDirectory = !options.outPath.empty() && options.outPath != STANDARD_STREAM &&
+		(files.size() > 1 || std::filesystem::is_directory(options.outPath, error));
+
+	int numToStandardOutput = 0;
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		puffJob job;
+		job.hufFileName = files[i];
+		job.outPath = options.outPath;
+		job.outIsDirectory = outIsDirectory;
+		if (options.outPath == STANDARD_STREAM || (options.outPath.empty() && files[i] == STANDARD_STREAM))
+			numToStandardOutput++;
+		jobs.push_back(job);
+	}
+
+	if (numToStandardOutput > 1 || (numToStandardOutput == 1 && files.size() > 1))
+	{
+		cerr << "Only one file can be written to standard output" << endl;
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	puffOptions options;
+	vector<string> hufFileNames;
+	if (!parseOptions(argc, argv, options, hufFileNames))
+	{
+		cerr << "Usage: puff [-o path] [-t threads] [-j jobs] [--stats[=text|json]] [file.huf | directory | -]..." << endl;
+		return 1;
+	}
+
+#ifdef _WIN32
+	_setmode(_fileno(stdin), _O_BINARY);
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+	// without any files on the command line, query user for .huf file to be decompressed
+	if (hufFileNames.empty())
+	{
+		string fileName;
+		cout << "File to decompress: ";
+		cin >> fileName;
+		hufFileNames.push_back(fileName);
+	}
+
+	vector<puffJob> jobs;
+	if (!listJobs(hufFileNames, options, jobs))
+		return 1;
+
+	// messages go to standard error when the decoded data goes to standard output
+	bool toStandardOutput = options.outPath == STANDARD_STREAM ||
+		(options.outPath.empty() && jobs.size() == 1 && jobs[0].hufFileName == STANDARD_STREAM);
+	std::ostream& status = toStandardOutput ? cerr : cout;
+
+	// start timer
+	std::chrono::steady_clock::time_point start, end;
+	start = std::chrono::steady_clock::now();
+
+	// each thread takes the next file of the batch and keeps its workspace
+	std::atomic<size_t> nextJob(0);
+	std::atomic<int> numFailed(0);
+	vector<HuffStats> jobStats(options.statsFormat != STATS_OFF ? jobs.size() : 0);
+	auto decompressJobs = [&]()
+	{
+		puffWorkspace workspace;
+		for (size_t job = nextJob++; job < jobs.size(); job = nextJob++)
+		{
+			if (!decompressFile(jobs[job], options, workspace))
+				numFailed++;
+			if (options.statsFormat != STATS_OFF)
+				jobStats[job] = workspace.stats;
+		}
+	};
+
+	unsigned int numJobThreads = (unsigned int)std::min((size_t)options.numJobs, jobs.size());
+	vector<std::thread> jobThreads;
+	for (unsigned int i = 1; i < numJobThreads; i++)
+		jobThreads.emplace_back(decompressJobs);
+	decompressJobs();
+	for (size_t i = 0; i < jobThreads.size(); i++)
+		jobThreads[i].join();
+
+	end = std::chrono::steady_clock::now();
+	/* json stats are a document of their own, so nothing else goes with them */
+	if (options.statsFormat != STATS_JSON)
+	{
+		status << std::setprecision(4) << std::fixed;
+		status << "Time to decompress: " << std::chrono::duration<double>(end - start).count() << endl;
+	}
+	if (options.statsFormat != STATS_OFF)
+		writeStats(status, jobStats, "puff");
+
+	return numFailed > 0 ? 1 : 0;
+}
@@ -0,0 +1,531 @@
+// bench.cpp
+// Measures how fast each phase of huff and Puff runs over a corpus of files
+// and synthetic data. Every phase is run a few times untimed to warm up and
+// then timed over several repetitions, and the results are printed as a
+// table, CSV or JSON so that runs can be compared to catch regressions.
+//
+// Throughput is always given in MB/s of uncompressed data, whatever the
+// phase works on, so the phases of one input can be compared directly.
+#include "../libhuffpuff/huffpuff.h"
+#include "../libhuffpuff/stats.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace huffpuff;
+
+const int DEFAULT_REPETITIONS = 5;
+const int DEFAULT_WARMUP = 1;
+const size_t DEFAULT_SYNTHETIC_SIZE = 8;
+const unsigned long MAX_REPETITIONS = 1000;
+const unsigned long MAX_SYNTHETIC_SIZE = 1024;
+const size_t MEGABYTE = 1 << 20;
+const double MB_PER_SECOND = 1e6;
+const char* DEFAULT_CORPUS = "TestFiles";
+const char* HUF_EXT = ".huf";
+const unsigned int SYNTHETIC_SEED = 12345;
+
+struct BenchOptions {
+	int repetitions = DEFAULT_REPETITIONS;
+	int warmup = DEFAULT_WARMUP;
+	size_t syntheticSize = DEFAULT_SYNTHETIC_SIZE * MEGABYTE;
+	string format = "text";
+	vector<string> paths;
+};
+
+struct BenchInput {
+	string name;
+	vector<unsigned char> data;
+	size_t compressedSize = 0;
+};
+
+// The timings of one phase over one input
+struct PhaseResult {
+	string input;
+	string phase;
+	size_t bytes = 0;
+	double bestSeconds = 0;
+	double medianSeconds = 0;
+};
+
+#pragma region inputs
+bool readFile(const string& fileName, vector<unsigned char>& data) {
+	ifstream fin(fileName, ios::binary | ios::in);
+	if (!fin)
+		return false;
+	data.assign(istreambuf_iterator<char>(fin), istreambuf_iterator<char>());
+	return !fin.bad();
+}
+
+// Adds every file of a directory that is not already compressed, or the
+// path itself when it is a file.
+bool addCorpus(const string& path, vector<BenchInput>& inputs) {
+	error_code error;
+	vector<string> fileNames;
+	if (filesystem::is_directory(path, error)) {
+		for (const filesystem::directory_entry& entry : filesystem::directory_iterator(path, error)) {
+			if (entry.is_regular_file() && entry.path().extension() != HUF_EXT)
+				fileNames.push_back(entry.path().string());
+		}
+		sort(fileNames.begin(), fileNames.end());
+	}
+	else
+		fileNames.push_back(path);
+
+	for (const string& fileName : fileNames) {
+		BenchInput input;
+		input.name = filesystem::path(fileName).filename().string();
+		if (!readFile(fileName, input.data)) {
+			cerr << "Cannot read " << fileName << endl;
+			return false;
+		}
+		inputs.push_back(input);
+	}
+	return true;
+}
+
+// Synthetic data covering the shapes of distribution that matter to the
+// coder: flat, a single glyph, geometric, text-like and one whose tree is
+// as deep as it can get.
+void addSynthetic(size_t size, vector<BenchInput>& inputs) {
+	mt19937 random(SYNTHETIC_SEED);
+
+	BenchInput uniform{ "synthetic-uniform", vector<unsigned char>(size) };
+	for (unsigned char& glyph : uniform.data)
+		glyph = (unsigned char)random();
+	inputs.push_back(uniform);
+
+	BenchInput zeros{ "synthetic-zeros", vector<unsigned char>(size, 0) };
+	inputs.push_back(zeros);
+
+	// Each glyph half as likely as the one before
+	BenchInput geometric{ "synthetic-geometric", vector<unsigned char>(size) };
+	geometric_distribution<int> halving(0.5);
+	for (unsigned char& glyph : geometric.data)
+		glyph = (unsigned char)min(halving(random), NUM_BYTE_VALUES - 1);
+	inputs.push_back(geometric);
+
+	// Zipf over the printable characters, roughly how words and letters fall
+	vector<double> weights;
+	for (int rank = 1; rank <= '~' - ' ' + 1; rank++)
+		weights.push_back(1.0 / rank);
+	discrete_distribution<int> zipf(weights.begin(), weights.end());
+	BenchInput text{ "synthetic-zipf", vector<unsigned char>(size) };
+	for (unsigned char& glyph : text.data)
+		glyph = (unsigned char)(' ' + zipf(random));
+	inputs.push_back(text);
+
+	// Fibonacci frequencies give every level of the tree a single glyph
+	BenchInput fibonacci{ "synthetic-fibonacci", vector<unsigned char>() };
+	fibonacci.data.reserve(size);
+	size_t count = 1, nextCount = 1;
+	for (int glyph = 0; glyph < NUM_BYTE_VALUES && fibonacci.data.size() + count <= size; glyph++) {
+		fibonacci.data.insert(fibonacci.data.end(), count, (unsigned char)glyph);
+		size_t sum = count + nextCount;
+		count = nextCount;
+		nextCount = sum;
+	}
+	shuffle(fibonacci.data.begin(), fibonacci.data.end(), random);
+	inputs.push_back(fibonacci);
+}
+#pragma endregion inputs
+
+#pragma region timing
+// Runs a phase warmup times untimed and then repetitions times, keeping
+// the best and the median time.
+template <typename Phase>
+PhaseResult timePhase(const BenchInput& input, const string& phase, const BenchOptions& options, Phase run) {
+	for (int i = 0; i < options.warmup; i++)
+		run();
+
+	vector<double> seconds;
+	for (int i = 0; i < options.repetitions; i++) {
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		run();
+		seconds.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+	}
+	sort(seconds.begin(), seconds.end());
+
+	PhaseResult result;
+	result.input = input.name;
+	result.phase = phase;
+	result.bytes = input.data.size();
+	result.bestSeconds = seconds.front();
+	result.medianSeconds = seconds[seconds.size() / 2];
+	return result;
+}
+
+// Compresses size bytes into the adaptive format with the streaming encoder,
+// growing encoded whenever it fills up
+void encodeAdaptiveStream(const unsigned char* data, size_t size, HuffEncoder& encoder,
+		vector<unsigned char>& encoded) {
+	initAdaptiveEncoder(encoder, "");
+	encoded.resize(compressBound(size));
+	size_t used = 0;
+	while (true) {
+		unsigned char* out = encoded.data() + used;
+		size_t outSize = encoded.size() - used;
+		HuffStatus status = size > 0 ? feedEncoder(encoder, data, size, out, outSize) : finishEncoder(encoder, out, outSize);
+		used = out - encoded.data();
+		if (status == HUFF_DONE)
+			break;
+		if (status == HUFF_OUTPUT_FULL)
+			encoded.resize(encoded.size() * 2);
+	}
+	encoded.resize(used);
+}
+
+// Times every phase of huff and then of Puff over one input, using a file
+// in tempDir for the phases that read or write one.
+bool benchInput(BenchInput& input, const filesystem::path& tempDir, const BenchOptions& options,
+		vector<PhaseResult>& results) {
+	const unsigned char* data = input.data.data();
+	size_t size = input.data.size();
+	string inFileName = (tempDir / "input.bin").string();
+	string hufFileName = (tempDir / "input.huf").string();
+	string outFileName = (tempDir / "output.bin").string();
+
+	ofstream inFile(inFileName, ios::binary | ios::out | ios::trunc);
+	inFile.write((const char*)data, size);
+	inFile.close();
+	if (!inFile)
+		return false;
+
+	// huff: read, histogram, tree build, code generation, encode, write
+	vector<unsigned char> readData;
+	results.push_back(timePhase(input, "read", options, [&]() {
+		readFile(inFileName, readData);
+	}));
+
+	long long frequencies[NUM_SYMBOLS];
+	results.push_back(timePhase(input, "histogram", options, [&]() {
+		fill(frequencies, frequencies + NUM_SYMBOLS, 0);
+		countGlyphs(data, size, frequencies);
+		frequencies[END_OF_FILE] = 1;
+	}));
+
+	HuffmanNode huffmanTable[MAX_HUFFMAN_TABLE];
+	MinHuffmanNode minHuffmanTable[MAX_HUFFMAN_TABLE];
+	int numNodes = 0;
+	results.push_back(timePhase(input, "tree", options, [&]() {
+		for (int glyph = 0; glyph < NUM_SYMBOLS; glyph++)
+			huffmanTable[glyph] = HuffmanNode{ glyph, frequencies[glyph] };
+		numNodes = buildHuffmanTree(huffmanTable, minHuffmanTable);
+	}));
+
+	HuffmanCode codes[NUM_SYMBOLS];
+	int codeLengths[NUM_SYMBOLS];
+	results.push_back(timePhase(input, "codes", options, [&]() {
+		fill(codeLengths, codeLengths + NUM_SYMBOLS, NO_CODE);
+		buildCodes(huffmanTable, numNodes, codes, codeLengths);
+		buildCanonicalCodes(codeLengths, codes);
+		packCodeLengths(codeLengths);
+	}));
+
+	vector<char> encoded(encodedBlockSize(frequencies, codeLengths, 0));
+	results.push_back(timePhase(input, "encode", options, [&]() {
+		encodeBlock(data, size, codeLengths, 0, encoded.data(), encoded.size());
+	}));
+
+	long long segmentFrequencies[NUM_STREAMS * NUM_SYMBOLS];
+	countSegmentGlyphs(data, size, segmentFrequencies);
+	vector<char> interleaved(encodedBlockSize(segmentFrequencies, codeLengths, INTERLEAVED_STREAMS));
+	results.push_back(timePhase(input, "encode-interleaved", options, [&]() {
+		encodeBlock(data, size, codeLengths, INTERLEAVED_STREAMS, interleaved.data(), interleaved.size());
+	}));
+
+	ContextModel contextModel;
+	vector<char> contextCoded;
+	results.push_back(timePhase(input, "encode-context", options, [&]() {
+		buildContextModel(data, size, MAX_SYMBOL_CODE_LENGTH, contextModel);
+		contextCoded.resize(contextModel.encodedSize);
+		encodeContextBlock(data, size, contextModel, contextCoded.data());
+	}));
+
+	RunLengthModel runLengthModel;
+	vector<char> runLengthCoded;
+	results.push_back(timePhase(input, "encode-runs", options, [&]() {
+		buildRunLengthModel(data, size, MAX_SYMBOL_CODE_LENGTH, runLengthModel);
+		runLengthCoded.resize(runLengthModel.encodedSize);
+		encodeRunLengthBlock(data, size, runLengthModel, runLengthCoded.data());
+	}));
+
+	// The shuffled synthetic inputs are the worst case of the match finder.
+	// Almost every place starts a short match that never reaches niceLength,
+	// so every chain is walked to its end. gzip -6 is nearly as slow on them.
+	MatchModel matchModel;
+	vector<char> matchCoded;
+	results.push_back(timePhase(input, "encode-matches", options, [&]() {
+		buildMatchModel(data, size, DEFAULT_MATCH_LEVEL, DEFAULT_WINDOW_SIZE, MAX_SYMBOL_CODE_LENGTH, matchModel);
+		matchCoded.resize(matchModel.encodedSize);
+		encodeMatchBlock(data, matchModel, matchCoded.data());
+	}));
+
+	// The transform is taken of blocks of the size huff -m uses
+	TransformModel transformModel;
+	vector<vector<char>> transformCoded;
+	results.push_back(timePhase(input, "encode-transform", options, [&]() {
+		transformCoded.clear();
+		for (size_t start = 0; start < size; start += DEFAULT_STREAM_BLOCK_SIZE) {
+			size_t blockSize = min(size - start, (size_t)DEFAULT_STREAM_BLOCK_SIZE);
+			buildTransformModel(data + start, blockSize, MAX_SYMBOL_CODE_LENGTH, transformModel);
+			transformCoded.emplace_back(transformModel.encodedSize);
+			encodeTransformBlock(transformModel, transformCoded.back().data());
+		}
+	}));
+
+	HuffEncoder encoder;
+	vector<unsigned char> adaptive;
+	results.push_back(timePhase(input, "encode-adaptive", options, [&]() {
+		encodeAdaptiveStream(data, size, encoder, adaptive);
+	}));
+
+	vector<unsigned char> compressed(compressBound(size));
+	compressed.resize(compress(data, size, compressed.data(), compressed.size()));
+	input.compressedSize = compressed.size();
+	results.push_back(timePhase(input, "write", options, [&]() {
+		ofstream fout(hufFileName, ios::binary | ios::out | ios::trunc);
+		fout.write((const char*)compressed.data(), compressed.size());
+	}));
+
+	// Puff: header parse, decode, write
+	HuffHeader header;
+	HuffStatus status = HUFF_OK;
+	results.push_back(timePhase(input, "header", options, [&]() {
+		status = readHeader(compressed.data(), compressed.size(), header);
+	}));
+	if (status != HUFF_OK)
+		return false;
+
+	// Every decode phase has to give the input back. The buffer starts out
+	// as the complement of the input, so a byte the phase does not write
+	// is caught as well as a wrong one.
+	vector<unsigned char> decoded(size + MAX_SYMBOLS_PER_ENTRY);
+	vector<decodeTable> decodeTables;
+	auto decodePhase = [&](const char* phase, auto decode) {
+		for (size_t i = 0; i < size; i++)
+			decoded[i] = (unsigned char)~data[i];
+		bool decodedOk = true;
+		results.push_back(timePhase(input, phase, options, [&]() {
+			decodedOk = decode() && decodedOk;
+		}));
+		return decodedOk && equal(input.data.begin(), input.data.end(), decoded.begin());
+	};
+
+	BlockIndexEntry indexEntry;
+	indexEntry.originalSize = (unsigned int)size;
+	auto decodeWholeBlock = [&](const vector<char>& block, unsigned char flags) {
+		indexEntry.compressedSize = (unsigned int)block.size();
+		return decodeBlock((const unsigned char*)block.data(), indexEntry, flags, nullptr, decodeTables, decoded.data());
+	};
+
+	if (!decodePhase("decode", [&]() { return decodeWholeBlock(encoded, 0); }) ||
+		!decodePhase("decode-interleaved", [&]() { return decodeWholeBlock(interleaved, INTERLEAVED_STREAMS); }) ||
+		!decodePhase("decode-context", [&]() { return decodeWholeBlock(contextCoded, CONTEXT_MODEL); }) ||
+		!decodePhase("decode-runs", [&]() { return decodeWholeBlock(runLengthCoded, RUN_LENGTHS); }) ||
+		!decodePhase("decode-matches", [&]() { return decodeWholeBlock(matchCoded, MATCHES); }))
+		return false;
+
+	bool transformOk = decodePhase("decode-transform", [&]() {
+		bool blocksOk = true;
+		for (size_t block = 0; block < transformCoded.size(); block++) {
+			size_t start = block * DEFAULT_STREAM_BLOCK_SIZE;
+			BlockIndexEntry blockEntry;
+			blockEntry.compressedSize = (unsigned int)transformCoded[block].size();
+			blockEntry.originalSize = (unsigned int)min(size - start, (size_t)DEFAULT_STREAM_BLOCK_SIZE);
+			blocksOk = decodeBlock((const unsigned char*)transformCoded[block].data(), blockEntry, BURROWS_WHEELER, nullptr,
+				decodeTables, decoded.data() + start) && blocksOk;
+		}
+		return blocksOk;
+	});
+	if (!transformOk)
+		return false;
+
+	HuffDecoder decoder;
+	bool adaptiveOk = decodePhase("decode-adaptive", [&]() {
+		size_t decompressedSize = 0;
+		return decompress(decoder, adaptive.data(), adaptive.size(), decoded.data(), decoded.size(), decompressedSize) == HUFF_DONE
+			&& decompressedSize == size;
+	});
+	if (!adaptiveOk)
+		return false;
+
+	results.push_back(timePhase(input, "write-decoded", options, [&]() {
+		ofstream fout(outFileName, ios::binary | ios::out | ios::trunc);
+		fout.write((const char*)decoded.data(), size);
+	}));
+
+	return true;
+}
+#pragma endregion timing
+
+#pragma region output
+double megabytesPerSecond(size_t bytes, double seconds) {
+	return seconds > 0 ? bytes / seconds / MB_PER_SECOND : 0;
+}
+
+void printText(const vector<BenchInput>& inputs, const vector<PhaseResult>& results) {
+	cout << left << setw(24) << "input" << setw(20) << "phase" << right << setw(12) << "bytes"
+		<< setw(12) << "median ms" << setw(12) << "MB/s" << setw(12) << "best MB/s" << endl;
+	cout << fixed << setprecision(3);
+	for (const PhaseResult& result : results) {
+		cout << left << setw(24) << result.input << setw(20) << result.phase << right << setw(12) << result.bytes
+			<< setw(12) << result.medianSeconds * 1000
+			<< setw(12) << megabytesPerSecond(result.bytes, result.medianSeconds)
+			<< setw(12) << megabytesPerSecond(result.bytes, result.bestSeconds) << endl;
+	}
+
+	cout << endl;
+	for (const BenchInput& input : inputs)
+		cout << left << setw(24) << input.name << right << setw(12) << input.data.size() << " -> " << input.compressedSize << endl;
+}
+
+void printCsv(const vector<PhaseResult>& results) {
+	cout << "input,phase,bytes,best_seconds,median_seconds,mb_per_second" << endl;
+	cout << setprecision(9);
+	for (const PhaseResult& result : results) {
+		cout << result.input << ',' << result.phase << ',' << result.bytes << ',' << result.bestSeconds << ','
+			<< result.medianSeconds << ',' << megabytesPerSecond(result.bytes, result.medianSeconds) << endl;
+	}
+}
+
+void printJson(const vector<BenchInput>& inputs, const vector<PhaseResult>& results, const BenchOptions& options) {
+	cout << setprecision(9);
+	cout << "{\n  \"repetitions\": " << options.repetitions << ",\n  \"warmup\": " << options.warmup << ",\n";
+
+	cout << "  \"inputs\": [";
+	for (size_t i = 0; i < inputs.size(); i++) {
+		cout << (i > 0 ? ",\n    " : "\n    ") << "{\"name\": " << jsonString(inputs[i].name)
+			<< ", \"size\": " << inputs[i].data.size() << ", \"compressedSize\": " << inputs[i].compressedSize << "}";
+	}
+	cout << "\n  ],\n";
+
+	cout << "  \"results\": [";
+	for (size_t i = 0; i < results.size(); i++) {
+		const PhaseResult& result = results[i];
+		cout << (i > 0 ? ",\n    " : "\n    ") << "{\"input\": " << jsonString(result.input)
+			<< ", \"phase\": " << jsonString(result.phase) << ", \"bytes\": " << result.bytes
+			<< ", \"bestSeconds\": " << result.bestSeconds << ", \"medianSeconds\": " << result.medianSeconds
+			<< ", \"mbPerSecond\": " << megabytesPerSecond(result.bytes, result.medianSeconds) << "}";
+	}
+	cout << "\n  ]\n}" << endl;
+}
+#pragma endregion output
+
+// Reads the number given to option. The whole of text has to be digits and
+// the number has to be from minValue to maxValue.
+bool readNumber(const string& option, const char* text, unsigned long minValue, unsigned long maxValue,
+		unsigned long& value) {
+	char* end = nullptr;
+	value = isdigit((unsigned char)text[0]) ? strtoul(text, &end, 10) : 0;
+	if (!end || *end != '\0' || value < minValue || value > maxValue) {
+		cerr << option << " needs a number from " << minValue << " to " << maxValue << endl;
+		return false;
+	}
+	return true;
+}
+
+// Reads the command line:
+//   -r <n>    timed repetitions of every phase
+//   -w <n>    untimed warmup runs of every phase
+//   -n <MB>   size of each synthetic input, 0 for none
+//   -f <fmt>  text, csv or json
+// Everything else is a file or directory to add to the corpus. Without
+// any, the corpus is the TestFiles directory.
+bool parseOptions(int argc, char* argv[], BenchOptions& options) {
+	unsigned long value;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "-r" && i + 1 < argc) {
+			if (!readNumber(arg, argv[++i], 1, MAX_REPETITIONS, value))
+				return false;
+			options.repetitions = (int)value;
+		}
+		else if (arg == "-w" && i + 1 < argc) {
+			if (!readNumber(arg, argv[++i], 0, MAX_REPETITIONS, value))
+				return false;
+			options.warmup = (int)value;
+		}
+		else if (arg == "-n" && i + 1 < argc) {
+			if (!readNumber(arg, argv[++i], 0, MAX_SYNTHETIC_SIZE, value))
+				return false;
+			options.syntheticSize = (size_t)value * MEGABYTE;
+		}
+		else if (arg == "-f" && i + 1 < argc)
+			options.format = argv[++i];
+		else if (arg.size() > 1 && arg[0] == '-') {
+			cerr << "Unknown option " << arg << endl;
+			return false;
+		}
+		else
+			options.paths.push_back(arg);
+	}
+
+	if (options.format != "text" && options.format != "csv" && options.format != "json") {
+		cerr << "-f needs text, csv or json" << endl;
+		return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	BenchOptions options;
+	if (!parseOptions(argc, argv, options)) {
+		cerr << "Usage: bench [-r repetitions] [-w warmup] [-n MB] [-f text|csv|json] [file | directory]..." << endl;
+		return 1;
+	}
+
+	vector<BenchInput> inputs;
+	if (options.paths.empty() && filesystem::is_directory(DEFAULT_CORPUS))
+		options.paths.push_back(DEFAULT_CORPUS);
+	for (const string& path : options.paths) {
+		if (!addCorpus(path, inputs))
+			return 1;
+	}
+	if (options.syntheticSize > 0)
+		addSynthetic(options.syntheticSize, inputs);
+
+	// The process id keeps the files of benches run at the same time apart
+	error_code error;
+	filesystem::path tempDir = filesystem::temp_directory_path(error) / ("huffpuff-bench-" + to_string(getpid()));
+	filesystem::create_directories(tempDir, error);
+
+	vector<PhaseResult> results;
+	int numFailed = 0;
+	for (BenchInput& input : inputs) {
+		if (!benchInput(input, tempDir, options, results)) {
+			cerr << "Round trip failed for " << input.name << endl;
+			numFailed++;
+		}
+	}
+	filesystem::remove_all(tempDir, error);
+
+	if (options.format == "json")
+		printJson(inputs, results, options);
+	else if (options.format == "csv")
+		printCsv(results);
+	else
+		printText(inputs, results);
+
+	return numFailed > 0 ? 1 : 0;
+}
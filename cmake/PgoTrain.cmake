@@ -0,0 +1,78 @@
+# Collects the PGO profile of a HUFFPUFF_PGO=GENERATE build. Every file of
+# CORPUS is compressed by HUFF in each of its modes and decompressed again
+# by PUFF, and the round trip is checked. Clang profiles are then merged
+# into the one file the USE build reads.
+#
+# Run through the pgo-train target, which passes HUFF, PUFF, CORPUS,
+# WORK_DIR, PROFILE_DIR and COMPILER_ID.
+foreach(variable HUFF PUFF CORPUS WORK_DIR PROFILE_DIR)
+  if(NOT DEFINED ${variable})
+    message(FATAL_ERROR "${variable} is not set")
+  endif()
+endforeach()
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}")
+
+file(GLOB corpus_files LIST_DIRECTORIES false "${CORPUS}/*")
+list(FILTER corpus_files EXCLUDE REGEX "\\.huf$")
+if(NOT corpus_files)
+  message(FATAL_ERROR "No files to train on in ${CORPUS}")
+endif()
+
+# Each mode is a name followed by the huff options it runs with
+set(modes
+  "default"
+  "canonical -c"
+  "limited -l 12"
+  "blocks -b 64"
+  "shared -b 64 -g"
+  "interleaved -b 64 -i"
+  "stream -s"
+  "adaptive -a"
+  "context -x"
+  "runs -r"
+  "matches -z 6"
+  "transform -m")
+
+list(LENGTH modes num_modes)
+foreach(corpus_file IN LISTS corpus_files)
+  get_filename_component(name "${corpus_file}" NAME)
+  foreach(mode IN LISTS modes)
+    separate_arguments(options UNIX_COMMAND "${mode}")
+    list(POP_FRONT options mode_name)
+    set(huf_file "${WORK_DIR}/${name}.${mode_name}.huf")
+    set(out_file "${WORK_DIR}/${name}.${mode_name}.out")
+
+    execute_process(COMMAND "${HUFF}" ${options} -o "${huf_file}" "${corpus_file}"
+      RESULT_VARIABLE result OUTPUT_QUIET)
+    if(NOT result EQUAL 0)
+      message(FATAL_ERROR "huff ${options} failed on ${name}")
+    endif()
+
+    execute_process(COMMAND "${PUFF}" -o "${out_file}" "${huf_file}"
+      RESULT_VARIABLE result OUTPUT_QUIET)
+    if(NOT result EQUAL 0)
+      message(FATAL_ERROR "puff failed on ${name} compressed with ${options}")
+    endif()
+
+    execute_process(COMMAND "${CMAKE_COMMAND}" -E compare_files "${corpus_file}" "${out_file}"
+      RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+      message(FATAL_ERROR "${name} did not survive the round trip with ${options}")
+    endif()
+  endforeach()
+endforeach()
+
+if(COMPILER_ID MATCHES "Clang")
+  find_program(LLVM_PROFDATA NAMES llvm-profdata REQUIRED)
+  file(GLOB raw_profiles "${PROFILE_DIR}/*.profraw")
+  execute_process(COMMAND "${LLVM_PROFDATA}" merge -o "${PROFILE_DIR}/huffpuff.profdata" ${raw_profiles}
+    RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "llvm-profdata could not merge the profiles")
+  endif()
+endif()
+
+list(LENGTH corpus_files num_files)
+message(STATUS "Trained on ${num_files} files in ${num_modes} modes, profile in ${PROFILE_DIR}")
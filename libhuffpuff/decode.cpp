@@ -0,0 +1,1837 @@
+// decode.cpp
+// the decompressing half of libhuffpuff: the decode tables, the .huf
+// header reader and the decoders for whole blocks and for streams.
+
+#include "huffpuff.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+using std::string;
+using std::vector;
+
+namespace huffpuff {
+
+/*
+	the stages a streaming decoder goes through.  block and stream format
+	files go round from DECODER_NEXT_BLOCK to DECODER_SKIPPING once for
+	every block, or through DECODER_WHOLE_BLOCK and DECODER_DRAINING when
+	the blocks have interleaved streams.  blocks with reused trees stop
+	at DECODER_TREE_DISTANCE first.  adaptive streams stay in
+	DECODER_ADAPTIVE until their end of file.  stored blocks and files
+	are copied through at DECODER_STORED.
+*/
+const int DECODER_HEADER = 0;
+const int DECODER_NEXT_BLOCK = 1;
+const int DECODER_FRAME_SIZES = 2;
+const int DECODER_TREE_DISTANCE = 3;
+const int DECODER_CODE_LENGTHS = 4;
+const int DECODER_DECODING = 5;
+const int DECODER_SKIPPING = 6;
+const int DECODER_WHOLE_BLOCK = 7;
+const int DECODER_DRAINING = 8;
+const int DECODER_ADAPTIVE = 9;
+const int DECODER_STORED = 10;
+const int DECODER_FINISHED = 11;
+
+// the streaming decoder has not read any block's code lengths yet
+const size_t NO_TREE_BLOCK = SIZE_MAX;
+
+// the original and canonical formats are one stream with no sizes given
+const unsigned long long NO_LIMIT = ULLONG_MAX;
+
+// an adaptive stream is decoded by walking the huffman table while its
+// codes are rebuilt more often than this, as building the decode tables
+// would take longer than the glyphs between rebuilds take to walk
+const unsigned int ADAPTIVE_TABLE_INTERVAL = 16 * 1024;
+
+// block flags whose blocks are decoded whole by decodeBlock
+const unsigned char WHOLE_BLOCK_FLAGS = INTERLEAVED_STREAMS | CONTEXT_MODEL | RUN_LENGTHS | MATCHES | BURROWS_WHEELER;
+
+// block flags whose blocks are coded with codes of their own kind
+const unsigned char OWN_CODE_FLAGS = CONTEXT_MODEL | RUN_LENGTHS | MATCHES | BURROWS_WHEELER;
+
+// symbol tables are indexed by this many bits of the encoded data
+const int SYMBOL_TABLE_BITS = 10;
+const int NO_SYMBOL = -1;
+
+/*
+	one entry of a symbol table: the symbol whose code the index starts
+	with and the length of that code, or longCode when the code is longer
+	than the index
+*/
+struct symbolEntry
+{
+	unsigned short symbol = 0;
+	unsigned char length = 0;
+	bool longCode = true;
+};
+
+/*
+	a canonical code that is decoded a symbol at a time.  codes of up to
+	SYMBOL_TABLE_BITS bits are looked up in entries, and longer ones are
+	found by counting through the codes of each length, whose symbols
+	sortedSymbols lists in code order.
+*/
+struct symbolTable
+{
+	vector<symbolEntry> entries;
+	int lengthCounts[MAX_SYMBOL_CODE_LENGTH + 1];
+	vector<unsigned short> sortedSymbols;
+	int maxLength = 0;
+};
+
+/*
+	reads the bits of a whole block, least significant bit first.  the
+	zero bits it makes up past the end are counted in bitsPastEnd so a
+	block that runs out can be told apart.
+*/
+struct bitReader
+{
+	const unsigned char* next;
+	const unsigned char* end;
+	uint64_t bitBuffer = 0;
+	int bitsInBuffer = 0;
+	int bitsPastEnd = 0;
+};
+
+/*
+	fill in decodeTables[tableIndex] by walking the huffman table from
+	startNode once for every possible tableBits-bit index.  sub tables
+	are created on demand and shared between entries that stop at the
+	same merge node, which subTableForNode keeps track of.  a sub table
+	is indexed by no more bits than the longest code below its node
+	needs, so the short ones of the many rare glyphs stay small.
+*/
+void buildDecodeTable(const tableNode* huffTable, int startNode, int tableIndex,
+	vector<decodeTable>& decodeTables, vector<int>& subTableForNode, const vector<int>& subtreeHeight)
+{
+	int tableBits = decodeTables[tableIndex].tableBits;
+	int tableSize = 1 << tableBits;
+
+	for (int index = 0; index < tableSize; index++)
+	{
+		decodeEntry entry;
+		int huffTablePosition = startNode;
+
+		for (int bitPos = 0; bitPos < tableBits; bitPos++)
+		{
+			// if the bit is 1, move to right child, otherwise to the left child
+			if (index & (1 << bitPos))
+				huffTablePosition = huffTable[huffTablePosition].rightChild;
+			else
+				huffTablePosition = huffTable[huffTablePosition].leftChild;
+
+			if (huffTable[huffTablePosition].glyph == MERGE_NODE)
+				continue;
+
+			// found a leaf, so everything up to this bit belongs to the entry
+			entry.bitsUsed = bitPos + 1;
+			if (huffTable[huffTablePosition].glyph == END_OF_FILE)
+			{
+				entry.endOfFile = true;
+				break;
+			}
+
+			entry.symbols[entry.symbolCount++] = (unsigned char)huffTable[huffTablePosition].glyph;
+			if (entry.symbolCount == MAX_SYMBOLS_PER_ENTRY)
+				break;
+
+			// start back at the root of the huff table
+			huffTablePosition = ROOT;
+		}
+
+		// no code ended inside of this index, so continue in a sub table
+		if (entry.symbolCount == 0 && !entry.endOfFile)
+		{
+			entry.bitsUsed = tableBits;
+			if (subTableForNode[huffTablePosition] == NO_SUB_TABLE)
+			{
+				int subTable = decodeTables.size();
+				subTableForNode[huffTablePosition] = subTable;
+				decodeTables.push_back(decodeTable{ std::min(SUB_TABLE_BITS, subtreeHeight[huffTablePosition]), {} });
+				buildDecodeTable(huffTable, huffTablePosition, subTable, decodeTables, subTableForNode, subtreeHeight);
+			}
+			entry.subTable = subTableForNode[huffTablePosition];
+		}
+
+		decodeTables[tableIndex].entries.push_back(entry);
+	}
+}
+
+/*
+	the number of bits of the longest code below node
+*/
+int findSubtreeHeight(const tableNode* huffTable, int node, vector<int>& subtreeHeight)
+{
+	if (huffTable[node].glyph != MERGE_NODE)
+		return subtreeHeight[node] = 0;
+	return subtreeHeight[node] = 1 + std::max(findSubtreeHeight(huffTable, huffTable[node].leftChild, subtreeHeight),
+		findSubtreeHeight(huffTable, huffTable[node].rightChild, subtreeHeight));
+}
+
+void buildDecodeTables(const tableNode* huffTable, vector<decodeTable>& decodeTables)
+{
+	vector<int> subTableForNode(MAX_HUFFMAN_TABLE, NO_SUB_TABLE);
+	vector<int> subtreeHeight(MAX_HUFFMAN_TABLE, 0);
+
+	decodeTables.clear();
+	decodeTables.push_back(decodeTable{ PRIMARY_TABLE_BITS, {} });
+
+	if (huffTable[ROOT].glyph == MERGE_NODE)
+	{
+		findSubtreeHeight(huffTable, ROOT, subtreeHeight);
+		buildDecodeTable(huffTable, ROOT, ROOT_TABLE, decodeTables, subTableForNode, subtreeHeight);
+	}
+	else
+	{
+		// a lone leaf at the root is the end of file glyph, which is
+		// encoded with zero bits
+		decodeEntry entry;
+		entry.endOfFile = true;
+		decodeTables[ROOT_TABLE].entries.assign(1 << PRIMARY_TABLE_BITS, entry);
+	}
+}
+
+/*
+	read numBits bits from packed, least significant bit first, starting
+	at bit bitCount.  bits past the end of packed read as zero.
+*/
+unsigned int unpackBits(const unsigned char* packed, size_t size, size_t& bitCount, int numBits)
+{
+	unsigned int value = 0;
+	for (int i = 0; i < numBits; i++)
+	{
+		size_t byte = bitCount / BYTE_SIZE;
+		if (byte < size && (packed[byte] & (1 << (bitCount % BYTE_SIZE))))
+			value |= 1u << i;
+		bitCount++;
+	}
+	return value;
+}
+
+/*
+	the canonical header is a bitmap of the glyphs that have a code,
+	one byte giving the number of bits used per code length, and then
+	the code length of every glyph in the bitmap.  returns the number
+	of bytes the code lengths take up, or 0 if packed is too short.
+*/
+size_t unpackCodeLengths(const unsigned char* packed, size_t size, int codeLengths[], int numSymbols)
+{
+	size_t bitCount = 0;
+
+	for (int glyph = 0; glyph < numSymbols; glyph++)
+		codeLengths[glyph] = unpackBits(packed, size, bitCount, 1) ? 0 : NO_CODE;
+
+	// no code is long enough to need more than a byte for its length
+	int lengthBits = unpackBits(packed, size, bitCount, BYTE_SIZE);
+	if (lengthBits > BYTE_SIZE)
+		return 0;
+	for (int glyph = 0; glyph < numSymbols; glyph++)
+	{
+		if (codeLengths[glyph] != NO_CODE)
+			codeLengths[glyph] = unpackBits(packed, size, bitCount, lengthBits);
+	}
+
+	size_t bytesUsed = (bitCount + BYTE_SIZE - 1) / BYTE_SIZE;
+	return bytesUsed <= size ? bytesUsed : 0;
+}
+
+/*
+	the bitmap says how many glyphs have a code and the byte after it
+	how many bits each code length takes, which is all it takes to
+	work out the size of the rest
+*/
+size_t packedCodeLengthsSize(const unsigned char* prefix)
+{
+	size_t bitCount = 0;
+	size_t glyphsWithCodes = 0;
+	for (int glyph = 0; glyph < NUM_SYMBOLS; glyph++)
+		glyphsWithCodes += unpackBits(prefix, CODE_LENGTHS_PREFIX_SIZE, bitCount, 1);
+	int lengthBits = unpackBits(prefix, CODE_LENGTHS_PREFIX_SIZE, bitCount, BYTE_SIZE);
+
+	return (bitCount + glyphsWithCodes * lengthBits + BYTE_SIZE - 1) / BYTE_SIZE;
+}
+
+/*
+	rebuild the huffman table that canonical codes describe.  the tree
+	is grown one level at a time: the open slots of a level are the
+	children of the previous level's merge nodes from left to right,
+	the glyphs with that code length take the leftmost slots in glyph
+	order and the rest of the slots become merge nodes.  returns the
+	number of entries used, or 0 if the code lengths are not a valid code.
+*/
+int buildTableFromCodeLengths(const int codeLengths[], tableNode* huffTable)
+{
+	int entriesInTable = 1;
+	int maxCodeLength = 0;
+	int glyphsLeft = 0;
+	for (int glyph = 0; glyph < NUM_SYMBOLS; glyph++)
+	{
+		if (codeLengths[glyph] != NO_CODE)
+		{
+			maxCodeLength = std::max(maxCodeLength, codeLengths[glyph]);
+			glyphsLeft++;
+		}
+	}
+
+	// a single glyph (only the end of file) sits at the root with no code
+	if (maxCodeLength == 0)
+	{
+		if (glyphsLeft != 1 || codeLengths[END_OF_FILE] != 0)
+			return 0;
+		huffTable[ROOT] = tableNode{ END_OF_FILE, -1, -1 };
+		return 1;
+	}
+
+	huffTable[ROOT] = tableNode{ MERGE_NODE, -1, -1 };
+	vector<int> mergeNodes(1, ROOT);
+	for (int codeLength = 1; codeLength <= maxCodeLength; codeLength++)
+	{
+		vector<int> nextMergeNodes;
+		int nextGlyph = 0;
+		for (size_t slot = 0; slot < 2 * mergeNodes.size(); slot++)
+		{
+			while (nextGlyph < NUM_SYMBOLS && codeLengths[nextGlyph] != codeLength)
+				nextGlyph++;
+
+			if (entriesInTable == MAX_HUFFMAN_TABLE)
+				return 0;
+			int node = entriesInTable++;
+			if (nextGlyph < NUM_SYMBOLS)
+			{
+				huffTable[node] = tableNode{ nextGlyph++, -1, -1 };
+				glyphsLeft--;
+			}
+			else
+			{
+				huffTable[node] = tableNode{ MERGE_NODE, -1, -1 };
+				nextMergeNodes.push_back(node);
+			}
+
+			tableNode& parent = huffTable[mergeNodes[slot / 2]];
+			if (slot % 2 == 0)
+				parent.leftChild = node;
+			else
+				parent.rightChild = node;
+		}
+
+		// more glyphs of this length than there were slots for
+		while (nextGlyph < NUM_SYMBOLS && codeLengths[nextGlyph] != codeLength)
+			nextGlyph++;
+		if (nextGlyph < NUM_SYMBOLS)
+			return 0;
+
+		mergeNodes.swap(nextMergeNodes);
+	}
+
+	// every slot must be filled for the code to be complete
+	if (!mergeNodes.empty() || glyphsLeft != 0)
+		return 0;
+	return entriesInTable;
+}
+
+/*
+	check that the tree of an original format file really is a tree:
+	every merge node has two children inside the table, no node is
+	reached twice and every leaf is a glyph.  the root can only be a
+	leaf in an empty file, where it is the end of file glyph.
+*/
+bool validHuffTable(const vector<tableNode>& huffTable)
+{
+	vector<bool> reached(huffTable.size(), false);
+	vector<int> nodes(1, ROOT);
+	reached[ROOT] = true;
+
+	while (!nodes.empty())
+	{
+		const tableNode& node = huffTable[nodes.back()];
+		nodes.pop_back();
+
+		if (node.glyph == MERGE_NODE)
+		{
+			for (int child : { node.leftChild, node.rightChild })
+			{
+				if (child < 0 || child >= (int)huffTable.size() || reached[child])
+					return false;
+				reached[child] = true;
+				nodes.push_back(child);
+			}
+		}
+		else if (node.glyph < 0 || node.glyph > END_OF_FILE)
+			return false;
+	}
+
+	return huffTable[ROOT].glyph == MERGE_NODE || huffTable[ROOT].glyph == END_OF_FILE;
+}
+
+HuffStatus readHeader(const unsigned char* data, size_t size, HuffHeader& header)
+{
+	size_t position = 0;
+
+	// the next fieldSize bytes are not there yet
+	auto needInput = [&](unsigned long long fieldSize)
+	{
+		header.size = (size_t)(position + fieldSize);
+		return HUFF_NEED_INPUT;
+	};
+	auto readField = [&](void* field, size_t fieldSize)
+	{
+		if (size - position < fieldSize)
+			return false;
+		memcpy(field, data + position, fieldSize);
+		position += fieldSize;
+		return true;
+	};
+
+	// the .huf file will have a consistent order of the first line :
+	// <length of name> -<file name(with original extension)> -<size of huffman table>
+
+	// canonical files start with a magic number and a format version,
+	// original files start straight away with the file name length
+	unsigned int firstWord = 0;
+	unsigned int fileNameLength = 0;
+	if (!readField(&firstWord, sizeof(firstWord)))
+		return needInput(sizeof(firstWord));
+
+	header.formatVersion = ORIGINAL_FORMAT;
+	if (firstWord == CANONICAL_MAGIC)
+	{
+		if (!readField(&header.formatVersion, sizeof(header.formatVersion)))
+			return needInput(sizeof(header.formatVersion));
+		if (header.formatVersion < CANONICAL_FORMAT_VERSION || header.formatVersion > STORED_FORMAT_VERSION)
+			return HUFF_INVALID_DATA;
+		if (!readField(&fileNameLength, sizeof(fileNameLength)))
+			return needInput(sizeof(fileNameLength));
+	}
+	else
+		fileNameLength = firstWord;
+
+	if (fileNameLength > MAX_STORED_NAME)
+		return HUFF_INVALID_DATA;
+	if (size - position < fileNameLength)
+		return needInput(fileNameLength);
+	header.storedName.assign((const char*)data + position, fileNameLength);
+	position += fileNameLength;
+
+	if (header.formatVersion == ORIGINAL_FORMAT)
+	{
+		// the tree, one table entry at a time
+		int entriesInTable = 0;
+		if (!readField(&entriesInTable, sizeof(entriesInTable)))
+			return needInput(sizeof(entriesInTable));
+		if (entriesInTable < 1 || entriesInTable > MAX_HUFFMAN_TABLE)
+			return HUFF_INVALID_DATA;
+
+		size_t tableSize = entriesInTable * sizeof(tableNode);
+		if (size - position < tableSize)
+			return needInput(tableSize);
+		header.huffTable.resize(entriesInTable);
+		memcpy(header.huffTable.data(), data + position, tableSize);
+		position += tableSize;
+
+		if (!validHuffTable(header.huffTable))
+			return HUFF_INVALID_DATA;
+	}
+
+	unsigned int numBlocks = 0;
+	header.flags = 0;
+	if (header.formatVersion == BLOCK_FORMAT_VERSION)
+	{
+		if (!readField(&numBlocks, sizeof(numBlocks)))
+			return needInput(sizeof(numBlocks));
+		if (!readField(&header.flags, sizeof(header.flags)))
+			return needInput(sizeof(header.flags));
+		if ((header.flags & SHARED_TREE) && (header.flags & REUSED_TREES))
+			return HUFF_INVALID_DATA;
+		// blocks with codes of their own have just the one flag
+		unsigned char ownCode = header.flags & OWN_CODE_FLAGS;
+		if (ownCode && ((header.flags & ~STORED_BLOCKS) != ownCode || (ownCode & (ownCode - 1))))
+			return HUFF_INVALID_DATA;
+	}
+
+	// the code lengths of the canonical format, or the ones every block shares
+	if (header.formatVersion == CANONICAL_FORMAT_VERSION || (header.flags & SHARED_TREE))
+	{
+		if (size - position < CODE_LENGTHS_PREFIX_SIZE)
+			return needInput(CODE_LENGTHS_PREFIX_SIZE);
+		size_t codeLengthsSize = packedCodeLengthsSize(data + position);
+		if (size - position < codeLengthsSize)
+			return needInput(codeLengthsSize);
+		if (unpackCodeLengths(data + position, codeLengthsSize, header.codeLengths) == 0)
+			return HUFF_INVALID_DATA;
+		position += codeLengthsSize;
+	}
+
+	// how often the adaptive format rebuilds its codes, and how long they may be
+	if (header.formatVersion == ADAPTIVE_FORMAT_VERSION)
+	{
+		unsigned char maxCodeLength = 0;
+		if (!readField(&header.rebuildInterval, sizeof(header.rebuildInterval)))
+			return needInput(sizeof(header.rebuildInterval));
+		if (!readField(&maxCodeLength, sizeof(maxCodeLength)))
+			return needInput(sizeof(maxCodeLength));
+		if (header.rebuildInterval == 0 || header.rebuildInterval > MAX_REBUILD_INTERVAL ||
+			maxCodeLength < MIN_CODE_LENGTH_LIMIT || maxCodeLength > MAX_CODE_LENGTH)
+			return HUFF_INVALID_DATA;
+		header.maxCodeLength = maxCodeLength;
+	}
+
+	// the size of a stored file
+	if (header.formatVersion == STORED_FORMAT_VERSION && !readField(&header.storedSize, sizeof(header.storedSize)))
+		return needInput(sizeof(header.storedSize));
+
+	header.blockIndex.clear();
+	if (header.formatVersion == BLOCK_FORMAT_VERSION)
+	{
+		unsigned long long indexSize = (unsigned long long)numBlocks * sizeof(BlockIndexEntry);
+		if (size - position < indexSize)
+			return needInput(indexSize);
+		header.blockIndex.resize(numBlocks);
+		if (indexSize > 0)
+			memcpy(header.blockIndex.data(), data + position, (size_t)indexSize);
+		position += (size_t)indexSize;
+	}
+
+	header.size = position;
+	return HUFF_OK;
+}
+
+bool decodeSymbols(const vector<decodeTable>& decodeTables, decodeState& state,
+	const unsigned char*& in, const unsigned char* inEnd, unsigned char*& out, unsigned char* outEnd)
+{
+	uint64_t bitBuffer = state.bitBuffer;
+	int bitsInBuffer = state.bitsInBuffer;
+	int currentTable = state.currentTable;
+	bool endOfFile = state.endOfFile;
+	const unsigned char* next = in;
+	unsigned char* to = out;
+
+	while (!endOfFile && outEnd - to >= MAX_SYMBOLS_PER_ENTRY)
+	{
+		// top up the bit buffer one byte at a time, least significant bit first
+		while (bitsInBuffer <= 56 && next < inEnd)
+		{
+			bitBuffer |= (uint64_t)*next++ << bitsInBuffer;
+			bitsInBuffer += 8;
+		}
+
+		const decodeTable& table = decodeTables[currentTable];
+		const decodeEntry& entry = table.entries[bitBuffer & ((1u << table.tableBits) - 1)];
+
+		// the rest of the code has not arrived yet
+		if (entry.bitsUsed > bitsInBuffer)
+			break;
+
+		bitBuffer >>= entry.bitsUsed;
+		bitsInBuffer -= entry.bitsUsed;
+
+		// the code continues past the end of this table
+		if (entry.subTable != NO_SUB_TABLE)
+		{
+			currentTable = entry.subTable;
+			continue;
+		}
+
+		memcpy(to, entry.symbols, MAX_SYMBOLS_PER_ENTRY);
+		to += entry.symbolCount;
+
+		endOfFile = entry.endOfFile;
+		currentTable = ROOT_TABLE;
+	}
+
+	state.bitBuffer = bitBuffer;
+	state.bitsInBuffer = bitsInBuffer;
+	state.currentTable = currentTable;
+	state.endOfFile = endOfFile;
+	in = next;
+	out = to;
+	return endOfFile;
+}
+
+/*
+	decode glyphs like decodeSymbols, but one at a time by walking the
+	huffman table a bit at a time, until out is full.  this needs no
+	decode tables, and never decodes a glyph past outEnd.
+*/
+bool walkSymbols(const tableNode* huffTable, decodeState& state,
+	const unsigned char*& in, const unsigned char* inEnd, unsigned char*& out, unsigned char* outEnd)
+{
+	while (!state.endOfFile && out < outEnd)
+	{
+		while (state.bitsInBuffer <= 56 && in < inEnd)
+		{
+			state.bitBuffer |= (uint64_t)*in++ << state.bitsInBuffer;
+			state.bitsInBuffer += 8;
+		}
+
+		int node = ROOT;
+		int bitsUsed = 0;
+		while (huffTable[node].glyph == MERGE_NODE)
+		{
+			// the rest of the code has not arrived yet
+			if (bitsUsed == state.bitsInBuffer)
+				return false;
+			if ((state.bitBuffer >> bitsUsed) & 1)
+				node = huffTable[node].rightChild;
+			else
+				node = huffTable[node].leftChild;
+			bitsUsed++;
+		}
+
+		state.bitBuffer >>= bitsUsed;
+		state.bitsInBuffer -= bitsUsed;
+		if (huffTable[node].glyph == END_OF_FILE)
+			state.endOfFile = true;
+		else
+			*out++ = (unsigned char)huffTable[node].glyph;
+	}
+	return state.endOfFile;
+}
+
+/*
+	decode the rest of one stream of an interleaved block into the
+	segment that ends at segmentEnd.  the last few glyphs are decoded
+	into symbols first so nothing is written past the segment.
+*/
+bool finishStream(const vector<decodeTable>& decodeTables, decodeState& state,
+	const unsigned char* in, const unsigned char* inEnd, unsigned char* out, unsigned char* segmentEnd)
+{
+	decodeSymbols(decodeTables, state, in, inEnd, out, segmentEnd);
+	while (!state.endOfFile)
+	{
+		unsigned char symbols[MAX_SYMBOLS_PER_ENTRY];
+		unsigned char* symbolsEnd = symbols;
+		decodeSymbols(decodeTables, state, in, inEnd, symbolsEnd, symbols + MAX_SYMBOLS_PER_ENTRY);
+
+		size_t count = symbolsEnd - symbols;
+		if ((count == 0 && !state.endOfFile) || count > (size_t)(segmentEnd - out))
+			return false;
+		memcpy(out, symbols, count);
+		out += count;
+	}
+	return out == segmentEnd;
+}
+
+/*
+	decode the NUM_STREAMS streams of an interleaved block, which start
+	with their jump table at in.  while every stream has room for a
+	whole table entry and a word of input left, the streams take turns
+	at one lookup each, so the lookups do not wait on each other.  each
+	stream then finishes on its own.
+*/
+bool decodeStreams(const vector<decodeTable>& decodeTables, const unsigned char* in, const unsigned char* inEnd,
+	unsigned char* out, size_t size)
+{
+	if ((size_t)(inEnd - in) < JUMP_TABLE_SIZE)
+		return false;
+
+	const unsigned char* streamEnd[NUM_STREAMS];
+	const unsigned char* next[NUM_STREAMS];
+	unsigned char* to[NUM_STREAMS];
+	unsigned char* segmentEnd[NUM_STREAMS];
+	decodeState state[NUM_STREAMS];
+	size_t segment = segmentSize(size);
+
+	next[0] = in + JUMP_TABLE_SIZE;
+	for (int stream = 0; stream < NUM_STREAMS; stream++)
+	{
+		unsigned int streamSize = (unsigned int)(inEnd - next[stream]);
+		if (stream < NUM_STREAMS - 1)
+			memcpy(&streamSize, in + stream * sizeof(streamSize), sizeof(streamSize));
+		if (streamSize > (size_t)(inEnd - next[stream]))
+			return false;
+		streamEnd[stream] = next[stream] + streamSize;
+		if (stream < NUM_STREAMS - 1)
+			next[stream + 1] = streamEnd[stream];
+
+		to[stream] = out + std::min(stream * segment, size);
+		segmentEnd[stream] = out + std::min(stream * segment + segment, size);
+	}
+
+	const decodeTable& rootTable = decodeTables[ROOT_TABLE];
+	const uint64_t rootMask = ((uint64_t)1 << rootTable.tableBits) - 1;
+	bool allStreamsReady = true;
+	while (allStreamsReady)
+	{
+		for (int stream = 0; stream < NUM_STREAMS; stream++)
+		{
+			allStreamsReady = allStreamsReady && segmentEnd[stream] - to[stream] >= MAX_SYMBOLS_PER_ENTRY &&
+				streamEnd[stream] - next[stream] >= (ptrdiff_t)sizeof(uint64_t);
+		}
+		if (!allStreamsReady)
+			break;
+
+		for (int stream = 0; stream < NUM_STREAMS; stream++)
+		{
+			// top up the bit buffer to at least 56 bits with one load
+			decodeState& current = state[stream];
+			uint64_t word;
+			memcpy(&word, next[stream], sizeof(word));
+			current.bitBuffer |= word << current.bitsInBuffer;
+			next[stream] += (63 - current.bitsInBuffer) >> 3;
+			current.bitsInBuffer |= 56;
+
+			// codes that go on into a sub table, and the end of file,
+			// take the long way round
+			const decodeEntry& entry = rootTable.entries[current.bitBuffer & rootMask];
+			if (entry.subTable != NO_SUB_TABLE || entry.endOfFile)
+			{
+				decodeSymbols(decodeTables, current, next[stream], streamEnd[stream], to[stream], to[stream] + MAX_SYMBOLS_PER_ENTRY);
+				if (current.endOfFile)
+					return false;
+				continue;
+			}
+
+			memcpy(to[stream], entry.symbols, MAX_SYMBOLS_PER_ENTRY);
+			to[stream] += entry.symbolCount;
+			current.bitBuffer >>= entry.bitsUsed;
+			current.bitsInBuffer -= entry.bitsUsed;
+		}
+	}
+
+	for (int stream = 0; stream < NUM_STREAMS; stream++)
+	{
+		if (!finishStream(decodeTables, state[stream], next[stream], streamEnd[stream], to[stream], segmentEnd[stream]))
+			return false;
+	}
+	return true;
+}
+
+/*
+	read the tree distance a block with reused trees starts with.  returns
+	the number of bytes it takes up, or 0 if block stops short of its end.
+*/
+size_t readTreeDistance(const unsigned char* block, size_t size, unsigned int& treeDistance)
+{
+	treeDistance = 0;
+	for (size_t position = 0; position < size && position < MAX_TREE_DISTANCE_SIZE; position++)
+	{
+		treeDistance |= (unsigned int)(block[position] & ~MORE_DISTANCE_BYTES) << (position * TREE_DISTANCE_BITS);
+		if (!(block[position] & MORE_DISTANCE_BYTES))
+			return position + 1;
+	}
+	return 0;
+}
+
+/*
+	build the symbol table for the code lengths of numSymbols symbols.
+	returns false if they are not a complete code of at most
+	MAX_SYMBOL_CODE_LENGTH bits.  no codes at all make a table that
+	decodes nothing, and a single code of no bits one that decodes its
+	symbol from nothing.
+*/
+bool buildSymbolTable(const int codeLengths[], int numSymbols, symbolTable& table)
+{
+	std::fill(table.lengthCounts, table.lengthCounts + MAX_SYMBOL_CODE_LENGTH + 1, 0);
+	table.maxLength = 0;
+	table.sortedSymbols.clear();
+	table.entries.assign((size_t)1 << SYMBOL_TABLE_BITS, symbolEntry());
+
+	int numCodes = 0;
+	for (int symbol = 0; symbol < numSymbols; symbol++)
+	{
+		if (codeLengths[symbol] == NO_CODE)
+			continue;
+		if (codeLengths[symbol] < 0 || codeLengths[symbol] > MAX_SYMBOL_CODE_LENGTH)
+			return false;
+		table.lengthCounts[codeLengths[symbol]]++;
+		table.maxLength = std::max(table.maxLength, codeLengths[symbol]);
+		numCodes++;
+	}
+
+	if (table.lengthCounts[0] > 0)
+	{
+		if (numCodes > 1)
+			return false;
+		for (int symbol = 0; symbol < numSymbols; symbol++)
+		{
+			if (codeLengths[symbol] == 0)
+				table.entries.assign(table.entries.size(), symbolEntry{ (unsigned short)symbol, 0, false });
+		}
+		return true;
+	}
+
+	// every code has to be used, and none more than once
+	long long codesLeft = 1;
+	for (int length = 1; length <= table.maxLength; length++)
+	{
+		codesLeft = 2 * codesLeft - table.lengthCounts[length];
+		if (codesLeft < 0)
+			return false;
+	}
+	if (numCodes > 0 && codesLeft != 0)
+		return false;
+
+	// the codes are handed out as buildCanonicalCodes does, and the
+	// bits of each arrive in reverse
+	uint64_t nextCode[MAX_SYMBOL_CODE_LENGTH + 2] = {};
+	for (int length = 2; length <= MAX_SYMBOL_CODE_LENGTH + 1; length++)
+		nextCode[length] = (nextCode[length - 1] + table.lengthCounts[length - 1]) << 1;
+
+	for (int length = 1; length <= table.maxLength; length++)
+	{
+		for (int symbol = 0; symbol < numSymbols; symbol++)
+		{
+			if (codeLengths[symbol] != length)
+				continue;
+			table.sortedSymbols.push_back((unsigned short)symbol);
+
+			uint64_t code = nextCode[length]++;
+			size_t reversed = 0;
+			for (int bit = 0; bit < length && bit < SYMBOL_TABLE_BITS; bit++)
+			{
+				if (code & ((uint64_t)1 << (length - 1 - bit)))
+					reversed |= (size_t)1 << bit;
+			}
+
+			if (length > SYMBOL_TABLE_BITS)
+				table.entries[reversed].longCode = true;
+			else
+			{
+				for (size_t index = reversed; index < table.entries.size(); index += (size_t)1 << length)
+					table.entries[index] = symbolEntry{ (unsigned short)symbol, (unsigned char)length, false };
+			}
+		}
+	}
+	return true;
+}
+
+/*
+	top the bit buffer up to at least 56 bits
+*/
+inline void refillBits(bitReader& reader)
+{
+	if (reader.end - reader.next >= (ptrdiff_t)sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, reader.next, sizeof(word));
+		reader.bitBuffer |= word << reader.bitsInBuffer;
+		reader.next += (63 - reader.bitsInBuffer) >> 3;
+		reader.bitsInBuffer |= 56;
+		return;
+	}
+
+	while (reader.bitsInBuffer <= 56)
+	{
+		if (reader.next < reader.end)
+			reader.bitBuffer |= (uint64_t)*reader.next++ << reader.bitsInBuffer;
+		else
+			reader.bitsPastEnd += BYTE_SIZE;
+		reader.bitsInBuffer += BYTE_SIZE;
+	}
+}
+
+/*
+	make sure the bit buffer holds at least numBits bits, up to
+	MAX_SYMBOL_CODE_LENGTH.  returns false once the codes have run past
+	the end of the block.
+*/
+inline bool haveBits(bitReader& reader, int numBits)
+{
+	if (reader.bitsInBuffer < numBits)
+	{
+		if (reader.bitsPastEnd > reader.bitsInBuffer)
+			return false;
+		refillBits(reader);
+	}
+	return true;
+}
+
+/*
+	decode the next symbol, which the bit buffer has to hold all of.
+	returns NO_SYMBOL if the bits are not a code of the table.
+*/
+inline int decodeSymbol(const symbolTable& table, bitReader& reader)
+{
+	const symbolEntry& entry = table.entries[reader.bitBuffer & (((uint64_t)1 << SYMBOL_TABLE_BITS) - 1)];
+	if (!entry.longCode)
+	{
+		reader.bitBuffer >>= entry.length;
+		reader.bitsInBuffer -= entry.length;
+		return entry.symbol;
+	}
+
+	// count through the codes of each length, first bit first
+	long long code = 0;
+	long long firstCode = 0;
+	int firstIndex = 0;
+	for (int length = 1; length <= table.maxLength; length++)
+	{
+		code |= (reader.bitBuffer >> (length - 1)) & 1;
+		int count = table.lengthCounts[length];
+		if (code - firstCode < count)
+		{
+			reader.bitBuffer >>= length;
+			reader.bitsInBuffer -= length;
+			return table.sortedSymbols[firstIndex + (int)(code - firstCode)];
+		}
+		firstIndex += count;
+		firstCode = (firstCode + count) << 1;
+		code <<= 1;
+	}
+	return NO_SYMBOL;
+}
+
+/*
+	decode a CONTEXT_MODEL block of size bytes into the originalSize
+	bytes at out
+*/
+bool decodeContextBlock(const unsigned char* block, size_t size, unsigned char* out, size_t originalSize)
+{
+	if (size < 1)
+		return false;
+	int numClusters = block[0];
+	if (numClusters == 0 || numClusters > MAX_CONTEXT_CLUSTERS)
+		return false;
+
+	// the cluster of every context
+	int clusterBits = 0;
+	while ((1 << clusterBits) < numClusters)
+		clusterBits++;
+	size_t clustersSize = (NUM_CONTEXTS * clusterBits + BYTE_SIZE - 1) / BYTE_SIZE;
+	if (size - 1 < clustersSize)
+		return false;
+	int clusters[NUM_CONTEXTS];
+	size_t bitCount = 0;
+	for (int context = 0; context < NUM_CONTEXTS; context++)
+	{
+		clusters[context] = (int)unpackBits(block + 1, clustersSize, bitCount, clusterBits);
+		if (clusters[context] >= numClusters)
+			return false;
+	}
+
+	// the code lengths of every cluster
+	size_t position = 1 + clustersSize;
+	vector<symbolTable> tables(numClusters);
+	for (int cluster = 0; cluster < numClusters; cluster++)
+	{
+		int codeLengths[NUM_SYMBOLS];
+		size_t codeLengthsSize = unpackCodeLengths(block + position, size - position, codeLengths);
+		if (codeLengthsSize == 0 || !buildSymbolTable(codeLengths, NUM_SYMBOLS, tables[cluster]))
+			return false;
+		position += codeLengthsSize;
+	}
+
+	const symbolTable* contextTables[NUM_CONTEXTS];
+	for (int context = 0; context < NUM_CONTEXTS; context++)
+		contextTables[context] = &tables[clusters[context]];
+
+	bitReader reader{ block + position, block + size };
+	int context = 0;
+	for (size_t i = 0; i < originalSize; i++)
+	{
+		if (!haveBits(reader, MAX_SYMBOL_CODE_LENGTH))
+			return false;
+		context = decodeSymbol(*contextTables[context], reader);
+		if (context < 0 || context >= NUM_BYTE_VALUES)
+			return false;
+		out[i] = (unsigned char)context;
+	}
+	return reader.bitsPastEnd <= reader.bitsInBuffer;
+}
+
+/*
+	decode a RUN_LENGTHS block of size bytes into the originalSize bytes
+	at out.  every run is written with a single memset.
+*/
+bool decodeRunLengthBlock(const unsigned char* block, size_t size, unsigned char* out, size_t originalSize)
+{
+	int codeLengths[NUM_RUN_LENGTH_SYMBOLS];
+	symbolTable table;
+	size_t position = unpackCodeLengths(block, size, codeLengths, NUM_RUN_LENGTH_SYMBOLS);
+	if (position == 0 || !buildSymbolTable(codeLengths, NUM_RUN_LENGTH_SYMBOLS, table))
+		return false;
+
+	bitReader reader{ block + position, block + size };
+	unsigned char previous = 0;
+	size_t i = 0;
+	while (i < originalSize)
+	{
+		if (!haveBits(reader, MAX_SYMBOL_CODE_LENGTH))
+			return false;
+		int symbol = decodeSymbol(table, reader);
+		if (symbol >= 0 && symbol < NUM_BYTE_VALUES)
+		{
+			previous = (unsigned char)symbol;
+			out[i++] = previous;
+			continue;
+		}
+		if (symbol < FIRST_RUN_SYMBOL)
+			return false;
+
+		int extraBits = symbol - FIRST_RUN_SYMBOL;
+		if (!haveBits(reader, extraBits))
+			return false;
+		size_t repeats = ((size_t)1 << extraBits) | (size_t)(reader.bitBuffer & (((uint64_t)1 << extraBits) - 1));
+		reader.bitBuffer >>= extraBits;
+		reader.bitsInBuffer -= extraBits;
+		if (repeats > originalSize - i)
+			return false;
+		memset(out + i, previous, repeats);
+		i += repeats;
+	}
+	return reader.bitsPastEnd <= reader.bitsInBuffer;
+}
+
+/*
+	read the length or distance value that symbol starts, as
+	matchValueSymbol in encode.cpp codes them
+*/
+inline bool readMatchValue(bitReader& reader, int symbol, unsigned int& value)
+{
+	if (symbol < 4)
+	{
+		value = symbol;
+		return true;
+	}
+	int extraBits = symbol / 2 - 1;
+	if (!haveBits(reader, extraBits))
+		return false;
+	value = ((2u | (symbol & 1)) << extraBits) | (unsigned int)(reader.bitBuffer & (((uint64_t)1 << extraBits) - 1));
+	reader.bitBuffer >>= extraBits;
+	reader.bitsInBuffer -= extraBits;
+	return true;
+}
+
+/*
+	copy length bytes from distance bytes back to to, where the two may
+	overlap.  a match that starts at least 8 bytes back and leaves room
+	before outEnd is copied 8 bytes at a time, running over by up to 7
+	bytes that later symbols overwrite.  a nearer one repeats what has
+	been copied so far, doubling it each time.
+*/
+inline void copyMatch(unsigned char* to, size_t distance, size_t length, const unsigned char* outEnd)
+{
+	const unsigned char* from = to - distance;
+	if (distance >= sizeof(uint64_t) && (size_t)(outEnd - to) >= length + sizeof(uint64_t))
+	{
+		for (size_t copied = 0; copied < length; copied += sizeof(uint64_t))
+			memcpy(to + copied, from + copied, sizeof(uint64_t));
+		return;
+	}
+	if (distance >= length)
+	{
+		memcpy(to, from, length);
+		return;
+	}
+	if (distance == 1)
+	{
+		memset(to, *from, length);
+		return;
+	}
+	while (length > 0)
+	{
+		size_t chunk = std::min(length, (size_t)(to - from));
+		memcpy(to, from, chunk);
+		to += chunk;
+		length -= chunk;
+	}
+}
+
+/*
+	decode a MATCHES block of size bytes into the originalSize bytes at out
+*/
+bool decodeMatchBlock(const unsigned char* block, size_t size, unsigned char* out, size_t originalSize)
+{
+	int literalCodeLengths[NUM_LITERAL_LENGTH_SYMBOLS];
+	int distanceCodeLengths[NUM_DISTANCE_SYMBOLS];
+	symbolTable literalTable, distanceTable;
+	size_t literalLengthsSize = unpackCodeLengths(block, size, literalCodeLengths, NUM_LITERAL_LENGTH_SYMBOLS);
+	if (literalLengthsSize == 0 || !buildSymbolTable(literalCodeLengths, NUM_LITERAL_LENGTH_SYMBOLS, literalTable))
+		return false;
+	size_t distanceLengthsSize = unpackCodeLengths(block + literalLengthsSize, size - literalLengthsSize,
+		distanceCodeLengths, NUM_DISTANCE_SYMBOLS);
+	if (distanceLengthsSize == 0 || !buildSymbolTable(distanceCodeLengths, NUM_DISTANCE_SYMBOLS, distanceTable))
+		return false;
+
+	bitReader reader{ block + literalLengthsSize + distanceLengthsSize, block + size };
+	const unsigned char* outEnd = out + originalSize;
+	size_t i = 0;
+	while (i < originalSize)
+	{
+		if (!haveBits(reader, MAX_SYMBOL_CODE_LENGTH))
+			return false;
+		int symbol = decodeSymbol(literalTable, reader);
+		if (symbol >= 0 && symbol < NUM_BYTE_VALUES)
+		{
+			out[i++] = (unsigned char)symbol;
+			continue;
+		}
+		if (symbol < FIRST_LENGTH_SYMBOL)
+			return false;
+
+		unsigned int length, distance;
+		if (!readMatchValue(reader, symbol - FIRST_LENGTH_SYMBOL, length) || !haveBits(reader, MAX_SYMBOL_CODE_LENGTH))
+			return false;
+		int distanceSymbol = decodeSymbol(distanceTable, reader);
+		if (distanceSymbol < 0 || !readMatchValue(reader, distanceSymbol, distance))
+			return false;
+		length += MIN_MATCH_LENGTH;
+		distance += 1;
+		if (distance > i || length > originalSize - i)
+			return false;
+		copyMatch(out + i, distance, length, outEnd);
+		i += length;
+	}
+	return reader.bitsPastEnd <= reader.bitsInBuffer;
+}
+
+/*
+	decode a BURROWS_WHEELER block of size bytes into the originalSize
+	bytes at out.  the move to front positions are decoded into out,
+	which then holds the transform, and the transform is undone by
+	following each row to the row that starts a byte later.
+*/
+bool decodeTransformBlock(const unsigned char* block, size_t size, unsigned char* out, size_t originalSize)
+{
+	uint32_t primaryIndex;
+	if (size < PRIMARY_INDEX_SIZE || originalSize > MAX_TRANSFORM_BLOCK_SIZE)
+		return false;
+	memcpy(&primaryIndex, block, PRIMARY_INDEX_SIZE);
+	if (primaryIndex == 0 || primaryIndex > originalSize)
+		return false;
+
+	int codeLengths[NUM_SYMBOLS];
+	symbolTable table;
+	size_t codeLengthsSize = unpackCodeLengths(block + PRIMARY_INDEX_SIZE, size - PRIMARY_INDEX_SIZE, codeLengths);
+	if (codeLengthsSize == 0 || !buildSymbolTable(codeLengths, NUM_SYMBOLS, table))
+		return false;
+
+	unsigned char order[NUM_BYTE_VALUES];
+	for (int byte = 0; byte < NUM_BYTE_VALUES; byte++)
+		order[byte] = (unsigned char)byte;
+	bitReader reader{ block + PRIMARY_INDEX_SIZE + codeLengthsSize, block + size };
+	size_t numZeros = 0;
+	int runDigit = 0;
+	size_t i = 0;
+	while (i < originalSize)
+	{
+		if (!haveBits(reader, MAX_SYMBOL_CODE_LENGTH))
+			return false;
+		int symbol = decodeSymbol(table, reader);
+		if (symbol == ZERO_RUN_A || symbol == ZERO_RUN_B)
+		{
+			numZeros += (size_t)(symbol - ZERO_RUN_A + 1) << runDigit++;
+			if (numZeros > originalSize - i)
+				return false;
+			/* a run that fills the block can have no more digits */
+			if (numZeros == originalSize - i)
+			{
+				memset(out + i, order[0], numZeros);
+				i += numZeros;
+			}
+			continue;
+		}
+		if (symbol < 0)
+			return false;
+
+		memset(out + i, order[0], numZeros);
+		i += numZeros;
+		numZeros = 0;
+		runDigit = 0;
+		int position = symbol - 1;
+		unsigned char byte = order[position];
+		memmove(order + 1, order, position);
+		order[0] = byte;
+		out[i++] = byte;
+	}
+	if (reader.bitsPastEnd > reader.bitsInBuffer)
+		return false;
+
+	/*
+		row 0 starts with the end of block, and the rows that start with
+		each byte follow in the order the byte appears in the transform.
+		rows holds the byte each row starts with and the row that starts
+		a byte later, so the block comes out first byte first from the
+		primary index, the row that starts with the whole block.
+	*/
+	size_t nextRow[NUM_BYTE_VALUES];
+	size_t counts[NUM_BYTE_VALUES] = {};
+	for (size_t j = 0; j < originalSize; j++)
+		counts[out[j]]++;
+	size_t row = 1;
+	for (int byte = 0; byte < NUM_BYTE_VALUES; byte++)
+	{
+		nextRow[byte] = row;
+		row += counts[byte];
+	}
+
+	vector<uint32_t> rows(originalSize + 1, 0);
+	for (size_t lastRow = 0, j = 0; lastRow <= originalSize; lastRow++)
+	{
+		if (lastRow == primaryIndex)
+			continue;
+		unsigned char byte = out[j++];
+		rows[nextRow[byte]++] = (uint32_t)(lastRow << BYTE_SIZE) | byte;
+	}
+
+	uint32_t current = primaryIndex;
+	for (size_t j = 0; j < originalSize; j++)
+	{
+		uint32_t entry = rows[current];
+		out[j] = (unsigned char)entry;
+		current = entry >> BYTE_SIZE;
+	}
+	return true;
+}
+
+bool findTreeBlock(const unsigned char* block, size_t size, size_t blockNumber, size_t& treeBlock)
+{
+	unsigned int treeDistance;
+	if (readTreeDistance(block, size, treeDistance) == 0 || treeDistance > blockNumber)
+		return false;
+	treeBlock = blockNumber - treeDistance;
+	return true;
+}
+
+bool readBlockCodeLengths(const unsigned char* block, size_t size, unsigned char flags, int codeLengths[])
+{
+	if (flags & SHARED_TREE)
+		return false;
+	if (flags & REUSED_TREES)
+	{
+		unsigned int treeDistance;
+		size_t distanceSize = readTreeDistance(block, size, treeDistance);
+		if (distanceSize == 0 || treeDistance != 0)
+			return false;
+		block += distanceSize;
+		size -= distanceSize;
+	}
+
+	tableNode huffTable[MAX_HUFFMAN_TABLE];
+	return unpackCodeLengths(block, size, codeLengths) != 0 && buildTableFromCodeLengths(codeLengths, huffTable) != 0;
+}
+
+bool decodeBlock(const unsigned char* block, const BlockIndexEntry& indexEntry, unsigned char flags,
+	const vector<decodeTable>* sharedTables, vector<decodeTable>& blockTables, unsigned char* out)
+{
+	if (isStoredBlock(indexEntry.compressedSize, indexEntry.originalSize, flags))
+	{
+		if (indexEntry.originalSize > 0)
+			memcpy(out, block, indexEntry.originalSize);
+		return true;
+	}
+	if (flags & CONTEXT_MODEL)
+		return decodeContextBlock(block, indexEntry.compressedSize, out, indexEntry.originalSize);
+	if (flags & RUN_LENGTHS)
+		return decodeRunLengthBlock(block, indexEntry.compressedSize, out, indexEntry.originalSize);
+	if (flags & MATCHES)
+		return decodeMatchBlock(block, indexEntry.compressedSize, out, indexEntry.originalSize);
+	if (flags & BURROWS_WHEELER)
+		return decodeTransformBlock(block, indexEntry.compressedSize, out, indexEntry.originalSize);
+
+	const vector<decodeTable>* decodeTables = sharedTables;
+	size_t position = 0;
+	unsigned int treeDistance = 0;
+
+	if (flags & REUSED_TREES)
+	{
+		position = readTreeDistance(block, indexEntry.compressedSize, treeDistance);
+		if (position == 0 || (treeDistance > 0 && !sharedTables))
+			return false;
+	}
+
+	if (!(flags & SHARED_TREE) && treeDistance == 0)
+	{
+		// the tables of a block's own code lengths may be built already,
+		// in which case they only need skipping
+		size_t codeLengthsSize;
+		if (sharedTables)
+		{
+			if (indexEntry.compressedSize - position < CODE_LENGTHS_PREFIX_SIZE)
+				return false;
+			codeLengthsSize = packedCodeLengthsSize(block + position);
+			if (indexEntry.compressedSize - position < codeLengthsSize)
+				return false;
+		}
+		else
+		{
+			int codeLengths[NUM_SYMBOLS];
+			tableNode huffTable[MAX_HUFFMAN_TABLE];
+			codeLengthsSize = unpackCodeLengths(block + position, indexEntry.compressedSize - position, codeLengths);
+			if (codeLengthsSize == 0 || buildTableFromCodeLengths(codeLengths, huffTable) == 0)
+				return false;
+			buildDecodeTables(huffTable, blockTables);
+			decodeTables = &blockTables;
+		}
+		position += codeLengthsSize;
+	}
+
+	// the rest of the block is its huffman coded data
+	const unsigned char* in = block + position;
+	const unsigned char* blockEnd = block + indexEntry.compressedSize;
+	if (flags & INTERLEAVED_STREAMS)
+		return decodeStreams(*decodeTables, in, blockEnd, out, indexEntry.originalSize);
+
+	decodeState state;
+	unsigned char* to = out;
+	bool endOfFile = decodeSymbols(*decodeTables, state, in, blockEnd,
+		to, out + indexEntry.originalSize + MAX_SYMBOLS_PER_ENTRY);
+
+	return endOfFile && (size_t)(to - out) == indexEntry.originalSize;
+}
+
+void initDecoder(HuffDecoder& decoder)
+{
+	decoder.stage = DECODER_HEADER;
+	decoder.headerRead = false;
+	decoder.gathered.clear();
+	decoder.bytesNeeded = sizeof(unsigned int);
+	decoder.state = decodeState();
+	decoder.nextBlock = 0;
+	decoder.treeBlock = NO_TREE_BLOCK;
+	decoder.blockOffset = 0;
+	decoder.pendingPosition = 0;
+	decoder.pendingCount = 0;
+}
+
+/*
+	copy input into decoder.gathered until it holds bytesNeeded bytes.
+	returns false if the input runs out first.
+*/
+bool gatherBytes(HuffDecoder& decoder, const unsigned char*& in, size_t& inSize)
+{
+	size_t count = std::min(inSize, decoder.bytesNeeded - decoder.gathered.size());
+	decoder.gathered.insert(decoder.gathered.end(), in, in + count);
+	in += count;
+	inSize -= count;
+	return decoder.gathered.size() == decoder.bytesNeeded;
+}
+
+/*
+	build the decode tables for canonical code lengths into decodeTables
+*/
+bool buildTablesFromCodeLengths(HuffDecoder& decoder, const int codeLengths[], vector<decodeTable>& decodeTables)
+{
+	decoder.huffTable.resize(MAX_HUFFMAN_TABLE);
+	if (buildTableFromCodeLengths(codeLengths, decoder.huffTable.data()) == 0)
+		return false;
+	buildDecodeTables(decoder.huffTable.data(), decodeTables);
+	return true;
+}
+
+/*
+	build the huffman table for the codes of an adaptive stream, and
+	its decode tables when the codes last long enough to be worth it
+*/
+bool buildAdaptiveTables(HuffDecoder& decoder)
+{
+	if (decoder.model.nextInterval >= ADAPTIVE_TABLE_INTERVAL)
+		return buildTablesFromCodeLengths(decoder, decoder.model.codeLengths, decoder.decodeTables);
+
+	decoder.huffTable.resize(MAX_HUFFMAN_TABLE);
+	return buildTableFromCodeLengths(decoder.model.codeLengths, decoder.huffTable.data()) != 0;
+}
+
+/*
+	start decoding huffman coded data that takes up at most
+	compressedSize bytes and decodes to originalSize bytes
+*/
+void startDecoding(HuffDecoder& decoder, unsigned long long compressedSize, unsigned long long originalSize)
+{
+	decoder.stage = DECODER_DECODING;
+	decoder.state = decodeState();
+	decoder.blockBytesLeft = compressedSize;
+	decoder.blockOriginalSize = originalSize;
+	decoder.blockBytesDecoded = 0;
+}
+
+/*
+	everything up to the huffman coded data has been read, so get the
+	decode tables ready or move on to the first block
+*/
+HuffStatus startStream(HuffDecoder& decoder)
+{
+	const HuffHeader& header = decoder.header;
+	decoder.headerRead = true;
+
+	if (header.formatVersion == ORIGINAL_FORMAT)
+	{
+		buildDecodeTables(header.huffTable.data(), decoder.decodeTables);
+		startDecoding(decoder, NO_LIMIT, NO_LIMIT);
+	}
+	else if (header.formatVersion == CANONICAL_FORMAT_VERSION)
+	{
+		if (!buildTablesFromCodeLengths(decoder, header.codeLengths, decoder.decodeTables))
+			return HUFF_INVALID_DATA;
+		startDecoding(decoder, NO_LIMIT, NO_LIMIT);
+	}
+	else if (header.formatVersion == ADAPTIVE_FORMAT_VERSION)
+	{
+		initAdaptiveModel(decoder.model, header.rebuildInterval, header.maxCodeLength);
+		if (!buildAdaptiveTables(decoder))
+			return HUFF_INVALID_DATA;
+		decoder.state = decodeState();
+		decoder.stage = DECODER_ADAPTIVE;
+	}
+	else if (header.formatVersion == STORED_FORMAT_VERSION)
+	{
+		decoder.stage = DECODER_STORED;
+		decoder.blockBytesLeft = header.storedSize;
+	}
+	else
+	{
+		if ((header.flags & SHARED_TREE) && !buildTablesFromCodeLengths(decoder, header.codeLengths, decoder.sharedDecodeTables))
+			return HUFF_INVALID_DATA;
+		decoder.stage = DECODER_NEXT_BLOCK;
+	}
+	return HUFF_OK;
+}
+
+/*
+	hand out as many of the glyphs that did not fit last time as there
+	is room for.  returns true once all of them have been handed out.
+*/
+bool drainPending(HuffDecoder& decoder, unsigned char*& out, size_t& outSize)
+{
+	while (decoder.pendingPosition < decoder.pendingCount && outSize > 0)
+	{
+		*out++ = decoder.pendingSymbols[decoder.pendingPosition++];
+		outSize--;
+	}
+	return decoder.pendingPosition == decoder.pendingCount;
+}
+
+HuffStatus feedDecoder(HuffDecoder& decoder, const unsigned char*& in, size_t& inSize,
+	unsigned char*& out, size_t& outSize)
+{
+	HuffHeader& header = decoder.header;
+	bool isBlocked = header.formatVersion == BLOCK_FORMAT_VERSION || header.formatVersion == STREAM_FORMAT_VERSION;
+
+	while (true)
+	{
+		switch (decoder.stage)
+		{
+		case DECODER_HEADER:
+		{
+			HuffStatus status;
+
+			// read the header straight from the input when all of it is there
+			if (decoder.gathered.empty())
+			{
+				status = readHeader(in, inSize, header);
+				if (status == HUFF_OK)
+				{
+					in += header.size;
+					inSize -= header.size;
+				}
+				else if (status == HUFF_NEED_INPUT)
+					decoder.bytesNeeded = header.size;
+			}
+			else
+			{
+				if (!gatherBytes(decoder, in, inSize))
+					return HUFF_NEED_INPUT;
+				status = readHeader(decoder.gathered.data(), decoder.gathered.size(), header);
+				if (status == HUFF_NEED_INPUT)
+					decoder.bytesNeeded = header.size;
+			}
+
+			if (status == HUFF_NEED_INPUT)
+			{
+				if (!gatherBytes(decoder, in, inSize))
+					return HUFF_NEED_INPUT;
+				continue;
+			}
+			if (status != HUFF_OK || startStream(decoder) != HUFF_OK)
+				return HUFF_INVALID_DATA;
+			isBlocked = header.formatVersion == BLOCK_FORMAT_VERSION || header.formatVersion == STREAM_FORMAT_VERSION;
+			break;
+		}
+
+		case DECODER_NEXT_BLOCK:
+			if (header.formatVersion == STREAM_FORMAT_VERSION)
+			{
+				decoder.stage = DECODER_FRAME_SIZES;
+				decoder.gathered.clear();
+				decoder.bytesNeeded = sizeof(unsigned int);
+				break;
+			}
+
+			if (decoder.nextBlock == header.blockIndex.size())
+			{
+				decoder.stage = DECODER_FINISHED;
+				break;
+			}
+
+			// the blocks have to follow each other for them to be read in order
+			{
+				const BlockIndexEntry& indexEntry = header.blockIndex[decoder.nextBlock++];
+				if (indexEntry.offset != decoder.blockOffset)
+					return HUFF_INVALID_DATA;
+				decoder.blockOffset += indexEntry.compressedSize;
+
+				if (isStoredBlock(indexEntry.compressedSize, indexEntry.originalSize, header.flags))
+				{
+					decoder.stage = DECODER_STORED;
+					decoder.blockBytesLeft = indexEntry.compressedSize;
+					break;
+				}
+
+				// interleaved streams and context models are decoded a
+				// whole block at a time
+				if (header.flags & WHOLE_BLOCK_FLAGS)
+				{
+					decoder.stage = DECODER_WHOLE_BLOCK;
+					decoder.gathered.clear();
+					decoder.bytesNeeded = indexEntry.compressedSize;
+					break;
+				}
+
+				startDecoding(decoder, indexEntry.compressedSize, indexEntry.originalSize);
+				if (header.flags & REUSED_TREES)
+				{
+					decoder.stage = DECODER_TREE_DISTANCE;
+					decoder.gathered.clear();
+					decoder.bytesNeeded = 1;
+				}
+				else if (!(header.flags & SHARED_TREE))
+				{
+					decoder.stage = DECODER_CODE_LENGTHS;
+					decoder.gathered.clear();
+					decoder.bytesNeeded = CODE_LENGTHS_PREFIX_SIZE;
+				}
+			}
+			break;
+
+		case DECODER_FRAME_SIZES:
+		{
+			// every frame starts with its original and compressed sizes,
+			// and a frame with no original size ends the stream
+			if (!gatherBytes(decoder, in, inSize))
+				return HUFF_NEED_INPUT;
+
+			unsigned int originalSize, compressedSize;
+			memcpy(&originalSize, decoder.gathered.data(), sizeof(originalSize));
+			if (originalSize == 0)
+			{
+				decoder.stage = DECODER_FINISHED;
+				break;
+			}
+			if (decoder.bytesNeeded == sizeof(originalSize))
+			{
+				decoder.bytesNeeded += sizeof(compressedSize);
+				break;
+			}
+			memcpy(&compressedSize, decoder.gathered.data() + sizeof(originalSize), sizeof(compressedSize));
+			if (compressedSize == 0)
+			{
+				decoder.stage = DECODER_STORED;
+				decoder.blockBytesLeft = originalSize;
+				break;
+			}
+
+			startDecoding(decoder, compressedSize, originalSize);
+			decoder.stage = DECODER_CODE_LENGTHS;
+			decoder.gathered.clear();
+			decoder.bytesNeeded = CODE_LENGTHS_PREFIX_SIZE;
+			break;
+		}
+
+		case DECODER_TREE_DISTANCE:
+		{
+			// the block either stores its own code lengths or is coded
+			// with those of the latest block that did.  the distance is
+			// gathered a byte at a time until its last byte.
+			if (decoder.blockBytesLeft < decoder.bytesNeeded - decoder.gathered.size())
+				return HUFF_INVALID_DATA;
+			size_t before = inSize;
+			bool gathered = gatherBytes(decoder, in, inSize);
+			decoder.blockBytesLeft -= before - inSize;
+			if (!gathered)
+				return HUFF_NEED_INPUT;
+			if ((decoder.gathered.back() & MORE_DISTANCE_BYTES) && decoder.bytesNeeded < MAX_TREE_DISTANCE_SIZE)
+			{
+				decoder.bytesNeeded++;
+				break;
+			}
+
+			size_t blockNumber = decoder.nextBlock - 1;
+			size_t treeBlock;
+			if (!findTreeBlock(decoder.gathered.data(), decoder.gathered.size(), blockNumber, treeBlock))
+				return HUFF_INVALID_DATA;
+			if (treeBlock == blockNumber)
+			{
+				decoder.treeBlock = blockNumber;
+				decoder.stage = DECODER_CODE_LENGTHS;
+				decoder.gathered.clear();
+				decoder.bytesNeeded = CODE_LENGTHS_PREFIX_SIZE;
+			}
+			else if (treeBlock == decoder.treeBlock)
+				decoder.stage = DECODER_DECODING;
+			else
+				return HUFF_INVALID_DATA;
+			break;
+		}
+
+		case DECODER_CODE_LENGTHS:
+		{
+			// the block starts with its own code lengths
+			if (decoder.blockBytesLeft < decoder.bytesNeeded - decoder.gathered.size())
+				return HUFF_INVALID_DATA;
+			size_t before = inSize;
+			bool gathered = gatherBytes(decoder, in, inSize);
+			decoder.blockBytesLeft -= before - inSize;
+			if (!gathered)
+				return HUFF_NEED_INPUT;
+
+			if (decoder.bytesNeeded == CODE_LENGTHS_PREFIX_SIZE)
+			{
+				size_t codeLengthsSize = packedCodeLengthsSize(decoder.gathered.data());
+				if (codeLengthsSize > CODE_LENGTHS_PREFIX_SIZE)
+				{
+					decoder.bytesNeeded = codeLengthsSize;
+					break;
+				}
+			}
+
+			int codeLengths[NUM_SYMBOLS];
+			if (unpackCodeLengths(decoder.gathered.data(), decoder.gathered.size(), codeLengths) == 0 ||
+				!buildTablesFromCodeLengths(decoder, codeLengths, decoder.decodeTables))
+				return HUFF_INVALID_DATA;
+			decoder.stage = DECODER_DECODING;
+			break;
+		}
+
+		case DECODER_DECODING:
+		{
+			const vector<decodeTable>& decodeTables = (header.flags & SHARED_TREE) ? decoder.sharedDecodeTables : decoder.decodeTables;
+
+			while (true)
+			{
+				if (!drainPending(decoder, out, outSize))
+					return HUFF_OUTPUT_FULL;
+
+				if (decoder.state.endOfFile)
+				{
+					if (decoder.blockOriginalSize != NO_LIMIT && decoder.blockBytesDecoded != decoder.blockOriginalSize)
+						return HUFF_INVALID_DATA;
+					decoder.stage = isBlocked ? DECODER_SKIPPING : DECODER_FINISHED;
+					break;
+				}
+
+				// glyphs are decoded straight into out while there is room
+				// for a whole table entry, otherwise one entry at a time
+				// into pendingSymbols
+				const unsigned char* inStart = in;
+				size_t inputAvailable = (size_t)std::min((unsigned long long)inSize, decoder.blockBytesLeft);
+				size_t decoded;
+				bool toPending = outSize < MAX_SYMBOLS_PER_ENTRY;
+				if (toPending)
+				{
+					unsigned char* pending = decoder.pendingSymbols;
+					decodeSymbols(decodeTables, decoder.state, in, in + inputAvailable, pending, pending + MAX_SYMBOLS_PER_ENTRY);
+					decoded = pending - decoder.pendingSymbols;
+					decoder.pendingPosition = 0;
+					decoder.pendingCount = (int)decoded;
+				}
+				else
+				{
+					unsigned char* outStart = out;
+					decodeSymbols(decodeTables, decoder.state, in, in + inputAvailable, out, out + outSize);
+					decoded = out - outStart;
+					outSize -= decoded;
+				}
+
+				size_t used = in - inStart;
+				inSize -= used;
+				if (decoder.blockBytesLeft != NO_LIMIT)
+					decoder.blockBytesLeft -= used;
+				decoder.blockBytesDecoded += decoded;
+				if (decoder.blockBytesDecoded > decoder.blockOriginalSize)
+					return HUFF_INVALID_DATA;
+
+				// stopped for want of input rather than room
+				if (!decoder.state.endOfFile && decoded == 0 && (toPending || outSize >= MAX_SYMBOLS_PER_ENTRY))
+					return decoder.blockBytesLeft == 0 ? HUFF_INVALID_DATA : HUFF_NEED_INPUT;
+			}
+			break;
+		}
+
+		case DECODER_SKIPPING:
+		{
+			// anything after the end of file glyph up to the end of the block
+			size_t count = (size_t)std::min((unsigned long long)inSize, decoder.blockBytesLeft);
+			in += count;
+			inSize -= count;
+			decoder.blockBytesLeft -= count;
+			if (decoder.blockBytesLeft > 0)
+				return HUFF_NEED_INPUT;
+			decoder.stage = DECODER_NEXT_BLOCK;
+			break;
+		}
+
+		case DECODER_WHOLE_BLOCK:
+		{
+			// the block is decoded straight from the input and into out
+			// when they hold all of it
+			const BlockIndexEntry& indexEntry = header.blockIndex[decoder.nextBlock - 1];
+			const unsigned char* block = in;
+			if (decoder.gathered.empty() && inSize >= indexEntry.compressedSize)
+			{
+				in += indexEntry.compressedSize;
+				inSize -= indexEntry.compressedSize;
+			}
+			else
+			{
+				if (!gatherBytes(decoder, in, inSize))
+					return HUFF_NEED_INPUT;
+				block = decoder.gathered.data();
+			}
+
+			const vector<decodeTable>* sharedTables = (header.flags & SHARED_TREE) ? &decoder.sharedDecodeTables : nullptr;
+			if (header.flags & REUSED_TREES)
+			{
+				size_t blockNumber = decoder.nextBlock - 1;
+				size_t treeBlock;
+				if (!findTreeBlock(block, indexEntry.compressedSize, blockNumber, treeBlock) ||
+					(treeBlock != blockNumber && treeBlock != decoder.treeBlock))
+					return HUFF_INVALID_DATA;
+				decoder.treeBlock = treeBlock;
+				if (treeBlock != blockNumber)
+					sharedTables = &decoder.decodeTables;
+			}
+			unsigned char* to = out;
+			if (outSize < indexEntry.originalSize)
+			{
+				decoder.decodedBlock.resize(indexEntry.originalSize);
+				decoder.decodedPosition = 0;
+				to = decoder.decodedBlock.data();
+			}
+			if (!decodeBlock(block, indexEntry, header.flags, sharedTables, decoder.decodeTables, to))
+				return HUFF_INVALID_DATA;
+
+			if (to == out)
+			{
+				out += indexEntry.originalSize;
+				outSize -= indexEntry.originalSize;
+				decoder.stage = DECODER_NEXT_BLOCK;
+			}
+			else
+				decoder.stage = DECODER_DRAINING;
+			break;
+		}
+
+		case DECODER_DRAINING:
+		{
+			// the decoded block that did not fit in out
+			size_t count = std::min(outSize, decoder.decodedBlock.size() - decoder.decodedPosition);
+			if (count > 0)
+				memcpy(out, decoder.decodedBlock.data() + decoder.decodedPosition, count);
+			out += count;
+			outSize -= count;
+			decoder.decodedPosition += count;
+			if (decoder.decodedPosition < decoder.decodedBlock.size())
+				return HUFF_OUTPUT_FULL;
+			decoder.stage = DECODER_NEXT_BLOCK;
+			break;
+		}
+
+		case DECODER_STORED:
+		{
+			// the bytes are copied straight from the input to out
+			size_t count = (size_t)std::min((unsigned long long)std::min(inSize, outSize), decoder.blockBytesLeft);
+			if (count > 0)
+				memcpy(out, in, count);
+			in += count;
+			inSize -= count;
+			out += count;
+			outSize -= count;
+			decoder.blockBytesLeft -= count;
+			if (decoder.blockBytesLeft > 0)
+				return outSize == 0 ? HUFF_OUTPUT_FULL : HUFF_NEED_INPUT;
+			decoder.stage = isBlocked ? DECODER_NEXT_BLOCK : DECODER_FINISHED;
+			break;
+		}
+
+		case DECODER_ADAPTIVE:
+		{
+			AdaptiveModel& model = decoder.model;
+
+			while (true)
+			{
+				if (!drainPending(decoder, out, outSize))
+					return HUFF_OUTPUT_FULL;
+
+				if (decoder.state.endOfFile)
+				{
+					decoder.stage = DECODER_FINISHED;
+					break;
+				}
+
+				// the codes change at every rebuild, so a table entry must not
+				// run past one.  the last few glyphs before it are decoded by
+				// walking the huffman table instead.
+				bool toPending = outSize < MAX_SYMBOLS_PER_ENTRY;
+				unsigned char* start = toPending ? decoder.pendingSymbols : out;
+				unsigned char* to = start;
+				size_t room = std::min(toPending ? (size_t)MAX_SYMBOLS_PER_ENTRY : outSize, (size_t)model.bytesUntilRebuild);
+				const unsigned char* inStart = in;
+				if (room >= MAX_SYMBOLS_PER_ENTRY && model.nextInterval >= ADAPTIVE_TABLE_INTERVAL)
+					decodeSymbols(decoder.decodeTables, decoder.state, in, in + inSize, to, to + room);
+				else
+					walkSymbols(decoder.huffTable.data(), decoder.state, in, in + inSize, to, to + room);
+				inSize -= in - inStart;
+
+				size_t decoded = to - start;
+				if (toPending)
+				{
+					decoder.pendingPosition = 0;
+					decoder.pendingCount = (int)decoded;
+				}
+				else
+				{
+					out += decoded;
+					outSize -= decoded;
+				}
+
+				if (updateAdaptiveModel(model, start, decoded) && !buildAdaptiveTables(decoder))
+					return HUFF_INVALID_DATA;
+
+				// stopped for want of input rather than room
+				if (!decoder.state.endOfFile && decoded == 0)
+					return HUFF_NEED_INPUT;
+			}
+			break;
+		}
+
+		default:
+			return HUFF_DONE;
+		}
+	}
+}
+
+HuffStatus finishDecoder(HuffDecoder& decoder, unsigned char*& out, size_t& outSize)
+{
+	const unsigned char* in = nullptr;
+	size_t inSize = 0;
+	HuffStatus status = feedDecoder(decoder, in, inSize, out, outSize);
+	return status == HUFF_NEED_INPUT ? HUFF_TRUNCATED : status;
+}
+
+HuffStatus decompress(const unsigned char* in, size_t size, unsigned char* out, size_t capacity,
+	size_t& decompressedSize)
+{
+	HuffDecoder decoder;
+	return decompress(decoder, in, size, out, capacity, decompressedSize);
+}
+
+HuffStatus decompress(HuffDecoder& decoder, const unsigned char* in, size_t size, unsigned char* out,
+	size_t capacity, size_t& decompressedSize)
+{
+	unsigned char* to = out;
+	size_t outSize = capacity;
+
+	// all of the input is there, so running out of it means the stream was cut short
+	initDecoder(decoder);
+	HuffStatus status = feedDecoder(decoder, in, size, to, outSize);
+	if (status == HUFF_NEED_INPUT)
+		status = finishDecoder(decoder, to, outSize);
+
+	decompressedSize = to - out;
+	return status;
+}
+
+}
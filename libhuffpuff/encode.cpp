@@ -0,0 +1,1583 @@
+// encode.cpp
+// The compressing half of libhuffpuff: the Huffman tree, the codes, the
+// glyph histogram, the bit writer and the stream format encoder.
+#include "huffpuff.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// The AVX2 histogram is compiled on x86 and only used when the CPU has AVX2
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <immintrin.h>
+#define HUFF_X86
+#define AVX2_TARGET
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HUFF_X86
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+using namespace std;
+
+namespace huffpuff {
+
+// The histogram keeps several tables of 32 bit counts so that runs of the
+// same byte do not wait on the previous increment of the same counter.
+// The tables are added into the 64 bit frequencies every slice so they
+// can never overflow.
+const int NUM_COUNT_TABLES = 4;
+const size_t HISTOGRAM_SLICE_SIZE = (size_t)1 << 30;
+const int AVX2_WIDTH = 32;
+
+// A canonical header with no file name, and a stored format one, which
+// adds the size of the stored data
+const size_t CANONICAL_HEADER_SIZE = sizeof(CANONICAL_MAGIC) + sizeof(CANONICAL_FORMAT_VERSION) + sizeof(unsigned int);
+const size_t STORED_HEADER_SIZE = CANONICAL_HEADER_SIZE + sizeof(unsigned long long);
+
+// Two codes of at most this many bits fit in the bit buffer together
+const int SHORT_CODE_LENGTH = 16;
+
+// The most nodes a tree of the largest alphabet has
+const int MAX_TREE_SIZE = 2 * MAX_SYMBOLS - 1;
+
+// Package-merge keeps at most this many items in each of its lists
+const int MAX_PACKAGE_LIST = 2 * MAX_SYMBOLS;
+
+// Adaptive streams are coded this many bytes at a time at most
+const size_t ADAPTIVE_SLICE_SIZE = 64 * 1024;
+
+// Contexts are clustered by an estimate of the bits they code to, in
+// which every stored code length takes about this many bits
+const double CODE_LENGTH_COST = 5;
+
+// A RUN_LENGTHS block codes a byte repeated at least this many times after
+// the one before it as a run, and shorter repeats byte by byte
+const size_t MIN_RUN_REPEATS = 4;
+const size_t MAX_RUN_REPEATS = ((size_t)1 << NUM_RUN_SYMBOLS) - 1;
+
+// The match finder hashes the next MIN_MATCH_LENGTH bytes into a table of
+// MIN_HASH_BITS to MAX_HASH_BITS bits, about one slot for every place in
+// the window, so chains stay short even on data with few matches. A match
+// of just MIN_MATCH_LENGTH bytes only pays for its distance when it is
+// this near.
+const int MIN_HASH_BITS = 10;
+const int MAX_HASH_BITS = 20;
+const unsigned int MAX_SHORT_MATCH_DISTANCE = 4096;
+
+// How hard each level looks for matches, much as zlib's levels do: how
+// many earlier places with the same hash it tries, a quarter as many once
+// it has a match of goodLength, the length it settles for, and the
+// matches shorter than lazyLength that are put off when the byte after
+// them starts a longer one
+struct MatchLevel {
+	int maxChain;
+	size_t goodLength;
+	size_t lazyLength;
+	size_t niceLength;
+};
+
+const MatchLevel MATCH_LEVELS[MAX_MATCH_LEVEL] = {
+	{ 4, 4, 0, 16 },
+	{ 8, 4, 0, 32 },
+	{ 16, 8, 0, 64 },
+	{ 16, 4, 4, 32 },
+	{ 32, 8, 16, 64 },
+	{ 128, 8, 16, 128 },
+	{ 256, 8, 32, 256 },
+	{ 1024, 32, 128, 512 },
+	{ 4096, 32, 256, 1024 }
+};
+
+// SA-IS sorts suffixes by their type: S type when the suffix sorts before
+// the one that starts a byte later, L type when it sorts after. The empty
+// suffix at the end sorts first of all and counts as S type.
+const unsigned char L_TYPE = 0;
+const unsigned char S_TYPE = 1;
+const int NO_SUFFIX = -1;
+
+// Orders the leaves by frequency, and by glyph when the frequencies are
+// the same, so a file always gets the same tree.
+bool lessFrequent(const HuffmanNode& node1, const HuffmanNode& node2) {
+	if (node1.frequency != node2.frequency)
+		return node1.frequency < node2.frequency;
+	return node1.glyph < node2.glyph;
+}
+
+// Runs the Huffman algorithm over the glyph frequencies in huffmanTable,
+// leaving the finished tree in huffmanTable and minHuffmanTable with its
+// root at ROOT. Returns the number of nodes in the tree.
+//
+// Uses the two queue method: once the leaves are sorted, every merged node
+// is at least as frequent as the one merged before it, so the two least 
+// frequent nodes are always at the front of the leaves or of the merged 
+// nodes. Nothing is allocated, and the tree is laid out with every node 
+// before its children.
+int buildHuffmanTree(HuffmanNode huffmanTable[], MinHuffmanNode minHuffmanTable[], int numSymbols) {
+	// The leaves come first in nodes, least frequent first, followed by 
+	// the merged nodes in the order they are made
+	HuffmanNode nodes[MAX_TREE_SIZE];
+	int numGlyphs = 0;
+	for (int glyph = 0; glyph < numSymbols; glyph++) {
+		if (huffmanTable[glyph].frequency > 0) {
+			nodes[numGlyphs].glyph = glyph;
+			nodes[numGlyphs].frequency = huffmanTable[glyph].frequency;
+			numGlyphs++;
+		}
+	}
+	sort(nodes, nodes + numGlyphs, lessFrequent);
+
+	int nextLeaf = 0;
+	int nextMerged = numGlyphs;
+	int nextFreeSlot = numGlyphs;
+	auto takeLeastFrequent = [&]() {
+		if (nextLeaf < numGlyphs && (nextMerged == nextFreeSlot || nodes[nextLeaf].frequency <= nodes[nextMerged].frequency))
+			return nextLeaf++;
+		return nextMerged++;
+	};
+
+	for (int i = 0; i < numGlyphs - 1; i++) {
+		HuffmanNode& merged = nodes[nextFreeSlot];
+		merged.glyph = MERGE_NODE;
+		merged.leftChildIndex = takeLeastFrequent();
+		merged.rightChildIndex = takeLeastFrequent();
+		merged.frequency = nodes[merged.leftChildIndex].frequency + nodes[merged.rightChildIndex].frequency;
+		nextFreeSlot++;
+	}
+
+	// The last merged node is the root, so the merged nodes go into the 
+	// table backwards followed by the leaves
+	int numMerged = nextFreeSlot - numGlyphs;
+	auto tableIndex = [&](int node) {
+		return node < numGlyphs ? numMerged + node : nextFreeSlot - 1 - node;
+	};
+
+	for (int node = 0; node < nextFreeSlot; node++) {
+		int index = tableIndex(node);
+		huffmanTable[index] = nodes[node];
+		if (nodes[node].glyph == MERGE_NODE) {
+			huffmanTable[index].leftChildIndex = tableIndex(nodes[node].leftChildIndex);
+			huffmanTable[index].rightChildIndex = tableIndex(nodes[node].rightChildIndex);
+		}
+
+		minHuffmanTable[index].glyph = huffmanTable[index].glyph;
+		minHuffmanTable[index].leftChildIndex = huffmanTable[index].leftChildIndex;
+		minHuffmanTable[index].rightChildIndex = huffmanTable[index].rightChildIndex;
+	}
+
+	return nextFreeSlot;
+}
+
+// Finds the code and code length of every glyph in a tree from 
+// buildHuffmanTree. Every node comes before its children, so one pass down 
+// the table hands each node its parent's code with one more bit.
+// Returns the number of bits the glyphs take up once encoded.
+long long buildCodes(const HuffmanNode huffmanTable[], int numNodes, HuffmanCode codes[], int codeLengths[]) {
+	HuffmanCode nodeCodes[MAX_TREE_SIZE];
+	long long numBitsWhenCompressed = 0;
+
+	for (int node = 0; node < numNodes; node++) {
+		const HuffmanNode& current = huffmanTable[node];
+		const HuffmanCode& code = nodeCodes[node];
+
+		// Found a leaf
+		if (current.glyph != MERGE_NODE) {
+			codes[current.glyph] = code;
+			codeLengths[current.glyph] = code.length;
+			numBitsWhenCompressed += code.length * current.frequency;
+			continue;
+		}
+
+		nodeCodes[current.leftChildIndex] = HuffmanCode{ code.bits, code.length + 1 };
+		nodeCodes[current.rightChildIndex] = HuffmanCode{ code.bits | ((uint64_t)1 << code.length), code.length + 1 };
+	}
+
+	return numBitsWhenCompressed;
+}
+
+// Packs values into bytes least significant bit first, the same bit
+// order that the compressed data uses. Each byte is cleared as the first
+// of its bits is packed.
+void packBits(unsigned char* packed, int& bitCount, unsigned int value, int numBits) {
+	for (int i = 0; i < numBits; i++) {
+		if (bitCount % BYTE_SIZE == 0)
+			packed[bitCount / BYTE_SIZE] = '\0';
+		if (value & (1u << i))
+			packed[bitCount / BYTE_SIZE] |= (unsigned char)(1 << (bitCount % BYTE_SIZE));
+		bitCount++;
+	}
+}
+
+// Replaces the codes of the tree with canonical codes of the same lengths.
+// Codes are handed out in order of length and then glyph, so the code 
+// lengths alone are enough for Puff to rebuild them. The first code of 
+// each length follows on from the last code of the length before.
+void buildCanonicalCodes(const int codeLengths[], HuffmanCode codes[], int numSymbols) {
+	int lengthCounts[MAX_CODE_LENGTH + 1] = {};
+	for (int glyph = 0; glyph < numSymbols; glyph++) {
+		if (codeLengths[glyph] > 0)
+			lengthCounts[codeLengths[glyph]]++;
+	}
+
+	uint64_t nextCode[MAX_CODE_LENGTH + 1] = {};
+	for (int length = 2; length <= MAX_CODE_LENGTH; length++)
+		nextCode[length] = (nextCode[length - 1] + lengthCounts[length - 1]) << 1;
+
+	for (int glyph = 0; glyph < numSymbols; glyph++) {
+		int length = codeLengths[glyph];
+		if (length == NO_CODE)
+			continue;
+
+		// The code is read most significant bit first, so reverse it 
+		// into the order the bits are written in
+		uint64_t code = length > 0 ? nextCode[length]++ : 0;
+		codes[glyph].length = length;
+		codes[glyph].bits = 0;
+		for (int j = 0; j < length; j++) {
+			if (code & ((uint64_t)1 << (length - 1 - j)))
+				codes[glyph].bits |= (uint64_t)1 << j;
+		}
+	}
+}
+
+// Just enough bits to hold the longest code length
+int codeLengthBits(const int codeLengths[], int numSymbols) {
+	int maxCodeLength = *max_element(codeLengths, codeLengths + numSymbols);
+	int lengthBits = 0;
+	while ((1 << lengthBits) <= maxCodeLength)
+		lengthBits++;
+	return lengthBits;
+}
+
+// The canonical header stores a bitmap of which glyphs have a code followed
+// by the code lengths of those glyphs, each packed into just enough bits
+// to hold the longest one.
+size_t packCodeLengths(const int codeLengths[], int numSymbols, unsigned char* packed) {
+	int bitCount = 0;
+
+	for (int glyph = 0; glyph < numSymbols; glyph++)
+		packBits(packed, bitCount, codeLengths[glyph] != NO_CODE, 1);
+
+	unsigned char lengthBits = (unsigned char)codeLengthBits(codeLengths, numSymbols);
+	packBits(packed, bitCount, lengthBits, BYTE_SIZE);
+
+	for (int glyph = 0; glyph < numSymbols; glyph++) {
+		if (codeLengths[glyph] != NO_CODE)
+			packBits(packed, bitCount, codeLengths[glyph], lengthBits);
+	}
+
+	return (bitCount + BYTE_SIZE - 1) / BYTE_SIZE;
+}
+
+vector<unsigned char> packCodeLengths(const int codeLengths[], int numSymbols) {
+	vector<unsigned char> packed(packedCodeLengthsSize(codeLengths, numSymbols));
+	packCodeLengths(codeLengths, numSymbols, packed.data());
+	return packed;
+}
+
+size_t packedCodeLengthsSize(const int codeLengths[], int numSymbols) {
+	size_t numCoded = numSymbols - count(codeLengths, codeLengths + numSymbols, NO_CODE);
+	return (numSymbols + BYTE_SIZE + numCoded * codeLengthBits(codeLengths, numSymbols) + BYTE_SIZE - 1) / BYTE_SIZE;
+}
+
+// Points the writer at outSize bytes of the caller's memory.
+void writeToMemory(BitWriter& writer, char* out, size_t outSize) {
+	writer.out = out;
+	writer.outSize = outSize;
+	writer.outBufferIndex = 0;
+	writer.bitBuffer = 0;
+	writer.bitCount = 0;
+}
+
+// Gives the writer room for more bits: outBuffer the first time through,
+// after that by writing outBuffer to fout.
+void makeRoom(BitWriter& writer) {
+	if (!writer.out) {
+		if (writer.outBuffer.empty())
+			writer.outBuffer.resize(OUTPUT_BUFFER_SIZE);
+		writer.out = writer.outBuffer.data();
+		writer.outSize = writer.outBuffer.size();
+	}
+	else if (writer.fout) {
+		writer.fout->write(writer.out, writer.outBufferIndex);
+		writer.outBufferIndex = 0;
+	}
+}
+
+// Writes out the last partially filled bytes and whatever is left in the buffer.
+void flushBits(BitWriter& writer) {
+	while (writer.bitCount > 0) {
+		if (writer.outBufferIndex == writer.outSize)
+			makeRoom(writer);
+		writer.out[writer.outBufferIndex++] = (char)writer.bitBuffer;
+		writer.bitBuffer >>= BYTE_SIZE;
+		writer.bitCount -= BYTE_SIZE;
+	}
+	writer.bitBuffer = 0;
+	writer.bitCount = 0;
+
+	if (writer.fout && writer.outBufferIndex > 0) {
+		writer.fout->write(writer.out, writer.outBufferIndex);
+		writer.outBufferIndex = 0;
+	}
+}
+
+// Counts the byte values of 8 bytes loaded as one word, spreading
+// neighbouring bytes over the count tables.
+inline void countWord(uint32_t counts[][NUM_BYTE_VALUES], const unsigned char* data) {
+	uint64_t word;
+	memcpy(&word, data, sizeof(word));
+	counts[0][word & 0xFF]++;
+	counts[1][(word >> 8) & 0xFF]++;
+	counts[2][(word >> 16) & 0xFF]++;
+	counts[3][(word >> 24) & 0xFF]++;
+	counts[0][(word >> 32) & 0xFF]++;
+	counts[1][(word >> 40) & 0xFF]++;
+	counts[2][(word >> 48) & 0xFF]++;
+	counts[3][word >> 56]++;
+}
+
+void addCounts(uint32_t counts[][NUM_BYTE_VALUES], long long frequencies[]) {
+	for (int glyph = 0; glyph < NUM_BYTE_VALUES; glyph++) {
+		for (int table = 0; table < NUM_COUNT_TABLES; table++)
+			frequencies[glyph] += counts[table][glyph];
+	}
+}
+
+void countGlyphsScalar(const unsigned char* data, size_t size, long long frequencies[]) {
+	uint32_t counts[NUM_COUNT_TABLES][NUM_BYTE_VALUES] = {};
+	size_t i = 0;
+
+	for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+		countWord(counts, data + i);
+	for (; i < size; i++)
+		counts[0][data[i]]++;
+
+	addCounts(counts, frequencies);
+}
+
+#ifdef HUFF_X86
+// Same as the scalar version, but first checks each 32 bytes for a run of
+// one byte value, which is counted with a single add.
+AVX2_TARGET void countGlyphsAvx2(const unsigned char* data, size_t size, long long frequencies[]) {
+	uint32_t counts[NUM_COUNT_TABLES][NUM_BYTE_VALUES] = {};
+	size_t i = 0;
+
+	for (; i + AVX2_WIDTH <= size; i += AVX2_WIDTH) {
+		__m256i bytes = _mm256_loadu_si256((const __m256i*)(data + i));
+		__m256i firstByte = _mm256_broadcastb_epi8(_mm256_castsi256_si128(bytes));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, firstByte)) == -1) {
+			counts[0][data[i]] += AVX2_WIDTH;
+			continue;
+		}
+
+		for (int j = 0; j < AVX2_WIDTH; j += sizeof(uint64_t))
+			countWord(counts, data + i + j);
+	}
+	for (; i < size; i++)
+		counts[0][data[i]]++;
+
+	addCounts(counts, frequencies);
+}
+#endif
+
+bool cpuHasAvx2() {
+#if defined(HUFF_X86) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+
+	// AVX2 also needs the OS to save the AVX registers
+	__cpuid(info, 1);
+	bool osSavesAvx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+	__cpuidex(info, 7, 0);
+	return osSavesAvx && (info[1] & (1 << 5));
+#elif defined(HUFF_X86)
+	return __builtin_cpu_supports("avx2");
+#else
+	return false;
+#endif
+}
+
+// Adds the number of times each byte value appears in data to frequencies.
+// The AVX2 version is picked the first time through if the CPU supports it.
+void countGlyphs(const unsigned char* data, size_t size, long long frequencies[]) {
+	static const bool useAvx2 = cpuHasAvx2();
+
+	for (size_t start = 0; start < size; start += HISTOGRAM_SLICE_SIZE) {
+		size_t sliceSize = min(size - start, HISTOGRAM_SLICE_SIZE);
+#ifdef HUFF_X86
+		if (useAvx2) {
+			countGlyphsAvx2(data + start, sliceSize, frequencies);
+			continue;
+		}
+#endif
+		countGlyphsScalar(data + start, sliceSize, frequencies);
+	}
+}
+
+// Builds a Huffman tree for the given glyph frequencies and returns the
+// code length of every glyph along with the number of encoded bits.
+long long buildCodeLengths(const long long frequencies[], int codeLengths[], int maxCodeLength, int numSymbols) {
+	HuffmanNode huffmanTable[MAX_TREE_SIZE];
+	MinHuffmanNode minHuffmanTable[MAX_TREE_SIZE];
+	HuffmanCode codes[MAX_SYMBOLS];
+
+	for (int glyph = 0; glyph < numSymbols; glyph++) {
+		huffmanTable[glyph].glyph = glyph;
+		huffmanTable[glyph].frequency = frequencies[glyph];
+	}
+
+	int numNodes = buildHuffmanTree(huffmanTable, minHuffmanTable, numSymbols);
+	fill(codeLengths, codeLengths + numSymbols, NO_CODE);
+	long long numBitsWhenCompressed = buildCodes(huffmanTable, numNodes, codes, codeLengths);
+
+	if (*max_element(codeLengths, codeLengths + numSymbols) > maxCodeLength)
+		return limitCodeLengths(frequencies, codeLengths, maxCodeLength, numSymbols);
+	return numBitsWhenCompressed;
+}
+
+// Package-merge: with the glyphs sorted by frequency, the list of each code
+// length holds the glyphs merged with pairs ("packages") of the items of 
+// the list one bit longer. Picking the cheapest 2n - 2 items of the list of
+// length 1 and following the packages down gives the optimal lengths: a 
+// glyph's code length is the number of lists it was picked from. Only
+// whether each item is a glyph needs keeping, since the glyphs picked from 
+// a list are always its least frequent ones.
+long long limitCodeLengths(const long long frequencies[], int codeLengths[], int maxCodeLength, int numSymbols) {
+	HuffmanNode leaves[MAX_SYMBOLS];
+	int numGlyphs = 0;
+	for (int glyph = 0; glyph < numSymbols; glyph++) {
+		if (codeLengths[glyph] != NO_CODE) {
+			leaves[numGlyphs].glyph = glyph;
+			leaves[numGlyphs].frequency = frequencies[glyph];
+			numGlyphs++;
+		}
+	}
+	sort(leaves, leaves + numGlyphs, lessFrequent);
+	maxCodeLength = min(max(maxCodeLength, MIN_CODE_LENGTH_LIMIT), MAX_CODE_LENGTH);
+
+	bool isLeaf[MAX_CODE_LENGTH + 1][MAX_PACKAGE_LIST];
+	long long list[MAX_PACKAGE_LIST];
+	long long nextList[MAX_PACKAGE_LIST];
+	int listSize = numGlyphs;
+	int maxListSize = 2 * numGlyphs - 2;
+
+	// The longest codes' list is just the glyphs
+	for (int i = 0; i < numGlyphs; i++) {
+		list[i] = leaves[i].frequency;
+		isLeaf[maxCodeLength][i] = true;
+	}
+
+	for (int length = maxCodeLength - 1; length >= 1; length--) {
+		int numPackages = listSize / 2;
+		int nextLeaf = 0;
+		int nextPackage = 0;
+		int nextListSize = 0;
+
+		while (nextListSize < maxListSize && (nextLeaf < numGlyphs || nextPackage < numPackages)) {
+			long long packageFrequency = nextPackage < numPackages ? list[2 * nextPackage] + list[2 * nextPackage + 1] : 0;
+			bool takeLeaf = nextPackage == numPackages || 
+				(nextLeaf < numGlyphs && leaves[nextLeaf].frequency <= packageFrequency);
+
+			isLeaf[length][nextListSize] = takeLeaf;
+			nextList[nextListSize++] = takeLeaf ? leaves[nextLeaf++].frequency : packageFrequency;
+			if (!takeLeaf)
+				nextPackage++;
+		}
+
+		copy(nextList, nextList + nextListSize, list);
+		listSize = nextListSize;
+	}
+
+	int lengths[MAX_SYMBOLS] = {};
+	int numPicked = maxListSize;
+	for (int length = 1; length <= maxCodeLength && numPicked > 0; length++) {
+		int numLeaves = 0;
+		for (int i = 0; i < numPicked; i++)
+			numLeaves += isLeaf[length][i];
+
+		for (int i = 0; i < numLeaves; i++)
+			lengths[i]++;
+		numPicked = 2 * (numPicked - numLeaves);
+	}
+
+	long long numBitsWhenCompressed = 0;
+	for (int i = 0; i < numGlyphs; i++) {
+		codeLengths[leaves[i].glyph] = lengths[i];
+		numBitsWhenCompressed += lengths[i] * leaves[i].frequency;
+	}
+
+	return numBitsWhenCompressed;
+}
+
+// Writes the codes of size glyphs. When every code is short, two codes go
+// into the bit buffer before it is checked.
+void writeGlyphs(BitWriter& writer, const unsigned char* contents, size_t size,
+		const HuffmanCode codes[], int maxCodeLength) {
+	size_t i = 0;
+	if (maxCodeLength <= SHORT_CODE_LENGTH) {
+		for (; i + 1 < size; i += 2) {
+			const HuffmanCode& code1 = codes[contents[i]];
+			const HuffmanCode& code2 = codes[contents[i + 1]];
+			writer.bitBuffer |= code1.bits << writer.bitCount;
+			writer.bitCount += code1.length;
+			writer.bitBuffer |= code2.bits << writer.bitCount;
+			writer.bitCount += code2.length;
+			if (writer.bitCount >= 32)
+				writeWord(writer);
+		}
+	}
+
+	for (; i < size; i++)
+		writeCode(writer, codes[contents[i]]);
+}
+
+// Writes the codes of size glyphs and an end of file, then the last
+// partially filled byte.
+void writeCodes(BitWriter& writer, const unsigned char* contents, size_t size, 
+		const HuffmanCode codes[], int maxCodeLength) {
+	writeGlyphs(writer, contents, size, codes, maxCodeLength);
+	writeCode(writer, codes[END_OF_FILE]);
+	flushBits(writer);
+}
+
+// Encodes one block on its own, preceded by its code lengths unless every
+// block shares one tree.
+vector<char> encodeBlock(const unsigned char* contents, const BlockIndexEntry& indexEntry,
+		const int codeLengths[], unsigned char flags, unsigned int treeDistance) {
+	vector<char> encodedBlock(indexEntry.compressedSize);
+	encodeBlock(contents, indexEntry.originalSize, codeLengths, flags, encodedBlock.data(), encodedBlock.size(),
+		treeDistance);
+	return encodedBlock;
+}
+
+// Whether a block stores its own code lengths
+bool storesCodeLengths(unsigned char flags, unsigned int treeDistance) {
+	return !(flags & SHARED_TREE) && treeDistance == 0;
+}
+
+// The same, written straight to out, which has to hold compressedSize bytes.
+void encodeBlock(const unsigned char* contents, size_t size, const int codeLengths[], unsigned char flags,
+		char* out, size_t compressedSize, unsigned int treeDistance) {
+	HuffmanCode codes[NUM_SYMBOLS];
+	buildCanonicalCodes(codeLengths, codes);
+	int maxCodeLength = *max_element(codeLengths, codeLengths + NUM_SYMBOLS);
+
+	size_t position = 0;
+	if (flags & REUSED_TREES) {
+		unsigned int distance = treeDistance;
+		for (; distance >> TREE_DISTANCE_BITS; distance >>= TREE_DISTANCE_BITS)
+			out[position++] = (char)(distance | MORE_DISTANCE_BYTES);
+		out[position++] = (char)distance;
+	}
+	if (storesCodeLengths(flags, treeDistance))
+		position += packCodeLengths(codeLengths, NUM_SYMBOLS, (unsigned char*)out + position);
+
+	BitWriter writer;
+	if (!(flags & INTERLEAVED_STREAMS)) {
+		writeToMemory(writer, out + position, compressedSize - position);
+		writeCodes(writer, contents, size, codes, maxCodeLength);
+		return;
+	}
+
+	// Each segment gets a stream of its own, and the size of every stream
+	// but the last goes into the jump table
+	char* jumpTable = out + position;
+	position += JUMP_TABLE_SIZE;
+	size_t segment = segmentSize(size);
+	for (int stream = 0; stream < NUM_STREAMS; stream++) {
+		size_t start = min(stream * segment, size);
+		size_t end = min(start + segment, size);
+
+		writeToMemory(writer, out + position, compressedSize - position);
+		writeCodes(writer, contents + start, end - start, codes, maxCodeLength);
+		position += writer.outBufferIndex;
+		if (stream < NUM_STREAMS - 1) {
+			unsigned int streamSize = (unsigned int)writer.outBufferIndex;
+			memcpy(jumpTable + stream * sizeof(streamSize), &streamSize, sizeof(streamSize));
+		}
+	}
+}
+
+// The number of bytes encodeBlock writes for a block.
+size_t encodedBlockSize(const long long frequencies[], const int codeLengths[], unsigned char flags,
+		unsigned int treeDistance) {
+	size_t blockSize = 0;
+	if (flags & REUSED_TREES)
+		blockSize += treeDistanceSize(treeDistance);
+	if (storesCodeLengths(flags, treeDistance))
+		blockSize += packedCodeLengthsSize(codeLengths);
+
+	int numStreams = 1;
+	if (flags & INTERLEAVED_STREAMS) {
+		blockSize += JUMP_TABLE_SIZE;
+		numStreams = NUM_STREAMS;
+	}
+
+	// Every stream ends on a byte of its own
+	for (int stream = 0; stream < numStreams; stream++) {
+		long long numBitsWhenCompressed = 0;
+		for (int glyph = 0; glyph < NUM_SYMBOLS; glyph++) {
+			if (codeLengths[glyph] != NO_CODE)
+				numBitsWhenCompressed += frequencies[stream * NUM_SYMBOLS + glyph] * codeLengths[glyph];
+		}
+		blockSize += (size_t)((numBitsWhenCompressed + BYTE_SIZE - 1) / BYTE_SIZE);
+	}
+
+	return blockSize;
+}
+
+bool codesAllGlyphs(const long long frequencies[], const int codeLengths[]) {
+	for (int glyph = 0; glyph < NUM_SYMBOLS; glyph++) {
+		if (frequencies[glyph] > 0 && codeLengths[glyph] == NO_CODE)
+			return false;
+	}
+	return true;
+}
+
+// Counts the glyphs of each segment of an interleaved block.
+void countSegmentGlyphs(const unsigned char* contents, size_t size, long long segmentFrequencies[]) {
+	size_t segment = segmentSize(size);
+	for (int stream = 0; stream < NUM_STREAMS; stream++) {
+		size_t start = min(stream * segment, size);
+		size_t end = min(start + segment, size);
+		long long* frequencies = segmentFrequencies + stream * NUM_SYMBOLS;
+
+		fill(frequencies, frequencies + NUM_SYMBOLS, 0);
+		countGlyphs(contents + start, end - start, frequencies);
+		frequencies[END_OF_FILE] = 1;
+	}
+}
+
+// The estimated bits the bytes of a cluster of contexts take: the entropy
+// of their counts plus the code lengths the cluster stores.
+double clusterCost(const long long frequencies[]) {
+	long long total = 0;
+	int numGlyphs = 0;
+	double numBits = 0;
+	for (int glyph = 0; glyph < NUM_BYTE_VALUES; glyph++) {
+		if (frequencies[glyph] > 0) {
+			total += frequencies[glyph];
+			numBits -= frequencies[glyph] * log2((double)frequencies[glyph]);
+			numGlyphs++;
+		}
+	}
+	if (total > 0)
+		numBits += total * log2((double)total);
+	return numBits + NUM_SYMBOLS + BYTE_SIZE + numGlyphs * CODE_LENGTH_COST;
+}
+
+// The number of bits the cluster of every context is packed into
+int clusterBits(int numClusters) {
+	int bits = 0;
+	while ((1 << bits) < numClusters)
+		bits++;
+	return bits;
+}
+
+// The busiest contexts start out in clusters of their own and the rest in
+// one shared cluster. The two clusters that save the most bits by sharing
+// a code are then merged, over and over until no merge saves any more.
+void buildContextModel(const unsigned char* contents, size_t size, int maxCodeLength, ContextModel& model) {
+	vector<long long> contextFrequencies(NUM_CONTEXTS * NUM_SYMBOLS, 0);
+	unsigned char previous = 0;
+	for (size_t i = 0; i < size; i++) {
+		contextFrequencies[previous * NUM_SYMBOLS + contents[i]]++;
+		previous = contents[i];
+	}
+
+	vector<long long> contextTotals(NUM_CONTEXTS, 0);
+	vector<int> busiest;
+	for (int context = 0; context < NUM_CONTEXTS; context++) {
+		for (int glyph = 0; glyph < NUM_BYTE_VALUES; glyph++)
+			contextTotals[context] += contextFrequencies[context * NUM_SYMBOLS + glyph];
+		if (contextTotals[context] > 0)
+			busiest.push_back(context);
+	}
+	stable_sort(busiest.begin(), busiest.end(), [&](int context1, int context2) {
+		return contextTotals[context1] > contextTotals[context2];
+	});
+
+	int numSeparate = (int)busiest.size() <= MAX_CONTEXT_CLUSTERS ? (int)busiest.size() : MAX_CONTEXT_CLUSTERS - 1;
+	vector<vector<long long>> clusterFrequencies;
+	int contextCluster[NUM_CONTEXTS] = {};
+	for (size_t i = 0; i < busiest.size(); i++) {
+		int cluster = min((int)i, numSeparate);
+		if (cluster == (int)clusterFrequencies.size())
+			clusterFrequencies.emplace_back(NUM_SYMBOLS, 0);
+		for (int glyph = 0; glyph < NUM_BYTE_VALUES; glyph++)
+			clusterFrequencies[cluster][glyph] += contextFrequencies[busiest[i] * NUM_SYMBOLS + glyph];
+		contextCluster[busiest[i]] = cluster;
+	}
+	if (clusterFrequencies.empty())
+		clusterFrequencies.emplace_back(NUM_SYMBOLS, 0);
+
+	// changes[first * numClusters + second] is how many bits merging
+	// second into first adds, which is negative when it saves some
+	int numClusters = (int)clusterFrequencies.size();
+	vector<double> costs(numClusters);
+	vector<double> changes(numClusters * numClusters, 0);
+	vector<bool> merged(numClusters, false);
+	vector<long long> mergedFrequencies(NUM_SYMBOLS);
+	auto mergeCost = [&](int first, int second) {
+		for (int glyph = 0; glyph < NUM_BYTE_VALUES; glyph++)
+			mergedFrequencies[glyph] = clusterFrequencies[first][glyph] + clusterFrequencies[second][glyph];
+		return clusterCost(mergedFrequencies.data()) - costs[first] - costs[second];
+	};
+
+	for (int cluster = 0; cluster < numClusters; cluster++)
+		costs[cluster] = clusterCost(clusterFrequencies[cluster].data());
+	for (int first = 0; first < numClusters; first++) {
+		for (int second = first + 1; second < numClusters; second++)
+			changes[first * numClusters + second] = mergeCost(first, second);
+	}
+
+	while (true) {
+		int bestFirst = -1, bestSecond = -1;
+		double bestChange = 0;
+		for (int first = 0; first < numClusters; first++) {
+			for (int second = first + 1; second < numClusters && !merged[first]; second++) {
+				if (!merged[second] && changes[first * numClusters + second] < bestChange) {
+					bestChange = changes[first * numClusters + second];
+					bestFirst = first;
+					bestSecond = second;
+				}
+			}
+		}
+		if (bestFirst < 0)
+			break;
+
+		for (int glyph = 0; glyph < NUM_BYTE_VALUES; glyph++)
+			clusterFrequencies[bestFirst][glyph] += clusterFrequencies[bestSecond][glyph];
+		costs[bestFirst] = clusterCost(clusterFrequencies[bestFirst].data());
+		merged[bestSecond] = true;
+		for (int context = 0; context < NUM_CONTEXTS; context++) {
+			if (contextCluster[context] == bestSecond)
+				contextCluster[context] = bestFirst;
+		}
+		for (int other = 0; other < numClusters; other++) {
+			if (other != bestFirst && !merged[other])
+				changes[min(bestFirst, other) * numClusters + max(bestFirst, other)] = mergeCost(bestFirst, other);
+		}
+	}
+
+	// Number the clusters that are left and build their codes
+	vector<int> clusterNumbers(numClusters);
+	model.numClusters = 0;
+	for (int cluster = 0; cluster < numClusters; cluster++) {
+		if (!merged[cluster])
+			clusterNumbers[cluster] = model.numClusters++;
+	}
+	for (int context = 0; context < NUM_CONTEXTS; context++)
+		model.clusters[context] = (unsigned char)clusterNumbers[contextCluster[context]];
+
+	model.codeLengths.assign(model.numClusters * NUM_SYMBOLS, NO_CODE);
+	model.frequencies.assign(model.numClusters * NUM_SYMBOLS, 0);
+	model.encodedSize = 1 + (NUM_CONTEXTS * clusterBits(model.numClusters) + BYTE_SIZE - 1) / BYTE_SIZE;
+	long long numBitsWhenCompressed = 0;
+	for (int cluster = 0; cluster < numClusters; cluster++) {
+		if (merged[cluster])
+			continue;
+		long long* frequencies = model.frequencies.data() + clusterNumbers[cluster] * NUM_SYMBOLS;
+		int* codeLengths = model.codeLengths.data() + clusterNumbers[cluster] * NUM_SYMBOLS;
+		copy(clusterFrequencies[cluster].begin(), clusterFrequencies[cluster].end(), frequencies);
+		numBitsWhenCompressed += buildCodeLengths(frequencies, codeLengths, maxCodeLength);
+		model.encodedSize += packedCodeLengthsSize(codeLengths);
+	}
+	model.encodedSize += (size_t)((numBitsWhenCompressed + BYTE_SIZE - 1) / BYTE_SIZE);
+}
+
+void encodeContextBlock(const unsigned char* contents, size_t size, const ContextModel& model, char* out) {
+	out[0] = (char)model.numClusters;
+	size_t position = 1;
+
+	int bitCount = 0;
+	for (int context = 0; context < NUM_CONTEXTS; context++)
+		packBits((unsigned char*)out + position, bitCount, model.clusters[context], clusterBits(model.numClusters));
+	position += (bitCount + BYTE_SIZE - 1) / BYTE_SIZE;
+
+	vector<HuffmanCode> codes(model.numClusters * NUM_SYMBOLS);
+	for (int cluster = 0; cluster < model.numClusters; cluster++) {
+		const int* codeLengths = model.codeLengths.data() + cluster * NUM_SYMBOLS;
+		position += packCodeLengths(codeLengths, NUM_SYMBOLS, (unsigned char*)out + position);
+		buildCanonicalCodes(codeLengths, codes.data() + cluster * NUM_SYMBOLS);
+	}
+
+	const HuffmanCode* contextCodes[NUM_CONTEXTS];
+	for (int context = 0; context < NUM_CONTEXTS; context++)
+		contextCodes[context] = codes.data() + model.clusters[context] * NUM_SYMBOLS;
+
+	BitWriter writer;
+	writeToMemory(writer, out + position, model.encodedSize - position);
+	unsigned char context = 0;
+	for (size_t i = 0; i < size; i++) {
+		writeCode(writer, contextCodes[context][contents[i]]);
+		context = contents[i];
+	}
+	flushBits(writer);
+}
+
+// Hands each stretch of a RUN_LENGTHS block that is coded a byte at a time
+// to visit, as visit(start, numBytes, repeats), along with the number of
+// repeats of the run that follows it, which is 0 after the last stretch.
+// A run starts once a byte has repeated the one before it MIN_RUN_REPEATS
+// times and takes in every repeat after that.
+template <typename Visit>
+void visitRuns(const unsigned char* contents, size_t size, Visit visit) {
+	unsigned char previous = 0;
+	size_t start = 0;
+	size_t repeats = 0;
+	for (size_t i = 0; i < size; i++) {
+		repeats = (repeats + 1) & (0 - (size_t)(contents[i] == previous));
+		previous = contents[i];
+		if (repeats < MIN_RUN_REPEATS)
+			continue;
+
+		size_t runStart = i + 1 - MIN_RUN_REPEATS;
+		size_t runEnd = i + 1;
+		while (runEnd < size && contents[runEnd] == previous && runEnd - runStart < MAX_RUN_REPEATS)
+			runEnd++;
+		visit(start, runStart - start, runEnd - runStart);
+		start = runEnd;
+		i = runEnd - 1;
+		repeats = 0;
+	}
+	visit(start, size - start, (size_t)0);
+}
+
+// The run symbol of a number of repeats, which is followed by that many
+// extra bits
+int runSymbolBits(size_t repeats) {
+	int extraBits = 0;
+	while (repeats >> (extraBits + 1))
+		extraBits++;
+	return extraBits;
+}
+
+// Every byte is counted as coded on its own, and the bytes of each run
+// then taken off again
+void buildRunLengthModel(const unsigned char* contents, size_t size, int maxCodeLength, RunLengthModel& model) {
+	fill(model.frequencies, model.frequencies + NUM_RUN_LENGTH_SYMBOLS, 0);
+	countGlyphs(contents, size, model.frequencies);
+	model.extraBits = 0;
+	visitRuns(contents, size, [&](size_t start, size_t numBytes, size_t repeats) {
+		if (repeats == 0)
+			return;
+		int extraBits = runSymbolBits(repeats);
+		model.frequencies[contents[start + numBytes]] -= repeats;
+		model.frequencies[FIRST_RUN_SYMBOL + extraBits]++;
+		model.extraBits += extraBits;
+	});
+
+	long long numBitsWhenCompressed = buildCodeLengths(model.frequencies, model.codeLengths, maxCodeLength, NUM_RUN_LENGTH_SYMBOLS);
+	model.encodedSize = packedCodeLengthsSize(model.codeLengths, NUM_RUN_LENGTH_SYMBOLS)
+		+ (size_t)((numBitsWhenCompressed + model.extraBits + BYTE_SIZE - 1) / BYTE_SIZE);
+}
+
+void encodeRunLengthBlock(const unsigned char* contents, size_t size, const RunLengthModel& model, char* out) {
+	size_t codeLengthsSize = packCodeLengths(model.codeLengths, NUM_RUN_LENGTH_SYMBOLS, (unsigned char*)out);
+	HuffmanCode codes[NUM_RUN_LENGTH_SYMBOLS];
+	buildCanonicalCodes(model.codeLengths, codes, NUM_RUN_LENGTH_SYMBOLS);
+	int maxCodeLength = *max_element(model.codeLengths, model.codeLengths + NUM_RUN_LENGTH_SYMBOLS);
+
+	BitWriter writer;
+	writeToMemory(writer, out + codeLengthsSize, model.encodedSize - codeLengthsSize);
+	visitRuns(contents, size, [&](size_t start, size_t numBytes, size_t repeats) {
+		writeGlyphs(writer, contents + start, numBytes, codes, maxCodeLength);
+		if (repeats == 0)
+			return;
+		int extraBits = runSymbolBits(repeats);
+		writeCode(writer, codes[FIRST_RUN_SYMBOL + extraBits]);
+		writeCode(writer, HuffmanCode{ repeats - ((size_t)1 << extraBits), extraBits });
+	});
+	flushBits(writer);
+}
+
+// The hash of the MIN_MATCH_LENGTH bytes at data
+inline unsigned int matchHash(const unsigned char* data, int hashBits) {
+	uint32_t bytes = data[0] | (data[1] << 8) | (data[2] << 16);
+	return (bytes * 2654435761u) >> (32 - hashBits);
+}
+
+// How many bytes from the start of match and data are the same, up to maxLength
+inline size_t matchLength(const unsigned char* match, const unsigned char* data, size_t maxLength) {
+	size_t length = 0;
+	while (length + sizeof(uint64_t) <= maxLength) {
+		uint64_t matchWord, dataWord;
+		memcpy(&matchWord, match + length, sizeof(matchWord));
+		memcpy(&dataWord, data + length, sizeof(dataWord));
+		if (matchWord != dataWord)
+			break;
+		length += sizeof(uint64_t);
+	}
+	while (length < maxLength && match[length] == data[length])
+		length++;
+	return length;
+}
+
+// The symbol of a match length or distance value, which is followed by
+// extraBits bits of the value
+int matchValueSymbol(unsigned int value, int& extraBits) {
+	if (value < 4) {
+		extraBits = 0;
+		return (int)value;
+	}
+	int highBit = 1;
+	while (value >> (highBit + 1))
+		highBit++;
+	extraBits = highBit - 1;
+	return 2 * highBit + ((value >> extraBits) & 1);
+}
+
+// Walks the hash chains from the newest place with the same hash as the
+// bytes at position, newest first. A place is in the chains from the time
+// it is inserted until windowSize bytes later, when its slot is reused.
+// Lazy levels put a short match off by a byte for as long as the next byte
+// starts a longer one, and only look for longer ones there.
+void buildMatchModel(const unsigned char* contents, size_t size, int level, unsigned int windowSize,
+		int maxCodeLength, MatchModel& model) {
+	const MatchLevel& settings = MATCH_LEVELS[min(max(level, MIN_MATCH_LEVEL), MAX_MATCH_LEVEL) - 1];
+	size_t window = MIN_WINDOW_SIZE;
+	while (window < windowSize && window < size)
+		window *= 2;
+	int hashBits = MIN_HASH_BITS;
+	while (hashBits < MAX_HASH_BITS && ((size_t)1 << hashBits) < min(size, window))
+		hashBits++;
+
+	// Places are stored plus one, so 0 ends a chain
+	model.head.assign((size_t)1 << hashBits, 0);
+	model.chain.resize(window);
+	size_t windowMask = window - 1;
+	auto insert = [&](size_t position) {
+		if (position + MIN_MATCH_LENGTH <= size) {
+			unsigned int& head = model.head[matchHash(contents + position, hashBits)];
+			model.chain[position & windowMask] = head;
+			head = (unsigned int)(position + 1);
+		}
+	};
+	auto findMatch = [&](size_t position, size_t shorterLength, unsigned int& distance) -> size_t {
+		size_t maxLength = min((size_t)MAX_MATCH_LENGTH, size - position);
+		if (maxLength <= max(shorterLength, (size_t)MIN_MATCH_LENGTH - 1))
+			return 0;
+		size_t bestLength = max(shorterLength, (size_t)MIN_MATCH_LENGTH - 1);
+		int maxChain = shorterLength >= settings.goodLength ? settings.maxChain / 4 : settings.maxChain;
+		unsigned int next = model.head[matchHash(contents + position, hashBits)];
+		for (int chainLeft = maxChain; next != 0 && chainLeft > 0; chainLeft--) {
+			size_t candidate = next - 1;
+			if (position - candidate > window)
+				break;
+			if (contents[candidate + bestLength] == contents[position + bestLength]) {
+				size_t length = matchLength(contents + candidate, contents + position, maxLength);
+				if (length > bestLength) {
+					bestLength = length;
+					distance = (unsigned int)(position - candidate);
+					if (length >= settings.niceLength || length == maxLength)
+						break;
+				}
+			}
+			next = model.chain[candidate & windowMask];
+		}
+		if (bestLength == max(shorterLength, (size_t)MIN_MATCH_LENGTH - 1) ||
+				(bestLength == MIN_MATCH_LENGTH && distance > MAX_SHORT_MATCH_DISTANCE))
+			return 0;
+		return bestLength;
+	};
+
+	model.sequences.clear();
+	size_t literalStart = 0;
+	size_t position = 0;
+	while (position < size) {
+		unsigned int distance = 0;
+		size_t length = findMatch(position, 0, distance);
+		insert(position);
+		while (length > 0 && length < settings.lazyLength && position + 1 < size) {
+			unsigned int nextDistance = 0;
+			size_t nextLength = findMatch(position + 1, length, nextDistance);
+			if (nextLength == 0)
+				break;
+			position++;
+			insert(position);
+			length = nextLength;
+			distance = nextDistance;
+		}
+		if (length == 0) {
+			position++;
+			continue;
+		}
+
+		MatchSequence sequence;
+		sequence.numLiterals = (unsigned int)(position - literalStart);
+		sequence.length = (unsigned int)length;
+		sequence.distance = distance;
+		model.sequences.push_back(sequence);
+		// The places inside a match longer than niceLength are left out of
+		// the hash chains, as zlib does past its max_insert_length. They
+		// would fill the chains with candidates that cannot win.
+		if (length <= settings.niceLength) {
+			for (size_t i = position + 1; i < position + length; i++)
+				insert(i);
+		}
+		position += length;
+		literalStart = position;
+	}
+	MatchSequence last;
+	last.numLiterals = (unsigned int)(size - literalStart);
+	model.sequences.push_back(last);
+
+	// Count the symbols and build the codes of both alphabets
+	fill(model.literalFrequencies, model.literalFrequencies + NUM_LITERAL_LENGTH_SYMBOLS, 0);
+	fill(model.distanceFrequencies, model.distanceFrequencies + NUM_DISTANCE_SYMBOLS, 0);
+	model.extraBits = 0;
+	position = 0;
+	for (const MatchSequence& sequence : model.sequences) {
+		for (size_t i = position; i < position + sequence.numLiterals; i++)
+			model.literalFrequencies[contents[i]]++;
+		position += sequence.numLiterals + sequence.length;
+		if (sequence.length == 0)
+			continue;
+
+		int lengthBits, distanceBits;
+		model.literalFrequencies[FIRST_LENGTH_SYMBOL + matchValueSymbol(sequence.length - MIN_MATCH_LENGTH, lengthBits)]++;
+		model.distanceFrequencies[matchValueSymbol(sequence.distance - 1, distanceBits)]++;
+		model.extraBits += lengthBits + distanceBits;
+	}
+
+	long long numBitsWhenCompressed = model.extraBits
+		+ buildCodeLengths(model.literalFrequencies, model.literalCodeLengths, maxCodeLength, NUM_LITERAL_LENGTH_SYMBOLS)
+		+ buildCodeLengths(model.distanceFrequencies, model.distanceCodeLengths, maxCodeLength, NUM_DISTANCE_SYMBOLS);
+	model.encodedSize = packedCodeLengthsSize(model.literalCodeLengths, NUM_LITERAL_LENGTH_SYMBOLS)
+		+ packedCodeLengthsSize(model.distanceCodeLengths, NUM_DISTANCE_SYMBOLS)
+		+ (size_t)((numBitsWhenCompressed + BYTE_SIZE - 1) / BYTE_SIZE);
+}
+
+void encodeMatchBlock(const unsigned char* contents, const MatchModel& model, char* out) {
+	size_t position = packCodeLengths(model.literalCodeLengths, NUM_LITERAL_LENGTH_SYMBOLS, (unsigned char*)out);
+	position += packCodeLengths(model.distanceCodeLengths, NUM_DISTANCE_SYMBOLS, (unsigned char*)out + position);
+
+	HuffmanCode literalCodes[NUM_LITERAL_LENGTH_SYMBOLS];
+	HuffmanCode distanceCodes[NUM_DISTANCE_SYMBOLS];
+	buildCanonicalCodes(model.literalCodeLengths, literalCodes, NUM_LITERAL_LENGTH_SYMBOLS);
+	buildCanonicalCodes(model.distanceCodeLengths, distanceCodes, NUM_DISTANCE_SYMBOLS);
+	int maxCodeLength = *max_element(model.literalCodeLengths, model.literalCodeLengths + NUM_LITERAL_LENGTH_SYMBOLS);
+
+	BitWriter writer;
+	writeToMemory(writer, out + position, model.encodedSize - position);
+	const unsigned char* next = contents;
+	for (const MatchSequence& sequence : model.sequences) {
+		writeGlyphs(writer, next, sequence.numLiterals, literalCodes, maxCodeLength);
+		next += sequence.numLiterals + sequence.length;
+		if (sequence.length == 0)
+			continue;
+
+		unsigned int length = sequence.length - MIN_MATCH_LENGTH;
+		unsigned int distance = sequence.distance - 1;
+		int lengthBits, distanceBits;
+		writeCode(writer, literalCodes[FIRST_LENGTH_SYMBOL + matchValueSymbol(length, lengthBits)]);
+		writeCode(writer, HuffmanCode{ length & ((1u << lengthBits) - 1), lengthBits });
+		writeCode(writer, distanceCodes[matchValueSymbol(distance, distanceBits)]);
+		writeCode(writer, HuffmanCode{ distance & ((1u << distanceBits) - 1), distanceBits });
+	}
+	flushBits(writer);
+}
+
+// Whether the suffix at position is S type and the one before it L type,
+// which makes it a leftmost S type suffix
+inline bool isLeftmostS(const vector<unsigned char>& types, int position) {
+	return position > 0 && types[position] == S_TYPE && types[position - 1] == L_TYPE;
+}
+
+// Points each symbol's bucket at its first place in the suffix array
+void bucketStarts(const vector<int>& counts, vector<int>& buckets) {
+	int start = 0;
+	for (size_t symbol = 0; symbol < counts.size(); symbol++) {
+		buckets[symbol] = start;
+		start += counts[symbol];
+	}
+}
+
+// Points each symbol's bucket just past its last place in the suffix array
+void bucketEnds(const vector<int>& counts, vector<int>& buckets) {
+	int end = 0;
+	for (size_t symbol = 0; symbol < counts.size(); symbol++) {
+		end += counts[symbol];
+		buckets[symbol] = end;
+	}
+}
+
+// Sorts the L type suffixes from the sorted S type suffixes at the ends of
+// their buckets, and then the S type suffixes from the L type ones
+template <typename Symbol>
+void induceSuffixes(const Symbol* text, int size, const vector<unsigned char>& types, const vector<int>& counts,
+		vector<int>& buckets, int* suffixArray) {
+	// The empty suffix sorts first, so the one before it heads its bucket
+	bucketStarts(counts, buckets);
+	suffixArray[buckets[text[size - 1]]++] = size - 1;
+	for (int i = 0; i < size; i++) {
+		int before = suffixArray[i] - 1;
+		if (before >= 0 && types[before] == L_TYPE)
+			suffixArray[buckets[text[before]]++] = before;
+	}
+
+	bucketEnds(counts, buckets);
+	for (int i = size - 1; i >= 0; i--) {
+		int before = suffixArray[i] - 1;
+		if (before >= 0 && types[before] == S_TYPE)
+			suffixArray[--buckets[text[before]]] = before;
+	}
+}
+
+// Whether the substrings from the leftmost S type suffixes at first and
+// second up to the next ones are the same, types and all. One that runs
+// into the end of the text is like no other.
+template <typename Symbol>
+bool sameLeftmostSubstring(const Symbol* text, int size, const vector<unsigned char>& types, int first, int second) {
+	for (int i = 0;; i++) {
+		if (first + i == size || second + i == size || text[first + i] != text[second + i] ||
+				types[first + i] != types[second + i])
+			return false;
+		if (i > 0 && isLeftmostS(types, first + i))
+			return true;
+	}
+}
+
+// SA-IS: sorts the substrings between the leftmost S type suffixes with two
+// induced passes, names each by its rank and sorts the suffixes of the
+// string of names the same way when the names are not all different. The
+// sorted leftmost S type suffixes then induce the order of all of them.
+// The string of names is kept in the back of the suffix array, which it
+// fits in along with its own suffix array, as there are at most half as
+// many leftmost S type suffixes as symbols.
+template <typename Symbol>
+void sortSuffixes(const Symbol* text, int size, int numSymbols, int* suffixArray) {
+	if (size <= 0)
+		return;
+
+	vector<unsigned char> types(size + 1);
+	types[size] = S_TYPE;
+	types[size - 1] = L_TYPE;
+	for (int i = size - 2; i >= 0; i--) {
+		bool sortsBefore = text[i] < text[i + 1] || (text[i] == text[i + 1] && types[i + 1] == S_TYPE);
+		types[i] = sortsBefore ? S_TYPE : L_TYPE;
+	}
+
+	vector<int> counts(numSymbols, 0);
+	vector<int> buckets(numSymbols);
+	for (int i = 0; i < size; i++)
+		counts[text[i]]++;
+
+	// Sort the substrings that start at the leftmost S type suffixes
+	fill(suffixArray, suffixArray + size, NO_SUFFIX);
+	bucketEnds(counts, buckets);
+	for (int i = 1; i < size; i++) {
+		if (isLeftmostS(types, i))
+			suffixArray[--buckets[text[i]]] = i;
+	}
+	induceSuffixes(text, size, types, counts, buckets, suffixArray);
+
+	// Gather them at the front in order, and name each substring by its rank
+	// in the back half, where no two of them land in the same place
+	int numLeftmost = 0;
+	for (int i = 0; i < size; i++) {
+		if (isLeftmostS(types, suffixArray[i]))
+			suffixArray[numLeftmost++] = suffixArray[i];
+	}
+	fill(suffixArray + numLeftmost, suffixArray + size, NO_SUFFIX);
+	int numNames = 0;
+	for (int i = 0; i < numLeftmost; i++) {
+		int position = suffixArray[i];
+		if (i == 0 || !sameLeftmostSubstring(text, size, types, position, suffixArray[i - 1]))
+			numNames++;
+		suffixArray[numLeftmost + position / 2] = numNames - 1;
+	}
+
+	// Move the names to the very back, in the order of the text
+	int* names = suffixArray + size - numLeftmost;
+	for (int i = size - 1, next = size - 1; i >= numLeftmost; i--) {
+		if (suffixArray[i] != NO_SUFFIX)
+			suffixArray[next--] = suffixArray[i];
+	}
+
+	// Sort the leftmost S type suffixes by their string of names, which
+	// needs no sorting when every name is different
+	if (numNames < numLeftmost)
+		sortSuffixes(names, numLeftmost, numNames, suffixArray);
+	else {
+		for (int i = 0; i < numLeftmost; i++)
+			suffixArray[names[i]] = i;
+	}
+
+	int* positions = names;
+	for (int i = 1, next = 0; i < size; i++) {
+		if (isLeftmostS(types, i))
+			positions[next++] = i;
+	}
+	for (int i = 0; i < numLeftmost; i++)
+		suffixArray[i] = positions[suffixArray[i]];
+	fill(suffixArray + numLeftmost, suffixArray + size, NO_SUFFIX);
+
+	// Put them at the ends of their buckets, last first, and induce the rest
+	bucketEnds(counts, buckets);
+	for (int i = numLeftmost - 1; i >= 0; i--) {
+		int position = suffixArray[i];
+		suffixArray[i] = NO_SUFFIX;
+		suffixArray[--buckets[text[position]]] = position;
+	}
+	induceSuffixes(text, size, types, counts, buckets, suffixArray);
+}
+
+void buildSuffixArray(const unsigned char* contents, size_t size, vector<int>& suffixArray) {
+	suffixArray.resize(size);
+	sortSuffixes(contents, (int)size, NUM_BYTE_VALUES, suffixArray.data());
+}
+
+// Adds the symbols of a run of numZeros move to front positions of 0 to the
+// transform, as its length in bijective base 2
+void addZeroRun(TransformModel& model, size_t numZeros) {
+	while (numZeros > 0) {
+		numZeros--;
+		model.symbols.push_back((unsigned short)(numZeros & 1 ? ZERO_RUN_B : ZERO_RUN_A));
+		numZeros >>= 1;
+	}
+}
+
+void buildTransformModel(const unsigned char* contents, size_t size, int maxCodeLength, TransformModel& model) {
+	buildSuffixArray(contents, size, model.suffixArray);
+	model.symbols.clear();
+	model.primaryIndex = 0;
+
+	// Row 0 is the rotation that starts with the end of block, and row r
+	// after it the one that starts with the suffix sorted r - 1st. The row
+	// of the suffix at 0 ends with the end of block and is left out.
+	unsigned char order[NUM_BYTE_VALUES];
+	for (int byte = 0; byte < NUM_BYTE_VALUES; byte++)
+		order[byte] = (unsigned char)byte;
+	size_t numZeros = 0;
+	for (size_t row = 0; row <= size && size > 0; row++) {
+		unsigned char byte;
+		if (row == 0)
+			byte = contents[size - 1];
+		else if (model.suffixArray[row - 1] == 0) {
+			model.primaryIndex = (unsigned int)row;
+			continue;
+		}
+		else
+			byte = contents[model.suffixArray[row - 1] - 1];
+
+		if (order[0] == byte) {
+			numZeros++;
+			continue;
+		}
+		addZeroRun(model, numZeros);
+		numZeros = 0;
+		int position = 1;
+		while (order[position] != byte)
+			position++;
+		memmove(order + 1, order, position);
+		order[0] = byte;
+		model.symbols.push_back((unsigned short)(position + 1));
+	}
+	addZeroRun(model, numZeros);
+
+	fill(model.frequencies, model.frequencies + NUM_SYMBOLS, 0);
+	for (unsigned short symbol : model.symbols)
+		model.frequencies[symbol]++;
+	long long numBitsWhenCompressed = buildCodeLengths(model.frequencies, model.codeLengths, maxCodeLength);
+	model.encodedSize = PRIMARY_INDEX_SIZE + packedCodeLengthsSize(model.codeLengths)
+		+ (size_t)((numBitsWhenCompressed + BYTE_SIZE - 1) / BYTE_SIZE);
+}
+
+void encodeTransformBlock(const TransformModel& model, char* out) {
+	uint32_t primaryIndex = model.primaryIndex;
+	memcpy(out, &primaryIndex, PRIMARY_INDEX_SIZE);
+	size_t position = PRIMARY_INDEX_SIZE + packCodeLengths(model.codeLengths, NUM_SYMBOLS, (unsigned char*)out + PRIMARY_INDEX_SIZE);
+	HuffmanCode codes[NUM_SYMBOLS];
+	buildCanonicalCodes(model.codeLengths, codes);
+
+	BitWriter writer;
+	writeToMemory(writer, out + position, model.encodedSize - position);
+	for (unsigned short symbol : model.symbols)
+		writeCode(writer, codes[symbol]);
+	flushBits(writer);
+}
+
+// The most bytes compress can write for size bytes of input.
+size_t compressBound(size_t size) {
+	// Data that coding would not make smaller is stored as it is
+	return STORED_HEADER_SIZE + size;
+}
+
+size_t compress(const unsigned char* in, size_t size, unsigned char* out, size_t capacity, int maxCodeLength) {
+	long long frequencies[NUM_SYMBOLS] = {};
+	countGlyphs(in, size, frequencies);
+	frequencies[END_OF_FILE] = 1;
+
+	int codeLengths[NUM_SYMBOLS];
+	long long numBitsWhenCompressed = buildCodeLengths(frequencies, codeLengths, maxCodeLength);
+	size_t codeLengthsSize = packedCodeLengthsSize(codeLengths);
+	const unsigned int fileNameSize = 0;
+	size_t blockSize = codeLengthsSize + (size_t)((numBitsWhenCompressed + BYTE_SIZE - 1) / BYTE_SIZE);
+	bool stored = STORED_HEADER_SIZE + size <= CANONICAL_HEADER_SIZE + blockSize;
+	size_t headerSize = stored ? STORED_HEADER_SIZE : CANONICAL_HEADER_SIZE;
+	if (stored)
+		blockSize = size;
+	if (capacity < headerSize || capacity - headerSize < blockSize)
+		return 0;
+
+	// The same header huff writes for a canonical or stored file, with no
+	// file name
+	unsigned char formatVersion = stored ? STORED_FORMAT_VERSION : CANONICAL_FORMAT_VERSION;
+	memcpy(out, &CANONICAL_MAGIC, sizeof(CANONICAL_MAGIC));
+	memcpy(out + sizeof(CANONICAL_MAGIC), &formatVersion, sizeof(formatVersion));
+	memcpy(out + sizeof(CANONICAL_MAGIC) + sizeof(formatVersion), &fileNameSize, sizeof(fileNameSize));
+	if (stored) {
+		unsigned long long storedSize = size;
+		memcpy(out + CANONICAL_HEADER_SIZE, &storedSize, sizeof(storedSize));
+		if (size > 0)
+			memcpy(out + STORED_HEADER_SIZE, in, size);
+	}
+	else
+		encodeBlock(in, size, codeLengths, 0, (char*)out + CANONICAL_HEADER_SIZE, blockSize);
+
+	return headerSize + blockSize;
+}
+
+// Appends a 32 bit value to the bytes waiting to be handed out
+void appendWord(vector<unsigned char>& pending, unsigned int value) {
+	for (size_t i = 0; i < sizeof(unsigned int); i++)
+		pending.push_back((unsigned char)(value >> (i * BYTE_SIZE)));
+}
+
+// Codes one block with its own tree and adds it to the pending output as
+// a stream format frame: its original size, its compressed size, its code
+// lengths and then its huffman coded data. A block that coding would not
+// make smaller is stored instead, with a compressed size of 0.
+void encodeFrame(HuffEncoder& encoder, const unsigned char* contents, size_t size) {
+	long long frequencies[NUM_SYMBOLS] = {};
+	countGlyphs(contents, size, frequencies);
+	frequencies[END_OF_FILE] = 1;
+
+	int codeLengths[NUM_SYMBOLS];
+	long long numBitsWhenCompressed = buildCodeLengths(frequencies, codeLengths, encoder.maxCodeLength);
+
+	BlockIndexEntry indexEntry;
+	indexEntry.originalSize = (unsigned int)size;
+	indexEntry.compressedSize = (unsigned int)(packedCodeLengthsSize(codeLengths) + (numBitsWhenCompressed + BYTE_SIZE - 1) / BYTE_SIZE);
+
+	if (indexEntry.compressedSize >= indexEntry.originalSize) {
+		appendWord(encoder.pending, indexEntry.originalSize);
+		appendWord(encoder.pending, 0);
+		encoder.pending.insert(encoder.pending.end(), contents, contents + size);
+		return;
+	}
+
+	appendWord(encoder.pending, indexEntry.originalSize);
+	appendWord(encoder.pending, indexEntry.compressedSize);
+	size_t frameStart = encoder.pending.size();
+	encoder.pending.resize(frameStart + indexEntry.compressedSize);
+	encodeBlock(contents, size, codeLengths, 0, (char*)encoder.pending.data() + frameStart, indexEntry.compressedSize);
+}
+
+// Hands out as much of the pending output as fits in out. Returns true
+// once all of it has been handed out.
+bool drainPending(HuffEncoder& encoder, unsigned char*& out, size_t& outSize) {
+	size_t count = min(outSize, encoder.pending.size() - encoder.pendingPosition);
+	if (count > 0)
+		memcpy(out, encoder.pending.data() + encoder.pendingPosition, count);
+	out += count;
+	outSize -= count;
+	encoder.pendingPosition += count;
+
+	if (encoder.pendingPosition < encoder.pending.size())
+		return false;
+	encoder.pending.clear();
+	encoder.pendingPosition = 0;
+	return true;
+}
+
+// Resets the encoder and makes the start of the header the pending output
+void startHeader(HuffEncoder& encoder, unsigned char formatVersion, const string& storedName,
+		unsigned int blockSize, int maxCodeLength) {
+	encoder.blockSize = max(blockSize, 1u);
+	encoder.maxCodeLength = maxCodeLength;
+	encoder.block.clear();
+	encoder.pending.clear();
+	encoder.pendingPosition = 0;
+	encoder.finished = false;
+	encoder.adaptive = formatVersion == ADAPTIVE_FORMAT_VERSION;
+
+	appendWord(encoder.pending, CANONICAL_MAGIC);
+	encoder.pending.push_back(formatVersion);
+	appendWord(encoder.pending, (unsigned int)storedName.size());
+	encoder.pending.insert(encoder.pending.end(), storedName.begin(), storedName.end());
+}
+
+void initEncoder(HuffEncoder& encoder, const string& storedName, unsigned int blockSize, int maxCodeLength) {
+	startHeader(encoder, STREAM_FORMAT_VERSION, storedName, blockSize, maxCodeLength);
+}
+
+void initAdaptiveModel(AdaptiveModel& model, unsigned int rebuildInterval, int maxCodeLength) {
+	fill(model.frequencies, model.frequencies + NUM_SYMBOLS, 1);
+	model.totalFrequency = NUM_SYMBOLS;
+	model.maxCodeLength = maxCodeLength;
+	model.rebuildInterval = rebuildInterval;
+	model.nextInterval = min(FIRST_REBUILD_INTERVAL, rebuildInterval);
+	model.bytesUntilRebuild = model.nextInterval;
+	buildCodeLengths(model.frequencies, model.codeLengths, maxCodeLength);
+}
+
+bool updateAdaptiveModel(AdaptiveModel& model, const unsigned char* data, size_t size) {
+	// A few glyphs at a time are not worth setting up countGlyphs for
+	if (size < sizeof(uint64_t)) {
+		for (size_t i = 0; i < size; i++)
+			model.frequencies[data[i]]++;
+	}
+	else
+		countGlyphs(data, size, model.frequencies);
+	model.totalFrequency += size;
+	model.bytesUntilRebuild -= (unsigned int)size;
+	if (model.bytesUntilRebuild > 0)
+		return false;
+
+	// Halving keeps every glyph counted at least once, so every glyph
+	// keeps a code
+	if (model.totalFrequency > ADAPTIVE_COUNT_LIMIT) {
+		model.totalFrequency = 0;
+		for (int glyph = 0; glyph < NUM_SYMBOLS; glyph++) {
+			model.frequencies[glyph] = (model.frequencies[glyph] + 1) / 2;
+			model.totalFrequency += model.frequencies[glyph];
+		}
+	}
+
+	buildCodeLengths(model.frequencies, model.codeLengths, model.maxCodeLength);
+	model.nextInterval = min(model.nextInterval * 2, model.rebuildInterval);
+	model.bytesUntilRebuild = model.nextInterval;
+	return true;
+}
+
+void initAdaptiveEncoder(HuffEncoder& encoder, const string& storedName, unsigned int rebuildInterval, int maxCodeLength) {
+	rebuildInterval = min(max(rebuildInterval, 1u), MAX_REBUILD_INTERVAL);
+	startHeader(encoder, ADAPTIVE_FORMAT_VERSION, storedName, rebuildInterval, maxCodeLength);
+	appendWord(encoder.pending, rebuildInterval);
+	encoder.pending.push_back((unsigned char)maxCodeLength);
+
+	initAdaptiveModel(encoder.model, rebuildInterval, maxCodeLength);
+	buildCanonicalCodes(encoder.model.codeLengths, encoder.codes);
+	encoder.writer.bitBuffer = 0;
+	encoder.writer.bitCount = 0;
+}
+
+// Points the encoder's writer at the end of the pending output, with room
+// for the codes of size glyphs and the bits left over from the last ones
+void makePendingRoom(HuffEncoder& encoder, size_t size, int longestCode) {
+	BitWriter& writer = encoder.writer;
+	size_t used = encoder.pending.size();
+	encoder.pending.resize(used + (size * longestCode + BYTE_SIZE - 1) / BYTE_SIZE + 2 * sizeof(uint64_t));
+	writer.out = (char*)encoder.pending.data();
+	writer.outSize = encoder.pending.size();
+	writer.outBufferIndex = used;
+	writer.fout = nullptr;
+}
+
+// Codes size glyphs with the current codes, then counts them, which may
+// give the glyphs after them new codes. Only whole 32 bit words are added
+// to the pending output; the bits left over wait in the bit buffer.
+void encodeAdaptive(HuffEncoder& encoder, const unsigned char* contents, size_t size) {
+	int longestCode = *max_element(encoder.model.codeLengths, encoder.model.codeLengths + NUM_SYMBOLS);
+	makePendingRoom(encoder, size, longestCode);
+	writeGlyphs(encoder.writer, contents, size, encoder.codes, longestCode);
+	encoder.pending.resize(encoder.writer.outBufferIndex);
+
+	if (updateAdaptiveModel(encoder.model, contents, size))
+		buildCanonicalCodes(encoder.model.codeLengths, encoder.codes);
+}
+
+// The adaptive half of feedEncoder. The input is coded a slice at a time
+// so the pending output stays small.
+HuffStatus feedAdaptive(HuffEncoder& encoder, const unsigned char*& in, size_t& inSize,
+		unsigned char*& out, size_t& outSize) {
+	while (true) {
+		if (!drainPending(encoder, out, outSize))
+			return HUFF_OUTPUT_FULL;
+
+		// Every whole byte coded so far is handed out before asking for
+		// more, so the output keeps up with a slow input
+		if (inSize == 0) {
+			BitWriter& writer = encoder.writer;
+			if (writer.bitCount < BYTE_SIZE)
+				return HUFF_NEED_INPUT;
+			makePendingRoom(encoder, 0, 0);
+			while (writer.bitCount >= BYTE_SIZE) {
+				writer.out[writer.outBufferIndex++] = (char)writer.bitBuffer;
+				writer.bitBuffer >>= BYTE_SIZE;
+				writer.bitCount -= BYTE_SIZE;
+			}
+			encoder.pending.resize(writer.outBufferIndex);
+			continue;
+		}
+
+		size_t count = min({ inSize, (size_t)encoder.model.bytesUntilRebuild, (size_t)ADAPTIVE_SLICE_SIZE });
+		encodeAdaptive(encoder, in, count);
+		in += count;
+		inSize -= count;
+	}
+}
+
+HuffStatus feedEncoder(HuffEncoder& encoder, const unsigned char*& in, size_t& inSize,
+		unsigned char*& out, size_t& outSize) {
+	if (encoder.adaptive)
+		return feedAdaptive(encoder, in, inSize, out, outSize);
+
+	while (true) {
+		if (!drainPending(encoder, out, outSize))
+			return HUFF_OUTPUT_FULL;
+
+		if (encoder.block.size() == encoder.blockSize) {
+			encodeFrame(encoder, encoder.block.data(), encoder.block.size());
+			encoder.block.clear();
+			continue;
+		}
+
+		if (inSize == 0)
+			return HUFF_NEED_INPUT;
+
+		// Whole blocks are coded straight from the caller's memory
+		if (encoder.block.empty() && inSize >= encoder.blockSize) {
+			encodeFrame(encoder, in, encoder.blockSize);
+			in += encoder.blockSize;
+			inSize -= encoder.blockSize;
+			continue;
+		}
+
+		size_t count = min(inSize, encoder.blockSize - encoder.block.size());
+		encoder.block.insert(encoder.block.end(), in, in + count);
+		in += count;
+		inSize -= count;
+	}
+}
+
+HuffStatus finishEncoder(HuffEncoder& encoder, unsigned char*& out, size_t& outSize) {
+	if (!encoder.finished && encoder.adaptive) {
+		makePendingRoom(encoder, 1, encoder.codes[END_OF_FILE].length);
+		writeCode(encoder.writer, encoder.codes[END_OF_FILE]);
+		flushBits(encoder.writer);
+		encoder.pending.resize(encoder.writer.outBufferIndex);
+		encoder.finished = true;
+	}
+
+	if (!encoder.finished) {
+		if (!encoder.block.empty())
+			encodeFrame(encoder, encoder.block.data(), encoder.block.size());
+		encoder.block.clear();
+
+		// A frame with no original size ends the stream
+		appendWord(encoder.pending, 0);
+		encoder.finished = true;
+	}
+
+	return drainPending(encoder, out, outSize) ? HUFF_DONE : HUFF_OUTPUT_FULL;
+}
+
+}
@@ -0,0 +1,725 @@
+// huffpuff.h
+// The Huffman coder behind huff and Puff, as a library that other programs
+// can link against. It builds the trees and codes, reads and writes the
+// .huf headers and encodes and decodes the huffman coded data. Everything
+// works on memory owned by the caller; huff and Puff add the files, the
+// threads and the command line on top.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace huffpuff {
+
+const int END_OF_FILE = 256;
+const int NUM_SYMBOLS = END_OF_FILE + 1;
+const int NUM_BYTE_VALUES = 256;
+const int MAX_HUFFMAN_TABLE = 513;
+const int ROOT = 0;
+const int INVALID = -1;
+const int MERGE_NODE = -1;
+const int NO_CODE = -1;
+const int MAX_CODE_LENGTH = 64;
+
+// Code lengths can be limited to as few as 9 bits, the shortest that still
+// gives every glyph and the end of file a code
+const int MIN_CODE_LENGTH_LIMIT = 9;
+const int BYTE_SIZE = 8;
+const int KILOBYTE = 1024;
+
+// Files written in the canonical format start with this magic number
+// where the original format starts with the length of the file name.
+const unsigned int CANONICAL_MAGIC = 0x46555048; // "HPUF"
+const unsigned char ORIGINAL_FORMAT = 0;
+const unsigned char CANONICAL_FORMAT_VERSION = 1;
+const unsigned char BLOCK_FORMAT_VERSION = 2;
+const unsigned char STREAM_FORMAT_VERSION = 3;
+const unsigned char ADAPTIVE_FORMAT_VERSION = 4;
+
+// A file that coding would not make smaller is stored as it is. The stored
+// format header ends with the size of the file as a 64 bit number, and its
+// bytes follow.
+const unsigned char STORED_FORMAT_VERSION = 5;
+
+// Block format flags
+const unsigned char SHARED_TREE = 1;
+const unsigned char INTERLEAVED_STREAMS = 2;
+const unsigned char REUSED_TREES = 4;
+const unsigned char CONTEXT_MODEL = 8;
+const unsigned char RUN_LENGTHS = 16;
+const unsigned char MATCHES = 32;
+const unsigned char BURROWS_WHEELER = 64;
+const unsigned char STORED_BLOCKS = 128;
+
+// Every block with the REUSED_TREES flag starts with how many blocks back
+// the block it takes its code lengths from is. That is always the latest
+// block to store code lengths, and 0 when the block stores its own. The
+// distance is written seven bits to a byte, lowest first, with the top bit
+// set on every byte but the last, so a nearby tree costs a single byte.
+const int MAX_TREE_DISTANCE_SIZE = 5;
+const int TREE_DISTANCE_BITS = 7;
+const unsigned char MORE_DISTANCE_BYTES = 0x80;
+
+inline size_t treeDistanceSize(unsigned int treeDistance) {
+	size_t size = 1;
+	while (treeDistance >>= TREE_DISTANCE_BITS)
+		size++;
+	return size;
+}
+
+// With the STORED_BLOCKS flag, a block whose compressed size is its
+// original size holds its bytes as they are. The encoder stores a block
+// whenever coding it would not make it smaller, and pads the rare block
+// that other blocks take their code lengths from and that codes to exactly
+// its original size with a byte after its end of file. A stream format
+// frame with a compressed size of 0 is stored the same way, with its
+// original size of bytes following the sizes.
+inline bool isStoredBlock(unsigned int compressedSize, unsigned int originalSize, unsigned char flags) {
+	return (flags & STORED_BLOCKS) && compressedSize == originalSize;
+}
+
+// A block with the CONTEXT_MODEL flag codes every byte with the code of
+// its context, the byte before it, which is 0 at the start of the block.
+// Contexts followed by much the same bytes share a cluster with one code.
+// The block starts with the number of clusters and the cluster of every
+// context, packed into just enough bits for the last cluster, followed by
+// the code lengths of each cluster and then the coded bytes, which have
+// no end of file.
+const int NUM_CONTEXTS = NUM_BYTE_VALUES;
+const int MAX_CONTEXT_CLUSTERS = 64;
+
+// A block with the RUN_LENGTHS flag adds NUM_RUN_SYMBOLS symbols after the
+// end of file glyph, which it does not use. Run symbol n repeats the byte
+// before it, 0 at the start of the block, a number of times from 2^n up to
+// 2^(n+1) - 1, and is followed by the n low bits of that number. The block
+// starts with the code lengths of all NUM_RUN_LENGTH_SYMBOLS symbols.
+const int NUM_RUN_SYMBOLS = 32;
+const int FIRST_RUN_SYMBOL = NUM_SYMBOLS;
+const int NUM_RUN_LENGTH_SYMBOLS = NUM_SYMBOLS + NUM_RUN_SYMBOLS;
+
+// A block with the MATCHES flag is LZ77 coded: bytes are coded one at a
+// time or as a match, which copies length bytes from distance bytes back in
+// the block. Its literal/length alphabet adds NUM_LENGTH_SYMBOLS length
+// symbols after the end of file glyph, which it does not use, and the
+// distances have an alphabet of their own. A length less MIN_MATCH_LENGTH
+// and a distance less one are coded alike: values below 4 have a symbol
+// each, and a larger one the symbol of its two highest bits followed by the
+// bits below them. The block starts with the code lengths of the literal/
+// length alphabet and then those of the distance alphabet.
+const int MIN_MATCH_LENGTH = 3;
+const int MATCH_LENGTH_BITS = 16;
+const unsigned int MAX_MATCH_LENGTH = MIN_MATCH_LENGTH + (1u << MATCH_LENGTH_BITS) - 1;
+const int NUM_LENGTH_SYMBOLS = 2 * MATCH_LENGTH_BITS;
+const int FIRST_LENGTH_SYMBOL = NUM_SYMBOLS;
+const int NUM_LITERAL_LENGTH_SYMBOLS = NUM_SYMBOLS + NUM_LENGTH_SYMBOLS;
+const int MAX_WINDOW_BITS = 24;
+const int NUM_DISTANCE_SYMBOLS = 2 * MAX_WINDOW_BITS;
+
+// Matches are looked for up to windowSize bytes back, harder at higher levels
+const unsigned int MIN_WINDOW_SIZE = 1 << 10;
+const unsigned int MAX_WINDOW_SIZE = 1u << MAX_WINDOW_BITS;
+const unsigned int DEFAULT_WINDOW_SIZE = 1 << 20;
+const int MIN_MATCH_LEVEL = 1;
+const int MAX_MATCH_LEVEL = 9;
+const int DEFAULT_MATCH_LEVEL = 6;
+
+// A block with the BURROWS_WHEELER flag codes the Burrows-Wheeler
+// transform of its bytes: the last byte of each rotation of the block, with
+// an end of block added that sorts before every byte, taken in the order
+// the rotations sort in. The rotation that starts with the end of block
+// is left out, and the block starts with its row, the primary index. The
+// transform is move to front coded, and symbol n + 1 codes position n.
+// Runs of position 0 are coded instead as their length in bijective base
+// 2, lowest digit first, with ZERO_RUN_A for a digit of 1 and ZERO_RUN_B
+// for a digit of 2, as bzip2 does. The code lengths of the
+// NUM_SYMBOLS symbols follow the primary index. Each row number shares a
+// word with a byte when the block is decoded, so blocks hold at most
+// MAX_TRANSFORM_BLOCK_SIZE bytes.
+const int ZERO_RUN_A = 0;
+const int ZERO_RUN_B = 1;
+const size_t PRIMARY_INDEX_SIZE = sizeof(uint32_t);
+const unsigned int MAX_TRANSFORM_BLOCK_SIZE = 1 << 23;
+
+// The most symbols any alphabet has
+const int MAX_SYMBOLS = NUM_RUN_LENGTH_SYMBOLS > NUM_LITERAL_LENGTH_SYMBOLS ? NUM_RUN_LENGTH_SYMBOLS : NUM_LITERAL_LENGTH_SYMBOLS;
+
+// Codes that change from one symbol to the next are decoded a symbol at a
+// time, and are kept to at most this many bits
+const int MAX_SYMBOL_CODE_LENGTH = 32;
+
+// A block with interleaved streams is cut into NUM_STREAMS segments that
+// are coded one after another, each ending with its own end of file, so
+// a decoder can work on all of them at once. A jump table with the sizes
+// of all but the last stream comes first.
+const int NUM_STREAMS = 4;
+const int JUMP_TABLE_SIZE = (NUM_STREAMS - 1) * sizeof(unsigned int);
+
+// The packed code lengths start with a bitmap of the glyphs that have a
+// code and the number of bits in each length, which give the size of the rest
+const int CODE_LENGTHS_PREFIX_SIZE = (NUM_SYMBOLS + BYTE_SIZE + BYTE_SIZE - 1) / BYTE_SIZE;
+
+// Longest file name a header may store
+const unsigned int MAX_STORED_NAME = 1 << 16;
+
+// Decode tables are indexed by this many bits of the encoded data, and an
+// entry holds at most MAX_SYMBOLS_PER_ENTRY glyphs
+const int PRIMARY_TABLE_BITS = 11;
+const int SUB_TABLE_BITS = 8;
+const int MAX_SYMBOLS_PER_ENTRY = 4;
+const int ROOT_TABLE = 0;
+const int NO_SUB_TABLE = -1;
+
+const int OUTPUT_BUFFER_SIZE = 1 << 20;
+const unsigned int DEFAULT_STREAM_BLOCK_SIZE = 1 << 20;
+
+// The adaptive format has no code lengths in it. Both ends start with every
+// glyph counted once and rebuild the codes from the glyphs seen so far,
+// first after FIRST_REBUILD_INTERVAL bytes and then after twice as many
+// each time, up to the rebuild interval in the header. The counts are
+// halved whenever they add up to more than ADAPTIVE_COUNT_LIMIT, so the
+// codes follow the data as it changes.
+const unsigned int FIRST_REBUILD_INTERVAL = 1024;
+const unsigned int DEFAULT_REBUILD_INTERVAL = 64 * 1024;
+const unsigned int MAX_REBUILD_INTERVAL = 1 << 24;
+const long long ADAPTIVE_COUNT_LIMIT = 1 << 20;
+
+// What the streaming calls and readHeader report back
+enum HuffStatus {
+	HUFF_OK,			// the call did everything it was asked to
+	HUFF_NEED_INPUT,	// all of the input was used, more is expected
+	HUFF_OUTPUT_FULL,	// call again with more room for output
+	HUFF_DONE,			// the end of the stream was reached
+	HUFF_INVALID_DATA,	// the input is not a valid .huf stream
+	HUFF_TRUNCATED		// the input ended in the middle of the stream
+};
+
+#pragma region encoding
+struct HuffmanNode {
+	int glyph = MERGE_NODE;
+	long long frequency = 0;
+	int leftChildIndex = INVALID;
+	int rightChildIndex = INVALID;
+};
+
+// The tree as the original format stores it
+struct MinHuffmanNode {
+	int glyph;
+	int leftChildIndex = INVALID;
+	int rightChildIndex = INVALID;
+};
+
+// A glyph's code as an integer. The bits are stored in the order they are
+// written, first bit in the lowest position, so they can be ORed straight
+// into the writer's bit buffer. Codes are assumed to be no longer than 64
+// bits, which would take a file of tens of terabytes to exceed.
+struct HuffmanCode {
+	uint64_t bits = 0;
+	int length = 0;
+};
+
+// Collects the compressed bits in a 64 bit buffer that is moved into
+// out 32 bits at a time, least significant byte first. out is outBuffer,
+// which is written to fout whenever it fills up, unless writeToMemory
+// pointed the writer at memory of the caller's. That memory has to be big
+// enough for all of the compressed bits.
+struct BitWriter {
+	std::vector<char> outBuffer;
+	char* out = nullptr;
+	size_t outSize = 0;
+	size_t outBufferIndex = 0;
+	uint64_t bitBuffer = 0;
+	int bitCount = 0;
+	std::ostream* fout = nullptr;
+};
+
+// One entry of the block index written after the block format header.
+// Offsets count from the end of the index, so any block can be found
+// and decoded on its own.
+struct BlockIndexEntry {
+	unsigned long long offset = 0;
+	unsigned int compressedSize = 0;
+	unsigned int originalSize = 0;
+};
+
+// The glyph counts and code lengths of an adaptive stream, which the
+// encoder and decoder update in step
+struct AdaptiveModel {
+	long long frequencies[NUM_SYMBOLS];
+	int codeLengths[NUM_SYMBOLS];
+	long long totalFrequency = 0;
+	int maxCodeLength = MAX_CODE_LENGTH;
+	unsigned int rebuildInterval = DEFAULT_REBUILD_INTERVAL;
+	unsigned int nextInterval = FIRST_REBUILD_INTERVAL;
+	unsigned int bytesUntilRebuild = FIRST_REBUILD_INTERVAL;
+};
+
+// The clusters of a CONTEXT_MODEL block and the code of each, along with
+// the exact number of bytes the block takes. frequencies counts the bytes
+// coded with each cluster's code.
+struct ContextModel {
+	int numClusters = 0;
+	unsigned char clusters[NUM_CONTEXTS] = {};
+	std::vector<int> codeLengths;
+	std::vector<long long> frequencies;
+	size_t encodedSize = 0;
+};
+
+// The symbols of a RUN_LENGTHS block and their code, along with the exact
+// number of bytes the block takes. extraBits counts the bits that follow
+// the run symbols.
+struct RunLengthModel {
+	long long frequencies[NUM_RUN_LENGTH_SYMBOLS] = {};
+	int codeLengths[NUM_RUN_LENGTH_SYMBOLS];
+	long long extraBits = 0;
+	size_t encodedSize = 0;
+};
+
+// Part of a MATCHES block: numLiterals bytes coded one at a time followed
+// by a match, which has a length of 0 after the last of the bytes.
+struct MatchSequence {
+	unsigned int numLiterals = 0;
+	unsigned int length = 0;
+	unsigned int distance = 0;
+};
+
+// The matches of a MATCHES block and the codes of both its alphabets, along
+// with the exact number of bytes the block takes. extraBits counts the bits
+// that follow the length and distance symbols. head and chain are the hash
+// chains of the match finder, which are built again for every block and
+// only kept so the next block reuses their memory.
+struct MatchModel {
+	std::vector<MatchSequence> sequences;
+	long long literalFrequencies[NUM_LITERAL_LENGTH_SYMBOLS];
+	long long distanceFrequencies[NUM_DISTANCE_SYMBOLS];
+	int literalCodeLengths[NUM_LITERAL_LENGTH_SYMBOLS];
+	int distanceCodeLengths[NUM_DISTANCE_SYMBOLS];
+	long long extraBits = 0;
+	size_t encodedSize = 0;
+	std::vector<unsigned int> head;
+	std::vector<unsigned int> chain;
+};
+
+// The move to front coded transform of a BURROWS_WHEELER block and its
+// code, along with the exact number of bytes the block takes. The suffix
+// array the transform is read from is sorted again for every block and
+// only kept so the next block reuses its memory.
+struct TransformModel {
+	unsigned int primaryIndex = 0;
+	std::vector<unsigned short> symbols;
+	long long frequencies[NUM_SYMBOLS];
+	int codeLengths[NUM_SYMBOLS];
+	size_t encodedSize = 0;
+	std::vector<int> suffixArray;
+};
+
+// Compresses a stream handed over a piece at a time. The input is cut into
+// blocks of blockSize bytes, and every block is coded with its own tree as
+// soon as it is complete, so memory use does not grow with the stream.
+// An adaptive encoder codes every byte as soon as it arrives instead.
+struct HuffEncoder {
+	unsigned int blockSize = DEFAULT_STREAM_BLOCK_SIZE;
+	int maxCodeLength = MAX_CODE_LENGTH;
+	std::vector<unsigned char> block;
+	std::vector<unsigned char> pending;
+	size_t pendingPosition = 0;
+	bool finished = false;
+	bool adaptive = false;
+	AdaptiveModel model;
+	HuffmanCode codes[NUM_SYMBOLS];
+	BitWriter writer;
+};
+
+// Runs the Huffman algorithm over the glyph frequencies in huffmanTable,
+// which is indexed by glyph, leaving the finished tree in huffmanTable and
+// minHuffmanTable with its root at ROOT and every node before its children.
+// The tables need room for 2 * numSymbols - 1 nodes. Returns the number of
+// nodes in the tree.
+int buildHuffmanTree(HuffmanNode huffmanTable[], MinHuffmanNode minHuffmanTable[], int numSymbols = NUM_SYMBOLS);
+
+// Finds the code and code length of every glyph in the finished tree.
+// Returns the number of bits the glyphs take up once encoded.
+long long buildCodes(const HuffmanNode huffmanTable[], int numNodes, HuffmanCode codes[], int codeLengths[]);
+
+// Builds a Huffman tree for the given glyph frequencies and returns the
+// code length of every glyph along with the number of encoded bits. No
+// code is longer than maxCodeLength bits. The alphabets with more symbols
+// than the glyphs and end of file pass their numSymbols to this and the
+// functions below.
+long long buildCodeLengths(const long long frequencies[], int codeLengths[],
+	int maxCodeLength = MAX_CODE_LENGTH, int numSymbols = NUM_SYMBOLS);
+
+// Shortens the codes of a Huffman code to at most maxCodeLength bits, using
+// the lengths that take the fewest encoded bits. Returns that number of bits.
+long long limitCodeLengths(const long long frequencies[], int codeLengths[], int maxCodeLength,
+	int numSymbols = NUM_SYMBOLS);
+
+// Replaces the codes of the tree with canonical codes of the same lengths.
+void buildCanonicalCodes(const int codeLengths[], HuffmanCode codes[], int numSymbols = NUM_SYMBOLS);
+
+// Packs the code lengths the way the canonical header stores them
+std::vector<unsigned char> packCodeLengths(const int codeLengths[], int numSymbols = NUM_SYMBOLS);
+
+// Packs the code lengths into the packedCodeLengthsSize bytes at out.
+// Returns that number of bytes.
+size_t packCodeLengths(const int codeLengths[], int numSymbols, unsigned char* out);
+
+// The number of bytes packCodeLengths packs the code lengths into
+size_t packedCodeLengthsSize(const int codeLengths[], int numSymbols = NUM_SYMBOLS);
+
+// Adds the number of times each byte value appears in data to frequencies.
+void countGlyphs(const unsigned char* data, size_t size, long long frequencies[]);
+
+// Points the writer at outSize bytes of the caller's memory.
+void writeToMemory(BitWriter& writer, char* out, size_t outSize);
+
+// Gives the writer room for more bits: outBuffer the first time through,
+// after that by writing outBuffer to fout.
+void makeRoom(BitWriter& writer);
+
+// Writes out the last partially filled bytes and whatever is left in the buffer.
+void flushBits(BitWriter& writer);
+
+// Encodes one block on its own, preceded by its code lengths unless the
+// SHARED_TREE flag says every block shares one tree, and as interleaved
+// streams with the INTERLEAVED_STREAMS flag. With the REUSED_TREES flag
+// the block starts with treeDistance, and only stores its code lengths
+// when that is 0. indexEntry gives the exact size of the result.
+std::vector<char> encodeBlock(const unsigned char* contents, const BlockIndexEntry& indexEntry,
+	const int codeLengths[], unsigned char flags, unsigned int treeDistance = 0);
+
+// The same, written straight to out, which has to hold compressedSize bytes.
+void encodeBlock(const unsigned char* contents, size_t size, const int codeLengths[], unsigned char flags,
+	char* out, size_t compressedSize, unsigned int treeDistance = 0);
+
+// The number of bytes encodeBlock writes for a block. frequencies counts
+// the glyphs of the block including its end of file, or with interleaved
+// streams those of each segment, as countSegmentGlyphs leaves them.
+size_t encodedBlockSize(const long long frequencies[], const int codeLengths[], unsigned char flags,
+	unsigned int treeDistance = 0);
+
+// Whether every glyph counted in frequencies has a code.
+bool codesAllGlyphs(const long long frequencies[], const int codeLengths[]);
+
+// Counts the bytes of a block in each context, clusters the contexts and
+// builds the code of each cluster, none longer than maxCodeLength bits.
+void buildContextModel(const unsigned char* contents, size_t size, int maxCodeLength, ContextModel& model);
+
+// Encodes one CONTEXT_MODEL block into out, which has to hold
+// model.encodedSize bytes.
+void encodeContextBlock(const unsigned char* contents, size_t size, const ContextModel& model, char* out);
+
+// Counts the run and byte symbols of a RUN_LENGTHS block and builds their
+// code, none longer than maxCodeLength bits.
+void buildRunLengthModel(const unsigned char* contents, size_t size, int maxCodeLength, RunLengthModel& model);
+
+// Encodes one RUN_LENGTHS block into out, which has to hold
+// model.encodedSize bytes.
+void encodeRunLengthBlock(const unsigned char* contents, size_t size, const RunLengthModel& model, char* out);
+
+// Finds the matches of a MATCHES block at most windowSize bytes back, a
+// power of two, trying harder the higher level is, and builds the codes of
+// both alphabets, none longer than maxCodeLength bits. Matches never reach
+// back past the start of the block, so a window larger than size does no
+// more than one of size.
+void buildMatchModel(const unsigned char* contents, size_t size, int level, unsigned int windowSize,
+	int maxCodeLength, MatchModel& model);
+
+// Encodes one MATCHES block, the bytes at contents that model was built
+// from, into out, which has to hold model.encodedSize bytes.
+void encodeMatchBlock(const unsigned char* contents, const MatchModel& model, char* out);
+
+// Sorts the suffixes of the size bytes at contents into suffixArray in
+// linear time with SA-IS, a shorter suffix sorting before any it starts.
+void buildSuffixArray(const unsigned char* contents, size_t size, std::vector<int>& suffixArray);
+
+// Takes the Burrows-Wheeler transform of a BURROWS_WHEELER block of at
+// most MAX_TRANSFORM_BLOCK_SIZE bytes, move to front codes it and builds
+// the code of its symbols, none longer than maxCodeLength bits.
+void buildTransformModel(const unsigned char* contents, size_t size, int maxCodeLength, TransformModel& model);
+
+// Encodes one BURROWS_WHEELER block into out, which has to hold
+// model.encodedSize bytes.
+void encodeTransformBlock(const TransformModel& model, char* out);
+
+// Counts the glyphs of each segment of an interleaved block into
+// NUM_STREAMS tables of NUM_SYMBOLS frequencies, each with its end of file.
+void countSegmentGlyphs(const unsigned char* contents, size_t size, long long segmentFrequencies[]);
+
+// The size of each segment of an interleaved block but the last
+inline size_t segmentSize(size_t blockSize) {
+	return (blockSize + NUM_STREAMS - 1) / NUM_STREAMS;
+}
+
+// The most bytes compress can write for size bytes of input.
+size_t compressBound(size_t size);
+
+// Compresses size bytes at in to a canonical format stream with no file
+// name, or a stored format one when that is no larger, written straight
+// to out. Returns the number of bytes written, or 0 if they would not fit
+// in capacity. compressBound(size) bytes are always enough.
+size_t compress(const unsigned char* in, size_t size, unsigned char* out, size_t capacity,
+	int maxCodeLength = MAX_CODE_LENGTH);
+
+// Starts a stream format stream that stores storedName as its file name.
+void initEncoder(HuffEncoder& encoder, const std::string& storedName,
+	unsigned int blockSize = DEFAULT_STREAM_BLOCK_SIZE, int maxCodeLength = MAX_CODE_LENGTH);
+
+// Starts an adaptive format stream, which is coded in a single pass with
+// codes rebuilt at least every rebuildInterval bytes.
+void initAdaptiveEncoder(HuffEncoder& encoder, const std::string& storedName,
+	unsigned int rebuildInterval = DEFAULT_REBUILD_INTERVAL, int maxCodeLength = MAX_CODE_LENGTH);
+
+// Starts the model of an adaptive stream with every glyph counted once.
+void initAdaptiveModel(AdaptiveModel& model, unsigned int rebuildInterval, int maxCodeLength);
+
+// Counts the next size bytes of an adaptive stream, which must not run
+// past model.bytesUntilRebuild. Returns true if that rebuilt the code lengths.
+bool updateAdaptiveModel(AdaptiveModel& model, const unsigned char* data, size_t size);
+
+// Takes in the next inSize bytes of the stream and writes as much of the
+// compressed stream as there is room for to out. in, inSize, out and
+// outSize are moved past what was used. Returns HUFF_NEED_INPUT once all
+// of the input is taken, or HUFF_OUTPUT_FULL if out filled up first.
+HuffStatus feedEncoder(HuffEncoder& encoder, const unsigned char*& in, size_t& inSize,
+	unsigned char*& out, size_t& outSize);
+
+// Ends the stream and writes the rest of it to out. Returns HUFF_DONE once
+// all of it is written, or HUFF_OUTPUT_FULL to be called again.
+HuffStatus finishEncoder(HuffEncoder& encoder, unsigned char*& out, size_t& outSize);
+
+// Moves the lowest 32 bits of the bit buffer into out.
+inline void writeWord(BitWriter& writer) {
+	if (writer.outBufferIndex + sizeof(uint32_t) > writer.outSize)
+		makeRoom(writer);
+
+	char* out = writer.out + writer.outBufferIndex;
+	out[0] = (char)writer.bitBuffer;
+	out[1] = (char)(writer.bitBuffer >> 8);
+	out[2] = (char)(writer.bitBuffer >> 16);
+	out[3] = (char)(writer.bitBuffer >> 24);
+	writer.outBufferIndex += sizeof(uint32_t);
+	writer.bitBuffer >>= 32;
+	writer.bitCount -= 32;
+}
+
+// Appends a code to the writer. There are always fewer than 32 bits waiting
+// in the bit buffer, so any code of up to 32 bits fits with one OR.
+inline void writeCode(BitWriter& writer, const HuffmanCode& code) {
+	if (code.length > 32) {
+		writeCode(writer, HuffmanCode{ code.bits & 0xFFFFFFFF, 32 });
+		writeCode(writer, HuffmanCode{ code.bits >> 32, code.length - 32 });
+		return;
+	}
+
+	writer.bitBuffer |= code.bits << writer.bitCount;
+	writer.bitCount += code.length;
+	if (writer.bitCount >= 32)
+		writeWord(writer);
+}
+#pragma endregion encoding
+
+#pragma region decoding
+/*
+	each node in the reconstructed huffman table will consist
+	of a glyph, left child indicator and right child indicator.
+	glyph frequency is not included, as it does not matter
+	in the case of decompression.
+*/
+struct tableNode
+{
+	int glyph, leftChild, rightChild;
+};
+
+/*
+	each decode table is indexed by the next tableBits bits of the
+	encoded data (least significant bit first).  an entry holds every
+	glyph whose code is completely contained in those bits, so one
+	lookup can produce several glyphs.  when not even one code fits,
+	the entry instead points to a sub table that continues the walk
+	from the merge node that was reached.
+*/
+struct decodeEntry
+{
+	unsigned char symbols[MAX_SYMBOLS_PER_ENTRY];
+	unsigned char symbolCount = 0;
+	unsigned char bitsUsed = 0;
+	bool endOfFile = false;
+	int subTable = NO_SUB_TABLE;
+};
+
+struct decodeTable
+{
+	int tableBits;
+	std::vector<decodeEntry> entries;
+};
+
+/*
+	how far the decoder has got through one huffman coded stream.  it
+	is kept between calls so the encoded data can arrive in pieces.
+*/
+struct decodeState
+{
+	uint64_t bitBuffer = 0;
+	int bitsInBuffer = 0;
+	int currentTable = ROOT_TABLE;
+	bool endOfFile = false;
+};
+
+/*
+	everything in a .huf header up to the first huffman coded data.
+	the original format has its tree, the canonical format its code
+	lengths and the block format its block index along with the code
+	lengths when the blocks share them, and the adaptive format the
+	settings of its model, and the stored format the size of the file
+	stored after it.  size is the number of bytes the header takes up.
+*/
+struct HuffHeader
+{
+	unsigned char formatVersion = ORIGINAL_FORMAT;
+	std::string storedName;
+	std::vector<tableNode> huffTable;
+	int codeLengths[NUM_SYMBOLS];
+	unsigned char flags = 0;
+	std::vector<BlockIndexEntry> blockIndex;
+	unsigned int rebuildInterval = 0;
+	int maxCodeLength = MAX_CODE_LENGTH;
+	unsigned long long storedSize = 0;
+	size_t size = 0;
+};
+
+/*
+	decompresses a .huf stream of any format handed over a piece at a
+	time.  header holds the header once headerRead is set.
+*/
+struct HuffDecoder
+{
+	int stage = 0;
+	bool headerRead = false;
+	HuffHeader header;
+	std::vector<unsigned char> gathered;
+	size_t bytesNeeded = 0;
+	std::vector<tableNode> huffTable;
+	std::vector<decodeTable> decodeTables;
+	std::vector<decodeTable> sharedDecodeTables;
+	decodeState state;
+	size_t nextBlock = 0;
+	size_t treeBlock = 0;
+	unsigned long long blockOffset = 0;
+	unsigned long long blockBytesLeft = 0;
+	unsigned long long blockOriginalSize = 0;
+	unsigned long long blockBytesDecoded = 0;
+	unsigned char pendingSymbols[MAX_SYMBOLS_PER_ENTRY];
+	int pendingPosition = 0;
+	int pendingCount = 0;
+	std::vector<unsigned char> decodedBlock;
+	size_t decodedPosition = 0;
+	AdaptiveModel model;
+};
+
+/*
+	build the decode tables for a huffman table
+*/
+void buildDecodeTables(const tableNode* huffTable, std::vector<decodeTable>& decodeTables);
+
+/*
+	unpack the code lengths of a canonical header, or of numSymbols
+	symbols for the larger alphabets.  returns the number of bytes they
+	take up, or 0 if packed is too short.
+*/
+size_t unpackCodeLengths(const unsigned char* packed, size_t size, int codeLengths[], int numSymbols = NUM_SYMBOLS);
+
+/*
+	the number of bytes the packed code lengths take up, worked out
+	from their first CODE_LENGTHS_PREFIX_SIZE bytes
+*/
+size_t packedCodeLengthsSize(const unsigned char* prefix);
+
+/*
+	rebuild the huffman table that canonical codes describe.  returns
+	the number of entries used, or 0 if the code lengths are not a valid code.
+*/
+int buildTableFromCodeLengths(const int codeLengths[], tableNode* huffTable);
+
+/*
+	read a .huf header from the first size bytes of data.  returns
+	HUFF_NEED_INPUT with header.size set to the number of bytes needed
+	so far when data stops short of the end of the header.
+*/
+HuffStatus readHeader(const unsigned char* data, size_t size, HuffHeader& header);
+
+/*
+	decode glyphs from in into out until the end of file glyph, the end
+	of in, or until out has less than MAX_SYMBOLS_PER_ENTRY bytes of room
+	left.  in and out are moved past what was used.  returns true once
+	the end of file glyph has been decoded.
+*/
+bool decodeSymbols(const std::vector<decodeTable>& decodeTables, decodeState& state,
+	const unsigned char*& in, const unsigned char* inEnd, unsigned char*& out, unsigned char* outEnd);
+
+/*
+	the number of the block whose code lengths block number blockNumber
+	is coded with, when the blocks have the REUSED_TREES flag.  block
+	holds the first size bytes of the block.  returns false if it does
+	not name an earlier block.
+*/
+bool findTreeBlock(const unsigned char* block, size_t size, size_t blockNumber, size_t& treeBlock);
+
+/*
+	read the code lengths stored in a block into codeLengths.  block
+	holds the first size bytes of the block.  returns false if the block
+	stores none or they are not valid.
+*/
+bool readBlockCodeLengths(const unsigned char* block, size_t size, unsigned char flags, int codeLengths[]);
+
+/*
+	decode one whole block of a block format file with the given header
+	flags.  sharedTables are the decode tables the block is coded with
+	when they are built already: those of the shared tree, or with
+	REUSED_TREES those of the block it takes its code lengths from.
+	they are null when the block has its own code lengths, in which
+	case blockTables is used to build its tables.  out needs
+	MAX_SYMBOLS_PER_ENTRY bytes of room past the decoded block unless
+	its streams are interleaved.
+*/
+bool decodeBlock(const unsigned char* block, const BlockIndexEntry& indexEntry, unsigned char flags,
+	const std::vector<decodeTable>* sharedTables, std::vector<decodeTable>& blockTables, unsigned char* out);
+
+/*
+	get ready to decode a new stream, keeping the buffers of the last one
+*/
+void initDecoder(HuffDecoder& decoder);
+
+/*
+	take in the next inSize bytes of a .huf stream and decode as much as
+	there is room for into out.  in, inSize, out and outSize are moved
+	past what was used.  returns HUFF_NEED_INPUT once all of the input is
+	taken, HUFF_OUTPUT_FULL if out filled up first, HUFF_DONE at the end
+	of the stream or HUFF_INVALID_DATA.
+*/
+HuffStatus feedDecoder(HuffDecoder& decoder, const unsigned char*& in, size_t& inSize,
+	unsigned char*& out, size_t& outSize);
+
+/*
+	there is no more input, so write out what is left of the decoded
+	stream.  returns HUFF_DONE once all of it is written, HUFF_OUTPUT_FULL
+	to be called again, or HUFF_TRUNCATED if the stream was cut short.
+*/
+HuffStatus finishDecoder(HuffDecoder& decoder, unsigned char*& out, size_t& outSize);
+
+/*
+	decompress a whole .huf stream of any format from the size bytes at
+	in straight into out.  decompressedSize is set to the number of bytes
+	written.  returns HUFF_DONE, HUFF_OUTPUT_FULL if the stream does not
+	fit in capacity bytes, HUFF_INVALID_DATA or HUFF_TRUNCATED.  passing
+	the same decoder to every call saves allocating its tables each time.
+*/
+HuffStatus decompress(const unsigned char* in, size_t size, unsigned char* out, size_t capacity,
+	size_t& decompressedSize);
+HuffStatus decompress(HuffDecoder& decoder, const unsigned char* in, size_t size, unsigned char* out,
+	size_t capacity, size_t& decompressedSize);
+#pragma endregion decoding
+
+}
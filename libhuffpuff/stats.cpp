@@ -0,0 +1,167 @@
+// stats.cpp
+// Timing the phases of huff and Puff and printing what was measured.
+#include "stats.h"
+
+#include <algorithm>
+#include <ctime>
+#include <iomanip>
+#include <sstream>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+using namespace std;
+
+namespace huffpuff {
+
+#ifdef _WIN32
+double fileTimeSeconds(const FILETIME& kernelTime, const FILETIME& userTime) {
+	ULARGE_INTEGER kernel, user;
+	kernel.LowPart = kernelTime.dwLowDateTime;
+	kernel.HighPart = kernelTime.dwHighDateTime;
+	user.LowPart = userTime.dwLowDateTime;
+	user.HighPart = userTime.dwHighDateTime;
+	return (kernel.QuadPart + user.QuadPart) / 1e7;
+}
+#endif
+
+double threadCpuSeconds() {
+#ifdef _WIN32
+	FILETIME creationTime, exitTime, kernelTime, userTime;
+	if (!GetThreadTimes(GetCurrentThread(), &creationTime, &exitTime, &kernelTime, &userTime))
+		return 0;
+	return fileTimeSeconds(kernelTime, userTime);
+#elif defined(CLOCK_THREAD_CPUTIME_ID)
+	timespec now;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) != 0)
+		return 0;
+	return now.tv_sec + now.tv_nsec / 1e9;
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+// clock() measures wall time on Windows, so the process times are asked for there
+double processCpuSeconds() {
+#ifdef _WIN32
+	FILETIME creationTime, exitTime, kernelTime, userTime;
+	if (!GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime))
+		return 0;
+	return fileTimeSeconds(kernelTime, userTime);
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+void startTiming(HuffStats& stats) {
+	stats.phaseStart = chrono::steady_clock::now();
+	stats.phaseCpuStart = threadCpuSeconds();
+}
+
+void stopTiming(HuffStats& stats, const char* phase, bool onWorkerThreads) {
+	double wallSeconds = chrono::duration<double>(chrono::steady_clock::now() - stats.phaseStart).count();
+	double cpuTime = onWorkerThreads ? 0 : threadCpuSeconds() - stats.phaseCpuStart;
+
+	vector<StatsPhase>::iterator found = find_if(stats.phases.begin(), stats.phases.end(),
+		[&](const StatsPhase& existing) { return existing.name == phase; });
+	if (found == stats.phases.end()) {
+		stats.phases.push_back(StatsPhase{ phase });
+		found = stats.phases.end() - 1;
+	}
+	found->wallSeconds += wallSeconds;
+	found->cpuSeconds += cpuTime;
+	found->onWorkerThreads = onWorkerThreads;
+}
+
+void addCodeLengths(HuffStats& stats, const long long frequencies[], const int codeLengths[]) {
+	for (int glyph = 0; glyph < NUM_SYMBOLS; glyph++) {
+		if (codeLengths[glyph] == NO_CODE || frequencies[glyph] == 0)
+			continue;
+		stats.glyphUsed[glyph] = true;
+		stats.maxCodeLength = max(stats.maxCodeLength, codeLengths[glyph]);
+		stats.numCodedGlyphs += frequencies[glyph];
+		stats.numCodedBits += frequencies[glyph] * codeLengths[glyph];
+	}
+}
+
+string jsonString(const string& value) {
+	ostringstream escaped;
+	escaped << '"';
+	for (char c : value) {
+		if (c == '"' || c == '\\')
+			escaped << '\\' << c;
+		else if ((unsigned char)c < ' ')
+			escaped << "\\u" << hex << setw(4) << setfill('0') << (int)c << dec;
+		else
+			escaped << c;
+	}
+	escaped << '"';
+	return escaped.str();
+}
+
+int countGlyphsUsed(const HuffStats& stats) {
+	return (int)count(stats.glyphUsed, stats.glyphUsed + NUM_SYMBOLS, true);
+}
+
+double averageCodeLength(const HuffStats& stats) {
+	return stats.numCodedGlyphs > 0 ? (double)stats.numCodedBits / stats.numCodedGlyphs : 0;
+}
+
+void writeStatsText(ostream& out, const vector<HuffStats>& stats) {
+	out << fixed << setprecision(6);
+	for (const HuffStats& file : stats) {
+		out << file.fileName << ": " << file.bytesIn << " bytes in, " << file.bytesOut << " bytes out";
+		if (file.numCodedGlyphs > 0) {
+			out << ", " << countGlyphsUsed(file) << " glyphs, max code length " << file.maxCodeLength
+				<< ", average code length " << averageCodeLength(file);
+		}
+		out << endl;
+
+		for (const StatsPhase& phase : file.phases) {
+			out << "  " << left << setw(24) << phase.name << right << " wall " << phase.wallSeconds << " s, ";
+			if (phase.onWorkerThreads)
+				out << "cpu on worker threads, counted in the process cpu" << endl;
+			else
+				out << "cpu " << phase.cpuSeconds << " s" << endl;
+		}
+	}
+	out << "process cpu " << processCpuSeconds() << " s" << endl;
+}
+
+void writeStatsJson(ostream& out, const vector<HuffStats>& stats, const string& tool) {
+	out << setprecision(9);
+	out << "{\"tool\": " << jsonString(tool) << ", \"files\": [";
+	for (size_t i = 0; i < stats.size(); i++) {
+		const HuffStats& file = stats[i];
+		out << (i > 0 ? ", " : "") << "{\"file\": " << jsonString(file.fileName)
+			<< ", \"bytesIn\": " << file.bytesIn << ", \"bytesOut\": " << file.bytesOut;
+		if (file.numCodedGlyphs > 0) {
+			out << ", \"numGlyphs\": " << countGlyphsUsed(file) << ", \"maxCodeLength\": " << file.maxCodeLength
+				<< ", \"averageCodeLength\": " << averageCodeLength(file);
+		}
+
+		out << ", \"phases\": [";
+		for (size_t j = 0; j < file.phases.size(); j++) {
+			const StatsPhase& phase = file.phases[j];
+			out << (j > 0 ? ", " : "") << "{\"name\": " << jsonString(phase.name)
+				<< ", \"wallSeconds\": " << phase.wallSeconds;
+			if (phase.onWorkerThreads)
+				out << ", \"onWorkerThreads\": true}";
+			else
+				out << ", \"cpuSeconds\": " << phase.cpuSeconds << "}";
+		}
+		out << "]}";
+	}
+	out << "], \"processCpuSeconds\": " << processCpuSeconds() << "}" << endl;
+}
+
+void writeStats(ostream& out, const vector<HuffStats>& stats, const string& tool) {
+	if (!stats.empty() && stats.front().format == STATS_JSON)
+		writeStatsJson(out, stats, tool);
+	else
+		writeStatsText(out, stats);
+}
+
+}
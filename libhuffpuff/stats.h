@@ -0,0 +1,91 @@
+// stats.h
+// Timings and counters that huff and Puff report with --stats. Every call
+// returns straight away while stats are off, so leaving the calls in the
+// hot paths costs no more than a test of a flag.
+#pragma once
+
+#include "huffpuff.h"
+
+#include <chrono>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace huffpuff {
+
+// How the stats are printed, if at all
+const int STATS_OFF = 0;
+const int STATS_TEXT = 1;
+const int STATS_JSON = 2;
+
+// The time spent in one phase, added up over every time it ran. The CPU
+// time is that of the thread that timed the phase, so it leaves out other
+// files compressed at the same time. A phase run on worker threads has no
+// CPU time of its own; their work only shows in the process CPU time.
+struct StatsPhase {
+	std::string name;
+	double wallSeconds = 0;
+	double cpuSeconds = 0;
+	bool onWorkerThreads = false;
+};
+
+// The stats of one file. The code length counters are added up over every
+// tree the file was coded with.
+struct HuffStats {
+	int format = STATS_OFF;
+	std::string fileName;
+	std::vector<StatsPhase> phases;
+	unsigned long long bytesIn = 0;
+	unsigned long long bytesOut = 0;
+	bool glyphUsed[NUM_SYMBOLS] = {};
+	int maxCodeLength = 0;
+	unsigned long long numCodedGlyphs = 0;
+	unsigned long long numCodedBits = 0;
+
+	std::chrono::steady_clock::time_point phaseStart;
+	double phaseCpuStart = 0;
+};
+
+// CPU time used by the calling thread so far
+double threadCpuSeconds();
+
+// CPU time used by every thread of the process so far
+double processCpuSeconds();
+
+void startTiming(HuffStats& stats);
+void stopTiming(HuffStats& stats, const char* phase, bool onWorkerThreads);
+void addCodeLengths(HuffStats& stats, const long long frequencies[], const int codeLengths[]);
+
+// Starts timing a phase
+inline void startPhase(HuffStats& stats) {
+	if (stats.format != STATS_OFF)
+		startTiming(stats);
+}
+
+// Adds the time since startPhase to the named phase
+inline void endPhase(HuffStats& stats, const char* phase) {
+	if (stats.format != STATS_OFF)
+		stopTiming(stats, phase, false);
+}
+
+// Adds the wall time since startPhase to the named phase, which was handed
+// out to worker threads
+inline void endWorkerPhase(HuffStats& stats, const char* phase) {
+	if (stats.format != STATS_OFF)
+		stopTiming(stats, phase, true);
+}
+
+// Counts the glyphs and code lengths of one tree
+inline void countCodeLengths(HuffStats& stats, const long long frequencies[], const int codeLengths[]) {
+	if (stats.format != STATS_OFF)
+		addCodeLengths(stats, frequencies, codeLengths);
+}
+
+// Quotes and escapes value as a JSON string
+std::string jsonString(const std::string& value);
+
+// Prints the stats of every file for the named tool, then the CPU time of
+// the whole process
+void writeStats(std::ostream& out, const std::vector<HuffStats>& stats, const std::string& tool);
+
+}